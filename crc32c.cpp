@@ -0,0 +1,88 @@
+/**
+ * CRC32C checksums of the data sent between master and slaves.
+ * With SSE4.2 the crc32 instruction does 8 bytes at a time, three streams
+ * interleaved so the instruction latency is hidden, which is fast enough to
+ * check every frame inline. Other cpus use a lookup table.
+ */
+#include "crc32c.hpp"
+
+#include <nmmintrin.h>
+
+#include <cstring>
+
+#define POLY 0x82f63b78  // reflected castagnoli polynomial
+#define BLOCK 4096       // bytes per interleaved stream
+
+using namespace std;
+
+static uint32_t table[256];
+// shift a crc over BLOCK zero bytes, per byte of the crc
+static uint32_t shift_table[4][256];
+
+static uint32_t crc32c_sw(uint32_t crc, const char* p, size_t len) {
+    while (len--) {
+        crc = table[(crc ^ (uint8_t)*p++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+// multiply the crc by x^(8 * BLOCK) modulo the polynomial
+static uint32_t shift(uint32_t crc) {
+    return shift_table[0][crc & 0xff] ^ shift_table[1][(crc >> 8) & 0xff] ^ shift_table[2][(crc >> 16) & 0xff] ^
+           shift_table[3][crc >> 24];
+}
+
+__attribute__((target("sse4.2"))) static uint32_t crc32c_hw(uint32_t crc, const char* p, size_t len) {
+    // three blocks at a time, the crcs of the first two are shifted over the blocks after them
+    while (len >= 3 * BLOCK) {
+        uint64_t crc0 = crc, crc1 = 0, crc2 = 0;
+        for (int i = 0; i < BLOCK; i += 8) {
+            uint64_t v0, v1, v2;
+            memcpy(&v0, p + i, 8);
+            memcpy(&v1, p + BLOCK + i, 8);
+            memcpy(&v2, p + 2 * BLOCK + i, 8);
+            crc0 = _mm_crc32_u64(crc0, v0);
+            crc1 = _mm_crc32_u64(crc1, v1);
+            crc2 = _mm_crc32_u64(crc2, v2);
+        }
+        crc = shift(shift((uint32_t)crc0) ^ (uint32_t)crc1) ^ (uint32_t)crc2;
+        p += 3 * BLOCK;
+        len -= 3 * BLOCK;
+    }
+    uint64_t crc64 = crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        crc64 = _mm_crc32_u64(crc64, v);
+    }
+    crc = crc64;
+    for (; len > 0; p++, len--) {
+        crc = _mm_crc32_u8(crc, *p);
+    }
+    return crc;
+}
+
+static bool init() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int k = 0; k < 8; k++) {
+            crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+        }
+        table[i] = crc;
+    }
+    // feeding BLOCK zero bytes into a crc is linear in the crc, so tabulate it per byte
+    static char zeros[BLOCK];
+    for (int b = 0; b < 4; b++) {
+        for (uint32_t i = 0; i < 256; i++) {
+            shift_table[b][i] = crc32c_sw(i << (8 * b), zeros, BLOCK);
+        }
+    }
+    return __builtin_cpu_supports("sse4.2");
+}
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t len) {
+    static bool hardware = init();
+    crc = ~crc;
+    crc = hardware ? crc32c_hw(crc, (const char*)data, len) : crc32c_sw(crc, (const char*)data, len);
+    return ~crc;
+}
\ No newline at end of file
@@ -0,0 +1,7 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// crc32c (castagnoli) of len bytes, continuing from crc, with the sse4.2 instruction when the cpu has it
+uint32_t crc32c(uint32_t crc, const void* data, size_t len);
\ No newline at end of file
@@ -0,0 +1,109 @@
+#include "exchange.hpp"
+
+#include <unistd.h>
+
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define PRESSURE_CHECK_BYTES 67108864  // 64 MB appended between checks of the available memory
+#define LOW_MEMORY_PERCENT 10          // spill once less than this share of the memory is available
+
+using namespace std;
+
+// share of the memory that is still available, in percent
+static int available_memory_percent() {
+    ifstream meminfo("/proc/meminfo");
+    string key, unit;
+    long long value, total = 0, available = -1;
+    while (meminfo >> key >> value >> unit) {
+        if (key == "MemTotal:") {
+            total = value;
+        } else if (key == "MemAvailable:") {
+            available = value;
+        }
+    }
+    if (total == 0 || available < 0) {
+        return 100;
+    }
+    return available * 100 / total;
+}
+
+ExchangeBuffer::ExchangeBuffer(string file_name, long long memory_budget)
+    : file_name(file_name), file(file_name, ios::out | ios::binary), memory_budget(memory_budget), buffered(0), total(0), spilled(0), unchecked(0), throttle(nullptr) {}
+
+ExchangeBuffer::~ExchangeBuffer() {}
+
+void ExchangeBuffer::spill() {
+    for (int i = 0; i < blocks.size(); i++) {
+        if (throttle != nullptr) {
+            throttle->disk(blocks[i].size());
+        }
+        file.write(blocks[i].data(), blocks[i].size());
+    }
+    spilled += buffered;
+    blocks.clear();
+    buffered = 0;
+}
+
+void ExchangeBuffer::set_throttle(Throttle* throttle) {
+    this->throttle = throttle;
+}
+
+void ExchangeBuffer::append(const char* data, size_t len) {
+    lock_guard<mutex> lock(mtx);
+    blocks.push_back(vector<char>(data, data + len));
+    buffered += len;
+    total += len;
+    unchecked += len;
+    // reading /proc/meminfo costs more than a few appends, so only look now and then
+    bool check = unchecked >= PRESSURE_CHECK_BYTES;
+    if (check) {
+        unchecked = 0;
+    }
+    if (buffered > memory_budget || (check && available_memory_percent() < LOW_MEMORY_PERCENT)) {
+        spill();
+    }
+}
+
+void ExchangeBuffer::truncate(long long size) {
+    lock_guard<mutex> lock(mtx);
+    while (!blocks.empty() && total - (long long)blocks.back().size() >= size) {
+        total -= blocks.back().size();
+        buffered -= blocks.back().size();
+        blocks.pop_back();
+    }
+    if (total > size && !blocks.empty()) {
+        blocks.back().resize(blocks.back().size() - (total - size));
+        buffered -= total - size;
+        total = size;
+    }
+    // the rest of the records to drop were spilled already
+    if (total > size) {
+        file.flush();
+        if (::truncate(file_name.c_str(), size) != 0) {
+            file.setstate(ios::badbit);
+        }
+        file.seekp(size);
+        spilled = size;
+        total = size;
+    }
+}
+
+void ExchangeBuffer::finish() {
+    lock_guard<mutex> lock(mtx);
+    long long spilled_early = spilled;
+    spill();
+    file.close();
+    printf("Exchange received %.2f MB, %.2f MB spilled under memory pressure.\n", total / 1024.0 / 1024.0, spilled_early / 1024.0 / 1024.0);
+}
+
+long long ExchangeBuffer::size() {
+    lock_guard<mutex> lock(mtx);
+    return total;
+}
+
+int exchange_send_peer(int slave_id, int slave_num, int round) {
+    return (slave_id + round) % slave_num;
+}
\ No newline at end of file
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "throttle.hpp"
+
+#define EXCHANGE_MEMORY 268435456  // 256 MB of received data kept in memory
+
+// collects the records a slave receives from its peers in the exchange mode.
+// The records stay in memory until the budget is used up or the machine runs
+// low on memory, then they are spilled to the file the slave sorts later.
+class ExchangeBuffer {
+   public:
+    ExchangeBuffer(std::string file_name, long long memory_budget = EXCHANGE_MEMORY);
+    ~ExchangeBuffer();
+    // the records are kept as one block, so append them in large blocks
+    void append(const char* data, size_t len);
+    // drop what was appended after the buffer held size bytes, like the records of a corrupt stream
+    void truncate(long long size);
+    // hold the spills to the disk limits of the job
+    void set_throttle(Throttle* throttle);
+    // spill what is left in memory and close the file
+    void finish();
+    long long size();
+
+   private:
+    std::mutex mtx;
+    std::string file_name;
+    std::ofstream file;
+    std::vector<std::vector<char>> blocks;
+    long long memory_budget;
+    long long buffered;
+    long long total;
+    long long spilled;
+    long long unchecked;  // appended since the last check of the available memory
+    Throttle* throttle;
+    void spill();
+};
+
+// the peer a slave sends to in each round, every receiver gets exactly one sender per round
+int exchange_send_peer(int slave_id, int slave_num, int round);
\ No newline at end of file
@@ -1,7 +1,5 @@
 #include "external_sort.hpp"
 
-#include <sys/stat.h>
-
 #include <algorithm>
 #include <chrono>
 #include <cstring>
@@ -11,6 +9,8 @@
 #include <string>
 #include <vector>
 
+#include "storage.hpp"
+
 #define DATA_SIZE 100
 #define MEMORY_SIZE 100000000  // 100 MB
 #define error_message "An error has occurred\n"
@@ -41,29 +41,32 @@ struct Comparator {
 };
 
 int ExternalSort::input() {
-    ifstream input;
-    input.open(inputName, ios::in | ios::binary);
+    // the input is a file or an object, read front to back
+    Storage& storage = Storage::of(inputName);
+    FileReader* input = storage.open_range(inputName);
 
-    if (!input.good()) {
+    if (!input->good()) {
         printf("Fail to open input file.\n");
+        delete input;
         return 1;
     }
 
     // print file size in GB
-    struct stat stat_buf;
-    int rc = stat(inputName.c_str(), &stat_buf);
-    double file_size = rc == 0 ? stat_buf.st_size : -1;
+    double file_size = storage.size(inputName);
     printf("file size: %.2f GB\n", file_size / 1024.0 / 1024.0 / 1024.0);
 
     ofstream output;
     int part_num = 0;
     char* buffer = new char[MEMORY_SIZE];
-    while (!input.eof()) {
-        input.read(buffer, MEMORY_SIZE);
+    while (true) {
+        ssize_t read_size = input->read(buffer, MEMORY_SIZE);
+        if (read_size <= 0) {
+            break;
+        }
 
         // convert the buffer to record vector
         vector<Record> buffer_vector;
-        for (int i = 0; i < input.gcount() / DATA_SIZE; i++) {
+        for (int i = 0; i < read_size / DATA_SIZE; i++) {
             Record r;
             memcpy(r.value, buffer + i * DATA_SIZE, DATA_SIZE);
             buffer_vector.push_back(r);
@@ -85,14 +88,14 @@ int ExternalSort::input() {
         part_num++;
     }
     delete[] buffer;
-    input.close();
+    delete input;
 
     return 0;
 }
 
 // k-way merge
 void ExternalSort::merge() {
-    ofstream output(outputName, ios::out | ios::binary);
+    FileWriter* output = Storage::of(outputName).create(outputName);
     priority_queue<HeapNode*, vector<HeapNode*>, Comparator> heap;
 
     // open all the part files
@@ -116,7 +119,7 @@ void ExternalSort::merge() {
     while (!heap.empty()) {
         HeapNode* node = heap.top();
         heap.pop();
-        output.write(node->value, DATA_SIZE);
+        output->write(node->value, DATA_SIZE);
 
         // read the next record of the part file
         // if the part file is not empty, push the record to the heap
@@ -133,7 +136,10 @@ void ExternalSort::merge() {
     for (int i = 0; i < part_files.size(); i++) {
         part_files[i].close();
     }
-    output.close();
+    if (!output->close()) {
+        printf("Fail to write output file.\n");
+    }
+    delete output;
 }
 
 int ExternalSort::run() {
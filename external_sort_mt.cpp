@@ -1,5 +1,6 @@
 #include "external_sort_mt.hpp"
 
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -7,108 +8,220 @@
 #include <chrono>
 #include <cstring>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <queue>
 #include <string>
 #include <thread>
 #include <vector>
 
+#include "forecast.hpp"
+#include "mapped_file.hpp"
+#include "merge.hpp"
+#include "pool.hpp"
+#include "quantile_sketch.hpp"
+#include "scratch.hpp"
+#include "storage.hpp"
+#include "throttle.hpp"
+
 #define MEMORY_SIZE 100000000  // 100 MB
+#define SPILL_DEPTH 16         // blocks in flight while reading the input and writing a run
 
 using namespace std;
 
-ExternalSortMT::ExternalSortMT(string inputName, string outputName) : inputName(inputName), outputName(outputName) {}
+static bool bounded_footprint = false;
+
+ExternalSortMT::ExternalSortMT(string inputName, string outputName, bool range_partition)
+    : inputName(inputName), outputName(outputName), input_size(0), range_partition(range_partition), runs_in_input(false), throttle(nullptr) {}
 ExternalSortMT::~ExternalSortMT() {}
 
-void ExternalSortMT::thread_process(long long cur_pos, long long size, int thread_id) {
-    ifstream input;
-    input.open(inputName, ios::in | ios::binary);
-    if (!input.good()) {
+FileSink::FileSink(string name, long long size) : output(Storage::of(name).create(name, size)) {}
+
+FileSink::~FileSink() {
+    delete output;
+}
+
+bool FileSink::write(const char* data, size_t len) {
+    return output->write(data, len);
+}
+
+bool FileSink::close() {
+    return output->close();
+}
+
+// a record of the run being sorted, with the first bytes of its key in front
+// of it so that most comparisons stay in the tag array
+struct Tag {
+    uint64_t prefix;
+    const char* record;
+};
+
+static Tag make_tag(const char* record) {
+    uint64_t prefix;
+    memcpy(&prefix, record, sizeof(prefix));
+    return Tag{__builtin_bswap64(prefix), record};
+}
+
+static bool tag_less(const Tag& a, const Tag& b) {
+    if (a.prefix != b.prefix) {
+        return a.prefix < b.prefix;
+    }
+    return memcmp(a.record + sizeof(a.prefix), b.record + sizeof(b.prefix), DATA_SIZE - sizeof(a.prefix)) < 0;
+}
+
+void ExternalSortMT::set_footprint(bool bounded) {
+    bounded_footprint = bounded;
+}
+
+bool ExternalSortMT::footprint() {
+    return bounded_footprint;
+}
+
+bool ExternalSortMT::thread_process(long long cur_pos, long long size, int thread_id) {
+    // a slice that fits in memory and is not on a rotational disk is mapped and its runs are sorted in place,
+    // else it is read into a buffer with many blocks in flight. the runs of a
+    // bounded footprint overwrite the slice, so they are sorted in the buffer.
+    // an object is read with ranged GETs of its own
+    MappedReader* mapped = nullptr;
+    FileReader* input;
+    if (!Storage::local(inputName)) {
+        input = Storage::of(inputName).open_range(inputName, cur_pos, cur_pos + size);
+    } else if (mappable(inputName, size) && !bounded_footprint) {
+        mapped = new MappedReader(inputName, cur_pos, cur_pos + size);
+        input = mapped;
+    } else {
+        input = new BlockReader(inputName, cur_pos, cur_pos + size, SPILL_DEPTH);
+    }
+    if (!input->good()) {
         printf("Fail to open input file.\n");
-        return;
+        delete input;
+        return false;
     }
 
-    // collect the part names for the thread
-    vector<string> thread_part_names;
+    // collect the runs of the thread
+    vector<RunRange> thread_part_names;
 
     // read the data from the input file
-    char* buffer = new char[MEMORY_SIZE];
-    input.seekg(cur_pos, ios::beg);
+    char* buffer = mapped == nullptr ? BufferPool::instance().acquire(MEMORY_SIZE) : nullptr;
+    vector<Tag> tags;
+    long long done = 0;
     int part_num = 0;
+    bool ok = true;
     while (size > 0) {
-        if (size < MEMORY_SIZE)
-            input.read(buffer, size);
-        else
-            input.read(buffer, MEMORY_SIZE);
-        int read_size = input.gcount();
-
-        // convert the buffer to record vector
-        vector<Record> buffer_vector;
-        for (int i = 0; i < read_size / DATA_SIZE; i++) {
-            Record r;
-            memcpy(r.value, buffer + i * DATA_SIZE, DATA_SIZE);
-            buffer_vector.push_back(r);
-        }
-
-        // sort the buffer
-        sort(buffer_vector.begin(), buffer_vector.end(), [](const Record& r1, const Record& r2) {
-            return memcmp(r1.value, r2.value, DATA_SIZE) < 0;
-        });
-
-        // write the sorted buffer to the output file
-        // folder for thread output
-        string thread_output_folder = string("thread") + to_string(thread_id);
-        // create the folder if not exist
-        if (access(thread_output_folder.c_str(), F_OK) == -1) {
-            mkdir(thread_output_folder.c_str(), 0777);
+        size_t read_size = 0;
+        const char* records = buffer;
+        if (mapped != nullptr) {
+            records = mapped->next(min(size, (long long)MEMORY_SIZE), read_size);
+        } else {
+            read_size = max(input->read(buffer, min(size, (long long)MEMORY_SIZE)), (ssize_t)0);
         }
-
-        ofstream output;
-        string part_name = thread_output_folder + "/" + string("part") + "_" + to_string(part_num);
-        thread_part_names.push_back(part_name);
-        output.open(part_name, ios::out | ios::binary);
+        if (read_size == 0) {
+            printf("Fail to read input file.\n");
+            ok = false;
+            break;
+        }
+        disk(read_size);
+
+        // sort tags of the records, the records stay where they are
+        tags.resize(read_size / DATA_SIZE);
+        for (size_t i = 0; i < tags.size(); i++) {
+            tags[i] = make_tag(records + i * DATA_SIZE);
+            if (range_partition) {
+                sketches[thread_id]->update(records + i * DATA_SIZE);
+            }
+        }
+        sort(tags.begin(), tags.end(), tag_less);
+
+        // write the sorted buffer to a run in one of the scratch directories,
+        // or back over the records it was read from
+        long long run_begin = cur_pos + done;
+        string part_name = inputName;
+        if (!runs_in_input) {
+            part_name = Scratch::instance().path(string("thread") + to_string(thread_id) + ".part_" + to_string(part_num),
+                                                 read_size);
+            run_begin = 0;
+        }
+        thread_part_names.push_back(RunRange{part_name, run_begin / DATA_SIZE, (long long)(run_begin + read_size) / DATA_SIZE});
+        BlockWriter output(part_name, run_begin, !runs_in_input, SPILL_DEPTH);
         if (!output.good()) {
             printf("Fail to open output file.\n");
-            return;
+            ok = false;
+            break;
+        }
+        disk(tags.size() * DATA_SIZE);
+        for (size_t i = 0; ok && i < tags.size(); i++) {
+            ok = output.write(tags[i].record, DATA_SIZE);
         }
-        for (int i = 0; i < buffer_vector.size(); i++) {
-            output.write(buffer_vector[i].value, DATA_SIZE);
+        if (!ok) {
+            printf("Fail to write output file.\n");
+            break;
+        }
+        if (!output.close()) {
+            printf("Fail to write output file.\n");
+            ok = false;
+            break;
+        }
+
+        // the pages of the run are written, drop them from the mapping
+        done += read_size;
+        if (mapped != nullptr) {
+            mapped->release(done);
         }
-        output.close();
         size -= read_size;
         part_num++;
     }
-    delete[] buffer;
-    input.close();
+    if (buffer != nullptr) {
+        BufferPool::instance().release(buffer, MEMORY_SIZE);
+    }
+    delete input;
+    if (!ok) {
+        remove_runs(thread_part_names);
+        return false;
+    }
+
+    // the runs are merged by key range once all threads are done
+    if (range_partition) {
+        thread_runs[thread_id] = thread_part_names;
+        return true;
+    }
 
     // merge the thread result
-    thread_merge(thread_part_names, thread_id);
+    return thread_merge(thread_part_names, thread_id);
 }
 
-// k-way merge
-void ExternalSortMT::thread_merge(vector<string>& thread_part_names, int thread_id) {
-    // output the thread result
-    ofstream output(string("part") + "_" + to_string(thread_id), ios::out | ios::binary);
-    priority_queue<HeapNode*, vector<HeapNode*>, Comparator> heap;
+// the runs of a bounded footprint are in the input, they go with it
+void ExternalSortMT::remove_runs(const vector<RunRange>& runs) {
+    for (int i = 0; i < runs.size() && !runs_in_input; i++) {
+        Scratch::instance().remove(runs[i].name);
+    }
+}
 
-    // open all the part files
-    vector<ifstream> part_files;
+// k-way merge, false if the thread result could not be written
+bool ExternalSortMT::thread_merge(vector<RunRange>& thread_part_names, int thread_id) {
+    // output the thread result next to its runs, or wherever there is room once they are written
+    long long size = 0;
     for (int i = 0; i < thread_part_names.size(); i++) {
-        ifstream part_file(thread_part_names[i], ios::in | ios::binary);
-        part_files.push_back(move(part_file));
+        size += (thread_part_names[i].end - thread_part_names[i].begin) * DATA_SIZE;
     }
+    thread_outputs[thread_id] = Scratch::instance().path(string("part") + "_" + to_string(thread_id), size);
+    BlockWriter output(thread_outputs[thread_id]);
+    priority_queue<HeapNode*, vector<HeapNode*>, Comparator> heap;
+
+    // open all the part files, mapped or read ahead of the merge
+    vector<FileReader*> part_files;
+    ForecastReader* forecast = open_runs(thread_part_names, part_files, bounded_footprint);
 
     // read the first record of each part file
     char buffer[DATA_SIZE];
     for (int i = 0; i < part_files.size(); i++) {
-        part_files[i].read(buffer, DATA_SIZE);
-        if (part_files[i].gcount() > 0) {
+        if (part_files[i]->read(buffer, DATA_SIZE) == DATA_SIZE) {
             HeapNode* node = new HeapNode(i, buffer);
             heap.push(node);
         }
     }
 
     // get the smallest record from the heap and write it to the output file
+    DiskMeter meter(throttle);
     while (!heap.empty()) {
         HeapNode* node = heap.top();
         heap.pop();
@@ -116,8 +229,8 @@ void ExternalSortMT::thread_merge(vector<string>& thread_part_names, int thread_
 
         // read the next record of the part file
         // if the part file is not empty, push the record to the heap
-        part_files[node->index].read(buffer, DATA_SIZE);
-        if (part_files[node->index].gcount() > 0) {
+        meter.add(2 * DATA_SIZE);
+        if (part_files[node->index]->read(buffer, DATA_SIZE) == DATA_SIZE) {
             HeapNode* next_node = new HeapNode(node->index, buffer);
             heap.push(next_node);
         }
@@ -126,48 +239,53 @@ void ExternalSortMT::thread_merge(vector<string>& thread_part_names, int thread_
 
     // close all the part files
     for (int i = 0; i < part_files.size(); i++) {
-        part_files[i].close();
+        delete part_files[i];
     }
-    output.close();
-
-    // remove the part files and the folder
-    for (int i = 0; i < thread_part_names.size(); i++) {
-        remove(thread_part_names[i].c_str());
+    delete forecast;
+    bool written = output.close();
+    if (!written) {
+        printf("Fail to write output file.\n");
+        Scratch::instance().remove(thread_outputs[thread_id]);
     }
-    remove((string("thread") + to_string(thread_id)).c_str());
+
+    // remove the part files, the runs in the input go with it
+    remove_runs(thread_part_names);
+    return written;
 }
 
-void ExternalSortMT::merge() {
-    ofstream output(outputName, ios::out | ios::binary);
+bool ExternalSortMT::merge(OutputSink* sink) {
     priority_queue<HeapNode*, vector<HeapNode*>, Comparator> heap;
 
-    // open all the part files
-    vector<ifstream> part_files;
-    for (int i = 0; i < part_names.size(); i++) {
-        ifstream part_file(part_names[i], ios::in | ios::binary);
-        part_files.push_back(move(part_file));
-    }
+    // open all the part files, mapped or read ahead of the merge
+    vector<FileReader*> part_files;
+    ForecastReader* forecast = open_runs(part_names, part_files, bounded_footprint);
 
     // read the first record of each part file
     char buffer[DATA_SIZE];
     for (int i = 0; i < part_files.size(); i++) {
-        part_files[i].read(buffer, DATA_SIZE);
-        if (part_files[i].gcount() > 0) {
+        if (part_files[i]->read(buffer, DATA_SIZE) == DATA_SIZE) {
             HeapNode* node = new HeapNode(i, buffer);
             heap.push(node);
         }
     }
 
     // get the smallest record from the heap and write it to the output file
+    bool written = true;
+    DiskMeter meter(throttle);
     while (!heap.empty()) {
         HeapNode* node = heap.top();
         heap.pop();
-        output.write(node->value, DATA_SIZE);
+        if (!sink->write(node->value, DATA_SIZE)) {
+            printf("Fail to write the merged output.\n");
+            written = false;
+            delete node;
+            break;
+        }
 
         // read the next record of the part file
         // if the part file is not empty, push the record to the heap
-        part_files[node->index].read(buffer, DATA_SIZE);
-        if (part_files[node->index].gcount() > 0) {
+        meter.add(DATA_SIZE);
+        if (part_files[node->index]->read(buffer, DATA_SIZE) == DATA_SIZE) {
             HeapNode* next_node = new HeapNode(node->index, buffer);
             heap.push(next_node);
         }
@@ -177,31 +295,204 @@ void ExternalSortMT::merge() {
 
     // close all the part files
     for (int i = 0; i < part_files.size(); i++) {
-        part_files[i].close();
+        delete part_files[i];
+    }
+    if (forecast != nullptr) {
+        printf("merge read ahead: %d runs, %lld stalls\n", (int)part_names.size(), forecast->stalls());
+    }
+    delete forecast;
+    while (!heap.empty()) {
+        delete heap.top();
+        heap.pop();
+    }
+    return written;
+}
+
+void ExternalSortMT::set_throttle(Throttle* throttle) {
+    this->throttle = throttle;
+}
+
+void ExternalSortMT::disk(size_t bytes) {
+    if (throttle != nullptr) {
+        throttle->disk(bytes);
+    }
+}
+
+void ExternalSortMT::add_part(string part_name) {
+    part_names.push_back(part_name);
+}
+
+void ExternalSortMT::remove_parts() {
+    for (int i = 0; i < part_names.size(); i++) {
+        Scratch::instance().remove(part_names[i]);
     }
-    output.close();
+    part_names.clear();
+}
+
+// split the keys into one range per thread using the merged sketches,
+// then every thread merges its range of all the runs straight into the output,
+// false if the output could not be written
+bool ExternalSortMT::merge_by_range(int num_threads) {
+    for (int i = 1; i < sketches.size(); i++) {
+        sketches[0]->merge(*sketches[i]);
+    }
+    vector<string> splitters = sketches[0]->splitters(num_threads);
+    num_threads = splitters.size() + 1;
+
+    // find where each range starts and ends in every run
+    vector<RunRange> runs;
+    for (int i = 0; i < thread_runs.size(); i++) {
+        runs.insert(runs.end(), thread_runs[i].begin(), thread_runs[i].end());
+    }
+    vector<vector<long long>> bounds(runs.size());
+    for (int r = 0; r < runs.size(); r++) {
+        bounds[r].push_back(runs[r].begin);
+        for (int j = 0; j < splitters.size(); j++) {
+            bounds[r].push_back(run_lower_bound(runs[r], splitters[j]));
+        }
+        bounds[r].push_back(runs[r].end);
+    }
+
+    // each range is written at its offset of the output file
+    vector<long long> range_records(num_threads, 0);
+    for (int r = 0; r < runs.size(); r++) {
+        for (int j = 0; j < num_threads; j++) {
+            range_records[j] += bounds[r][j + 1] - bounds[r][j];
+        }
+    }
+    long long total_records = 0, max_records = 0;
+    for (int j = 0; j < num_threads; j++) {
+        total_records += range_records[j];
+        max_records = max(max_records, range_records[j]);
+    }
+    printf("key ranges: %d, largest range %.1f%% above the average\n", num_threads,
+           total_records > 0 ? (max_records * num_threads * 100.0 / total_records - 100) : 0.0);
+
+    // the whole output is allocated before the ranges are written into it at the same time,
+    // with a bounded footprint it takes the space the merges punch out of the runs as it goes.
+    // an object cannot be written at offsets, it is put together in scratch and uploaded
+    string target = Storage::local(outputName) ? outputName : Scratch::instance().path("staged.output", total_records * DATA_SIZE);
+    int out_fd = open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0 || ((bounded_footprint || fallocate(out_fd, 0, 0, total_records * DATA_SIZE) != 0) &&
+                       ftruncate(out_fd, total_records * DATA_SIZE) != 0)) {
+        printf("Fail to open output file.\n");
+        if (out_fd >= 0) {
+            close(out_fd);
+            Scratch::instance().remove(target);
+        }
+        for (int r = 0; r < runs.size(); r++) {
+            Scratch::instance().remove(runs[r].name);
+        }
+        return false;
+    }
+    close(out_fd);
+
+    vector<function<void()>> tasks;
+    vector<char> merged(num_threads, false);
+    long long output_offset = 0;
+    for (int j = 0; j < num_threads; j++) {
+        vector<RunRange> ranges;
+        for (int r = 0; r < runs.size(); r++) {
+            if (bounds[r][j + 1] > bounds[r][j]) {
+                ranges.push_back(RunRange{runs[r].name, bounds[r][j], bounds[r][j + 1]});
+            }
+        }
+        string output_name = target;
+        bool consume = bounded_footprint;
+        tasks.push_back([ranges, output_name, output_offset, consume, &merged, j] {
+            merged[j] = merge_ranges(ranges, output_name, output_offset, consume);
+        });
+        output_offset += range_records[j] * DATA_SIZE;
+    }
+    ThreadPool::instance().run(tasks);
+
+    // remove the runs
+    for (int r = 0; r < runs.size(); r++) {
+        Scratch::instance().remove(runs[r].name);
+    }
+    if (find(merged.begin(), merged.end(), false) != merged.end()) {
+        Scratch::instance().remove(target);
+        return false;
+    }
+    if (target != outputName) {
+        bool copied = Storage::copy(target, outputName);
+        Scratch::instance().remove(target);
+        if (!copied) {
+            printf("Fail to write output file.\n");
+            return false;
+        }
+    }
+    return true;
 }
 
 int ExternalSortMT::run() {
     auto start = chrono::high_resolution_clock::now();
 
+    // in range partition mode the threads already merged their ranges into the output
+    if (!sort_parts()) {
+        printf("Fail to sort the input.\n");
+        return 1;
+    }
+    if (!range_partition) {
+        // a bounded footprint has no room for the whole output next to the parts
+        FileSink sink(outputName, bounded_footprint ? 0 : input_size);
+        bool merged = merge(&sink);
+        merged = sink.close() && merged;
+        remove_parts();
+        if (!merged) {
+            printf("Fail to write the merged output.\n");
+            return 1;
+        }
+    }
+
+    auto end = chrono::high_resolution_clock::now();
+    string devices = IoEngine::instance().describe();
+    if (!devices.empty()) {
+        printf("io devices: %s\n", devices.c_str());
+    }
+    printf("execution time: %.3f seconds\n", chrono::duration_cast<chrono::milliseconds>(end - start).count() / 1000.0);
+
+    return 0;
+}
+
+bool ExternalSortMT::sort_parts() {
     // number of the process cores
     int num_cores = thread::hardware_concurrency();
     int num_threads = num_cores + 2;
     printf("number of cores: %d\n", num_cores);
 
     // print file size in GB
-    struct stat stat_buf;
-    int rc = stat(inputName.c_str(), &stat_buf);
-    long long file_size = rc == 0 ? stat_buf.st_size : -1;
+    long long file_size = Storage::of(inputName).size(inputName);
+    input_size = max(file_size, 0LL);
+    bool local = Storage::local(inputName);
+    runs_in_input = bounded_footprint && local;
+    printf("io engine: %s%s%s%s\n", IoEngine::instance().name(), local ? "" : ", input in the object store",
+           IoEngine::direct() ? ", direct io" : local && mappable(inputName, file_size) && !bounded_footprint ? ", mapped input" : "",
+           bounded_footprint ? ", bounded footprint" : "");
     printf("file size: %.2f GB\n", file_size / 1024.0 / 1024.0 / 1024.0);
+    string scratch = Scratch::instance().describe();
+    if (!scratch.empty()) {
+        printf("scratch: %s\n", scratch.c_str());
+    }
 
     // calculate the number of records per thread
     long long num_records = file_size / DATA_SIZE;
     long long num_records_per_thread = num_records / num_threads;
     int num_remaining_records = num_records % num_threads;
 
-    vector<thread> threads;
+    if (range_partition) {
+        thread_runs.assign(num_threads, vector<RunRange>());
+        for (int i = 0; i < num_threads; i++) {
+            sketches.push_back(new QuantileSketch(DATA_SIZE));
+        }
+    }
+
+    // every thread merges its runs into a part of its own
+    thread_outputs.assign(range_partition ? 0 : num_threads, string());
+
+    // the threads come from the pool, so a long running slave reuses them
+    vector<function<void()>> tasks;
+    vector<char> processed(num_threads, false);
     long long cur_pos = 0;
     for (int i = 0; i < num_threads; i++) {
         long long size = num_records_per_thread * DATA_SIZE;
@@ -209,33 +500,47 @@ int ExternalSortMT::run() {
             size += DATA_SIZE;
             num_remaining_records--;
         }
-        threads.push_back(thread(&ExternalSortMT::thread_process, this, cur_pos, size, i));
+        tasks.push_back([this, cur_pos, size, i, &processed] { processed[i] = thread_process(cur_pos, size, i); });
         cur_pos += size;
     }
 
-    // wait for all the threads to finish
-    for (int i = 0; i < threads.size(); i++) {
-        threads[i].join();
+    // wait for all the threads to finish, a failed thread removed what it wrote, the others leave their runs or part
+    ThreadPool::instance().run(tasks);
+    bool sorted = find(processed.begin(), processed.end(), false) == processed.end();
+    if (!sorted) {
+        for (int i = 0; i < thread_runs.size(); i++) {
+            remove_runs(thread_runs[i]);
+        }
+        for (int i = 0; i < thread_outputs.size(); i++) {
+            if (processed[i]) {
+                Scratch::instance().remove(thread_outputs[i]);
+            }
+        }
     }
 
-    // get the part file names
-    for (int i = 0; i < num_threads; i++) {
-        part_names.push_back(string("part") + "_" + to_string(i));
+    // the runs of a bounded footprint are in the input, it goes with them.
+    // an input in the object store stays where it is
+    if (range_partition) {
+        if (sorted && !runs_in_input && local) {
+            Scratch::instance().remove(inputName);
+        }
+        sorted = sorted && merge_by_range(num_threads);
+        for (int i = 0; i < sketches.size(); i++) {
+            delete sketches[i];
+        }
+        sketches.clear();
+        return sorted;
     }
-
-    // remove the input file
-    remove(inputName.c_str());
-
-    // merge the thread result
-    merge();
-
-    // remove the part files
-    for (int i = 0; i < part_names.size(); i++) {
-        remove(part_names[i].c_str());
+    if (!sorted) {
+        return false;
     }
 
-    auto end = chrono::high_resolution_clock::now();
-    printf("execution time: %.3f seconds\n", chrono::duration_cast<chrono::milliseconds>(end - start).count() / 1000.0);
+    // the parts the threads merged their runs into
+    part_names.insert(part_names.end(), thread_outputs.begin(), thread_outputs.end());
 
-    return 0;
+    // remove the input file
+    if (local) {
+        Scratch::instance().remove(inputName);
+    }
+    return true;
 }
@@ -1,7 +1,11 @@
 #include <cstring>
+#include <fstream>
 #include <string>
 #include <vector>
 
+#include "io_engine.hpp"
+#include "merge.hpp"
+
 #define DATA_SIZE 100
 
 struct Record {
@@ -24,17 +28,66 @@ struct Comparator {
     }
 };
 
+// where the final merge writes the sorted records
+class OutputSink {
+   public:
+    virtual ~OutputSink() {}
+    virtual bool write(const char* data, size_t len) = 0;
+};
+
+// the output file, or object, in the storage its name is in
+class FileSink : public OutputSink {
+   public:
+    // size is that of the whole output, its space is allocated up front where the storage can
+    FileSink(std::string name, long long size = 0);
+    ~FileSink();
+    bool write(const char* data, size_t len);
+    // false if any write of the output failed
+    bool close();
+
+   private:
+    FileWriter* output;
+};
+
+class QuantileSketch;
+class Throttle;
+
 class ExternalSortMT {
    public:
-    ExternalSortMT(std::string inputName, std::string outputName);
+    // range_partition: every thread merges one key range of all the runs,
+    // chosen from quantile sketches of the input, instead of merging its own runs
+    ExternalSortMT(std::string inputName, std::string outputName, bool range_partition = false);
     ~ExternalSortMT();
     int run();
+    // run in steps: sort the input into one sorted part per thread, then merge the parts
+    // and the sorted files added with add_part into a sink, as often as needed.
+    // false if the runs or parts could not be written, what was written is removed
+    bool sort_parts();
+    void add_part(std::string part_name);
+    // false if the sink failed
+    bool merge(OutputSink* sink);
+    void remove_parts();
+    // hold the reads and writes of the runs and parts to the disk limits of a job
+    void set_throttle(Throttle* throttle);
+    // keep the disk footprint of the sorts near the size of the input: the runs are written
+    // over the slices of the input they come from, and the merges punch their runs behind them
+    static void set_footprint(bool bounded);
+    static bool footprint();
 
    private:
     std::string inputName;
     std::string outputName;
+    long long input_size;
+    bool range_partition;
+    bool runs_in_input;  // the runs of a bounded footprint overwrite a local input
     std::vector<std::string> part_names;
-    void thread_process(long long curPos, long long size, int thread_id);
-    void thread_merge(std::vector<std::string>& thread_part_names, int thread_id);
-    void merge();
+    std::vector<std::string> thread_outputs;
+    std::vector<std::vector<RunRange>> thread_runs;
+    std::vector<QuantileSketch*> sketches;
+    Throttle* throttle;
+    void disk(size_t bytes);
+    bool thread_process(long long curPos, long long size, int thread_id);
+    bool thread_merge(std::vector<RunRange>& thread_part_names, int thread_id);
+    void remove_runs(const std::vector<RunRange>& runs);
+    bool merge_by_range(int num_threads);
 };
\ No newline at end of file
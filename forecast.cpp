@@ -0,0 +1,267 @@
+/**
+ * Forecasting read ahead of the merges.
+ * A k-way merge reading its runs one block at a time stalls on the disk every
+ * time a run runs out. The runs of a merge share one pool of blocks instead:
+ * every run holds the block the merge copies from, and each spare block is
+ * read for the run whose last buffered record is smallest, since the merge
+ * gets to the end of that run's records before any other. With thousands of
+ * runs the blocks get smaller, but the next block of the run that empties
+ * next is always on its way. A merge that consumes its runs punches each
+ * block out of its run file once the block goes back to the pool.
+ */
+#include "forecast.hpp"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#include "external_sort_mt.hpp"
+#include "mapped_file.hpp"
+
+using namespace std;
+
+// the reader of one run, for the merges that read their runs through FileReaders
+class ForecastRun : public FileReader {
+   public:
+    ForecastRun(ForecastReader& reader, int index) : reader(reader), index(index) {}
+    bool good() { return reader.good(index); }
+    ssize_t read(char* data, size_t len) { return reader.read(index, data, len); }
+
+   private:
+    ForecastReader& reader;
+    int index;
+};
+
+// the priority queue pops its largest, we want the smallest record
+bool ForecastReader::Forecast::operator<(const Forecast& other) const {
+    return last > other.last;
+}
+
+ForecastReader::ForecastReader(const vector<RunRange>& ranges, bool consume, size_t memory)
+    : engine(IoEngine::instance()), consume(consume), runs(ranges.size()), stall_count(0) {
+    for (int i = 0; i < runs.size(); i++) {
+        Run& run = runs[i];
+        run.fd = open_file(ranges[i].name, consume ? O_RDWR : O_RDONLY, run.aligned);
+        run.begin = ranges[i].begin * DATA_SIZE;
+        run.end = ranges[i].end * DATA_SIZE;
+        struct stat stat_buf;
+        if (run.fd >= 0 && ranges[i].end < 0) {
+            run.end = fstat(run.fd, &stat_buf) == 0 ? stat_buf.st_size : 0;
+        }
+        run.next = run.aligned ? run.begin / DIRECT_ALIGN * DIRECT_ALIGN : run.begin;
+        run.pos = run.begin - run.next;
+        run.front_ready = false;
+        run.reading = false;
+        run.generation = 0;
+    }
+
+    // two blocks per run at least, one to merge from and one to read ahead. the blocks
+    // are as large as the requests of the slowest disk, if the memory has room for them
+    size_t count = max((size_t)1, ranges.size());
+    size_t request_size = IO_BLOCK;
+    for (int i = 0; i < runs.size(); i++) {
+        request_size = max(request_size, engine.request_size(runs[i].fd));
+    }
+    block_size = min(request_size, memory / (2 * count)) / DIRECT_ALIGN * DIRECT_ALIGN;
+    block_size = max(block_size, (size_t)DIRECT_ALIGN);
+    size_t blocks = max(2 * count, min(memory / block_size, FORECAST_DEPTH * count));
+    region = (char*)aligned_alloc(DIRECT_ALIGN, blocks * block_size);
+    requests.resize(blocks);
+    for (size_t b = 0; b < blocks; b++) {
+        requests[b].buffer = region + b * block_size;
+        free_blocks.push_back(blocks - 1 - b);
+    }
+
+    // every run asks for its first block, the spare blocks go by the forecast
+    for (int i = 0; i < runs.size(); i++) {
+        if (runs[i].fd >= 0 && runs[i].next < runs[i].end) {
+            int block = free_blocks.back();
+            free_blocks.pop_back();
+            request(i, block);
+        }
+    }
+    read_ahead();
+}
+
+ForecastReader::~ForecastReader() {
+    for (int i = 0; i < runs.size(); i++) {
+        for (int b = 0; b < runs[i].blocks.size(); b++) {
+            engine.wait(&requests[runs[i].blocks[b]]);
+        }
+        if (runs[i].fd >= 0) {
+            close(runs[i].fd);
+        }
+    }
+    free(region);
+}
+
+bool ForecastReader::good(int i) {
+    return runs[i].fd >= 0;
+}
+
+FileReader* ForecastReader::run(int i) {
+    return new ForecastRun(*this, i);
+}
+
+long long ForecastReader::stalls() {
+    return stall_count;
+}
+
+// ask for the next block of the run, a direct read of its last block asks for whole aligned units
+void ForecastReader::request(int i, int block) {
+    Run& run = runs[i];
+    IoRequest& request = requests[block];
+    long long left = run.end - run.next;
+    if (run.aligned) {
+        left = (left + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+    }
+    request.fd = run.fd;
+    request.write = false;
+    request.len = min((long long)block_size, left);
+    request.offset = run.next;
+    run.next += request.len;
+    run.blocks.push_back(block);
+    run.reading = true;
+    reading.push_back(i);
+    engine.submit(&request, 1);
+}
+
+// the last block of the run is here, the run goes back into the forecast with its last record
+void ForecastReader::arrived(int i) {
+    Run& run = runs[i];
+    IoRequest& block = requests[run.blocks.back()];
+    run.reading = false;
+    run.generation++;
+    if (block.result <= 0 || run.next >= run.end) {
+        return;
+    }
+    // records start at begin and every DATA_SIZE bytes after it
+    long long valid_end = block.offset + min((long long)block.result, run.end - (long long)block.offset);
+    long long last = run.begin + (valid_end - run.begin) / DATA_SIZE * DATA_SIZE - DATA_SIZE;
+    Forecast entry;
+    entry.run = i;
+    entry.generation = run.generation;
+    // a block too short for a whole record is merged soon anyway
+    if (last >= (long long)block.offset) {
+        entry.last.assign(block.buffer + (last - block.offset), DATA_SIZE);
+    }
+    forecast.push(entry);
+}
+
+void ForecastReader::read_ahead() {
+    for (int k = 0; k < reading.size();) {
+        Run& run = runs[reading[k]];
+        if (run.reading && engine.ready(&requests[run.blocks.back()])) {
+            arrived(reading[k]);
+        }
+        if (!run.reading) {
+            reading[k] = reading.back();
+            reading.pop_back();
+        } else {
+            k++;
+        }
+    }
+    // the spare blocks go to the runs the merge will empty first
+    while (!free_blocks.empty() && !forecast.empty()) {
+        Forecast entry = forecast.top();
+        forecast.pop();
+        Run& run = runs[entry.run];
+        if (entry.generation != run.generation || run.reading || run.next >= run.end) {
+            continue;
+        }
+        int block = free_blocks.back();
+        free_blocks.pop_back();
+        request(entry.run, block);
+    }
+}
+
+ssize_t ForecastReader::read(int i, char* data, size_t len) {
+    Run& run = runs[i];
+    size_t copied = 0;
+    while (copied < len && !run.blocks.empty()) {
+        int block = run.blocks.front();
+        IoRequest& front = requests[block];
+        if (!run.front_ready) {
+            if (!engine.ready(&front)) {
+                stall_count++;
+            }
+            if (!engine.wait(&front)) {
+                return -1;
+            }
+            run.front_ready = true;
+            if (run.reading && run.blocks.size() == 1) {
+                arrived(i);
+            }
+        }
+        // the bytes of the block that are in the range
+        long long valid = min((long long)front.result, run.end - (long long)front.offset);
+        if (valid <= 0) {
+            break;
+        }
+        if (run.pos >= valid) {
+            // the block is used up and goes back to the pool, the run needs its next one now.
+            // a direct read may start before the range, those bytes belong to the run before
+            if (consume) {
+                long long from = max((long long)front.offset, run.begin);
+                fallocate(run.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, from, front.offset + valid - from);
+            }
+            run.blocks.pop_front();
+            free_blocks.push_back(block);
+            run.pos = 0;
+            run.front_ready = false;
+            if (run.blocks.empty() && run.next < run.end) {
+                free_blocks.pop_back();
+                request(i, block);
+            }
+            read_ahead();
+            continue;
+        }
+        size_t n = min((size_t)valid - run.pos, len - copied);
+        memcpy(data + copied, front.buffer + run.pos, n);
+        run.pos += n;
+        copied += n;
+    }
+    return copied;
+}
+
+ForecastReader* open_runs(const vector<RunRange>& runs, vector<FileReader*>& readers, bool consume) {
+    // all runs of a merge are read at the same time, they have to fit in memory together,
+    // and runs on a rotational disk are read through its queue
+    long long bytes = 0;
+    for (int i = 0; i < runs.size(); i++) {
+        struct stat stat_buf;
+        long long end = runs[i].end * DATA_SIZE;
+        if (runs[i].end < 0) {
+            end = stat(runs[i].name.c_str(), &stat_buf) == 0 ? stat_buf.st_size : 0;
+        }
+        bytes += end - runs[i].begin * DATA_SIZE;
+    }
+    bool mapped = true;
+    for (int i = 0; mapped && i < runs.size(); i++) {
+        mapped = mappable(runs[i].name, bytes);
+    }
+    if (mapped) {
+        for (int i = 0; i < runs.size(); i++) {
+            readers.push_back(new MappedReader(runs[i].name, runs[i].begin * DATA_SIZE,
+                                               runs[i].end < 0 ? -1 : runs[i].end * DATA_SIZE, consume));
+        }
+        return nullptr;
+    }
+    ForecastReader* forecast = new ForecastReader(runs, consume);
+    for (int i = 0; i < runs.size(); i++) {
+        readers.push_back(forecast->run(i));
+    }
+    return forecast;
+}
+
+ForecastReader* open_runs(const vector<string>& names, vector<FileReader*>& readers, bool consume) {
+    vector<RunRange> runs;
+    for (int i = 0; i < names.size(); i++) {
+        runs.push_back(RunRange{names[i], 0, -1});
+    }
+    return open_runs(runs, readers, consume);
+}
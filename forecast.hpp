@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include <deque>
+#include <queue>
+#include <string>
+#include <vector>
+
+#include "io_engine.hpp"
+#include "merge.hpp"
+
+#define FORECAST_MEMORY 67108864  // bytes of read blocks shared by the runs of one merge, 64 MB
+#define FORECAST_DEPTH 8          // blocks per run at most, for merges of a few runs
+
+// reads the runs of a k-way merge through one fixed pool of blocks. every run keeps the
+// block it is merging from, and the spare blocks are read ahead for the run whose last
+// buffered record is smallest, because the merge will get to the end of its records first
+class ForecastReader {
+   public:
+    // runs with end -1 are read to the end of the file. consume punches every block the
+    // merge is done with out of its run, for runs that are read once
+    ForecastReader(const std::vector<RunRange>& runs, bool consume = false, size_t memory = FORECAST_MEMORY);
+    ~ForecastReader();
+    bool good(int i);
+    // a reader of run i, to be deleted before the forecast reader
+    FileReader* run(int i);
+    // copy the next len bytes of run i, fewer at its end, -1 on a read error
+    ssize_t read(int i, char* data, size_t len);
+    // times the merge found the next block of a run still in flight
+    long long stalls();
+
+   private:
+    struct Run {
+        int fd;
+        bool aligned;            // open for direct io, the reads start and end on aligned offsets
+        long long begin;
+        long long end;
+        long long next;          // offset of the next block to ask for
+        std::deque<int> blocks;  // read or in flight, the merge copies from the front one
+        size_t pos;              // in the front block
+        bool front_ready;        // we waited for the front block
+        bool reading;            // the last block is in flight
+        int generation;          // of the entry of the run in the forecast
+    };
+    // a run and the last whole record of its last block, the forecast pops the smallest first
+    struct Forecast {
+        std::string last;
+        int run;
+        int generation;
+        bool operator<(const Forecast& other) const;
+    };
+    IoEngine& engine;
+    bool consume;
+    size_t block_size;
+    char* region;  // the blocks, one after the other
+    std::vector<IoRequest> requests;
+    std::vector<int> free_blocks;
+    std::vector<Run> runs;
+    std::vector<int> reading;  // runs whose last block is in flight
+    std::priority_queue<Forecast> forecast;
+    long long stall_count;
+    void request(int i, int block);
+    void arrived(int i);
+    void read_ahead();
+};
+
+// readers of the runs of a merge, mapped when the runs fit in memory, else reading from
+// a forecast reader, which is returned to be deleted after the readers. consume gives
+// the disk space of the runs back behind the merge
+ForecastReader* open_runs(const std::vector<RunRange>& runs, std::vector<FileReader*>& readers, bool consume = false);
+ForecastReader* open_runs(const std::vector<std::string>& names, std::vector<FileReader*>& readers, bool consume = false);
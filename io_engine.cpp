@@ -0,0 +1,748 @@
+/**
+ * File io of the sorts.
+ * The io_uring engine talks to the kernel with raw system calls: callers put
+ * their reads and writes on the submission ring, and one thread
+ * reaps the completions, so the sort threads never block on the disk while
+ * the device has requests queued. The blocks of the block readers and writers
+ * are registered with the kernel, so their reads and writes skip the page
+ * pinning. Kernels without io_uring get blocking pread and pwrite.
+ * In direct mode the readers and writers open their files with O_DIRECT, so
+ * runs that are read once do not push everything else out of the page cache.
+ * Both engines go through a governor that queues the requests per device: a
+ * rotational disk gets two requests in flight, of 4 MB each, so the streams
+ * of the sort threads take turns on it instead of making it seek between
+ * them all, and the reads of the merges go ahead of the writes of the spills.
+ * The sort threads keep sorting while their writes wait in the queue.
+ */
+#include "io_engine.hpp"
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <set>
+#include <thread>
+
+#define QUEUE_DEPTH 64    // requests in flight in the io_uring engine
+#define FIXED_BLOCKS 64   // blocks registered with the kernel, 16 MB
+
+using namespace std;
+
+IoEngine::IoEngine() : region(nullptr), region_blocks(0), capacity(INT_MAX), started(0) {}
+
+// a partition has the queue of its disk one level up
+bool rotational(dev_t device) {
+    string base = "/sys/dev/block/" + to_string(major(device)) + ":" + to_string(minor(device));
+    const char* queues[] = {"/queue/rotational", "/../queue/rotational"};
+    for (int i = 0; i < 2; i++) {
+        FILE* file = fopen((base + queues[i]).c_str(), "r");
+        if (file != nullptr) {
+            int flag = 0;
+            bool read = fscanf(file, "%d", &flag) == 1;
+            fclose(file);
+            if (read) {
+                return flag != 0;
+            }
+        }
+    }
+    return false;
+}
+
+// called with governor_mtx held
+IoEngine::Device& IoEngine::device(dev_t id) {
+    auto it = devices.find(id);
+    if (it == devices.end()) {
+        Device device;
+        device.rotational = rotational(id);
+        device.streams = device.rotational ? HDD_STREAMS : SSD_STREAMS;
+        device.inflight = 0;
+        it = devices.insert(make_pair(id, device)).first;
+    }
+    return it->second;
+}
+
+size_t IoEngine::request_size(int fd) {
+    struct stat stat_buf;
+    if (fd < 0 || fstat(fd, &stat_buf) != 0) {
+        return IO_BLOCK;
+    }
+    lock_guard<mutex> lock(governor_mtx);
+    return device(stat_buf.st_dev).rotational ? HDD_REQUEST : IO_BLOCK;
+}
+
+string IoEngine::describe() {
+    lock_guard<mutex> lock(governor_mtx);
+    string text;
+    for (auto it = devices.begin(); it != devices.end(); it++) {
+        const Device& device = it->second;
+        text += (text.empty() ? "" : ", ") + to_string(major(it->first)) + ":" + to_string(minor(it->first)) + " (" +
+                (device.rotational ? "hdd" : "ssd") + ", " + to_string(device.streams) + " streams, " +
+                to_string((device.rotational ? HDD_REQUEST : IO_BLOCK) / 1024) + " KB requests)";
+    }
+    return text;
+}
+
+void IoEngine::submit(IoRequest* requests, int count) {
+    {
+        lock_guard<mutex> lock(governor_mtx);
+        for (int i = 0; i < count; i++) {
+            IoRequest& request = requests[i];
+            struct stat stat_buf;
+            request.done = false;
+            request.device = fstat(request.fd, &stat_buf) == 0 ? stat_buf.st_dev : 0;
+            Device& queue = device(request.device);
+            (request.write ? queue.writes : queue.reads).push_back(&request);
+        }
+    }
+    dispatch();
+}
+
+// start the queued requests of the devices with room, the reads first. the pread engine
+// finishes a read inside start, the outer dispatch of the thread goes on with the queues
+void IoEngine::dispatch() {
+    static thread_local bool dispatching = false;
+    if (dispatching) {
+        return;
+    }
+    dispatching = true;
+    while (true) {
+        IoRequest* next = nullptr;
+        {
+            lock_guard<mutex> lock(governor_mtx);
+            for (auto it = devices.begin(); it != devices.end() && next == nullptr && started < capacity; it++) {
+                Device& queue = it->second;
+                if (queue.inflight >= queue.streams) {
+                    continue;
+                }
+                deque<IoRequest*>& waiting = queue.reads.empty() ? queue.writes : queue.reads;
+                if (!waiting.empty()) {
+                    next = waiting.front();
+                    waiting.pop_front();
+                    queue.inflight++;
+                    started++;
+                }
+            }
+        }
+        if (next == nullptr) {
+            break;
+        }
+        start(next);
+    }
+    dispatching = false;
+}
+
+void IoEngine::finish(IoRequest* request, ssize_t result) {
+    // the waiter may reuse the request once it is done, so the device gets its room back first
+    {
+        lock_guard<mutex> lock(governor_mtx);
+        devices[request->device].inflight--;
+        started--;
+    }
+    {
+        lock_guard<mutex> lock(mtx);
+        request->result = result;
+        request->done = true;
+        done_cv.notify_all();
+    }
+    dispatch();
+}
+
+bool IoEngine::wait(IoRequest* request) {
+    {
+        unique_lock<mutex> lock(mtx);
+        done_cv.wait(lock, [request] { return request->done; });
+    }
+    if (request->result < 0) {
+        return false;
+    }
+    // a short write of a regular file is rare, we write the rest ourselves
+    while (request->write && (size_t)request->result < request->len) {
+        ssize_t n = pwrite(request->fd, request->buffer + request->result, request->len - request->result,
+                           request->offset + request->result);
+        if (n <= 0) {
+            return false;
+        }
+        request->result += n;
+    }
+    return true;
+}
+
+bool IoEngine::ready(IoRequest* request) {
+    lock_guard<mutex> lock(mtx);
+    return request->done;
+}
+
+// the registered blocks first, then blocks of our own once they are all taken
+char* IoEngine::acquire_block(size_t len) {
+    if (len != IO_BLOCK) {
+        return (char*)aligned_alloc(DIRECT_ALIGN, len);
+    }
+    {
+        lock_guard<mutex> lock(mtx);
+        if (!free_blocks.empty()) {
+            char* block = free_blocks.back();
+            free_blocks.pop_back();
+            return block;
+        }
+    }
+    return (char*)aligned_alloc(DIRECT_ALIGN, IO_BLOCK);
+}
+
+void IoEngine::release_block(char* block) {
+    lock_guard<mutex> lock(mtx);
+    if (block_index(block, IO_BLOCK) >= 0) {
+        free_blocks.push_back(block);
+    } else {
+        free(block);
+    }
+}
+
+int IoEngine::block_index(const char* buffer, size_t len) {
+    if (region == nullptr || buffer < region || buffer >= region + (size_t)region_blocks * IO_BLOCK) {
+        return -1;
+    }
+    int index = (buffer - region) / IO_BLOCK;
+    return buffer + len <= region + (size_t)(index + 1) * IO_BLOCK ? index : -1;
+}
+
+// blocking reads in the thread that submits them. the writes go to a thread of their own,
+// so a merge fills its next blocks while the last ones are written
+class PosixEngine : public IoEngine {
+   public:
+    PosixEngine() { thread(&PosixEngine::write_behind, this).detach(); }
+    const char* name() { return "pread/pwrite"; }
+
+   protected:
+    void start(IoRequest* request) {
+        if (request->write) {
+            lock_guard<mutex> lock(queue_mtx);
+            writes.push_back(request);
+            queue_cv.notify_one();
+        } else {
+            transfer(*request);
+        }
+    }
+
+   private:
+    mutex queue_mtx;
+    condition_variable queue_cv;
+    deque<IoRequest*> writes;
+
+    void transfer(IoRequest& request) {
+        size_t done = 0;
+        ssize_t n = 0;
+        while (done < request.len) {
+            n = request.write ? pwrite(request.fd, request.buffer + done, request.len - done, request.offset + done)
+                              : pread(request.fd, request.buffer + done, request.len - done, request.offset + done);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+            done += n;
+        }
+        finish(&request, n < 0 ? -errno : done);
+    }
+
+    void write_behind() {
+        while (true) {
+            IoRequest* request;
+            {
+                unique_lock<mutex> lock(queue_mtx);
+                queue_cv.wait(lock, [this] { return !writes.empty(); });
+                request = writes.front();
+                writes.pop_front();
+            }
+            transfer(*request);
+        }
+    }
+};
+
+class UringEngine : public IoEngine {
+   public:
+    // nullptr if the kernel has no io_uring, or one without plain reads and writes
+    static UringEngine* create();
+    const char* name() { return fixed ? "io_uring, registered buffers" : "io_uring"; }
+
+   protected:
+    void start(IoRequest* request);
+
+   private:
+    int ring_fd;
+    unsigned entries;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+    bool fixed;  // the blocks are registered with the kernel
+    mutex sq_mtx;
+    condition_variable sq_cv;
+    unsigned inflight;  // on the submission ring or in the kernel
+    set<IoRequest*> started_requests;  // the kernel has them, they fail with the ring if it breaks
+    int broken;                         // errno of the ring once it stopped working, 0 while it works
+    int enter(unsigned count);
+    void reap();
+};
+
+static int io_uring_setup(unsigned entries, struct io_uring_params* params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+UringEngine* UringEngine::create() {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = io_uring_setup(QUEUE_DEPTH, &params);
+    if (fd < 0) {
+        return nullptr;
+    }
+
+    // IORING_OP_READ and IORING_OP_WRITE came after the first io_uring kernels
+    size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = (struct io_uring_probe*)calloc(1, probe_size);
+    bool supported = io_uring_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0 && probe->last_op >= IORING_OP_WRITE &&
+                     (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+                     (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    if (!supported) {
+        close(fd);
+        return nullptr;
+    }
+
+    // the rings are shared with the kernel, newer kernels map both with one mmap
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single) {
+        sq_size = cq_size = max(sq_size, cq_size);
+    }
+    char* sq = (char*)mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    char* cq = single ? sq : (char*)mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    void* sqes = mmap(nullptr, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+        close(fd);
+        return nullptr;
+    }
+
+    UringEngine* engine = new UringEngine();
+    engine->ring_fd = fd;
+    engine->entries = params.sq_entries;
+    engine->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    engine->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    engine->sq_array = (unsigned*)(sq + params.sq_off.array);
+    engine->sqes = (struct io_uring_sqe*)sqes;
+    engine->cq_head = (unsigned*)(cq + params.cq_off.head);
+    engine->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    engine->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    engine->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    engine->inflight = 0;
+    engine->broken = 0;
+    // the governor never starts more than the ring holds, so start does not wait in the reaper
+    engine->capacity = params.sq_entries;
+
+    // register the blocks, without them the engine works too, a little slower
+    engine->region = (char*)aligned_alloc(DIRECT_ALIGN, (size_t)FIXED_BLOCKS * IO_BLOCK);
+    vector<struct iovec> iovecs(FIXED_BLOCKS);
+    for (int i = 0; i < FIXED_BLOCKS; i++) {
+        iovecs[i].iov_base = engine->region + (size_t)i * IO_BLOCK;
+        iovecs[i].iov_len = IO_BLOCK;
+    }
+    engine->fixed = io_uring_register(fd, IORING_REGISTER_BUFFERS, iovecs.data(), FIXED_BLOCKS) == 0;
+    engine->region_blocks = FIXED_BLOCKS;
+    for (int i = FIXED_BLOCKS - 1; i >= 0; i--) {
+        engine->release_block(engine->region + (size_t)i * IO_BLOCK);
+    }
+
+    // the engine lives as long as the process, and so does its reaper
+    thread(&UringEngine::reap, engine).detach();
+    return engine;
+}
+
+void UringEngine::start(IoRequest* request) {
+    int error;
+    {
+        unique_lock<mutex> lock(sq_mtx);
+        // the completion ring has room for twice the entries, so it never overflows
+        sq_cv.wait(lock, [this] { return inflight < entries || broken != 0; });
+        error = broken;
+        if (error == 0) {
+            unsigned tail = *sq_tail;
+            unsigned index = tail & *sq_mask;
+            struct io_uring_sqe* sqe = &sqes[index];
+            memset(sqe, 0, sizeof(*sqe));
+            int block = fixed ? block_index(request->buffer, request->len) : -1;
+            if (block >= 0) {
+                sqe->opcode = request->write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+                sqe->buf_index = block;
+            } else {
+                sqe->opcode = request->write ? IORING_OP_WRITE : IORING_OP_READ;
+            }
+            sqe->fd = request->fd;
+            sqe->addr = (uint64_t)request->buffer;
+            sqe->len = request->len;
+            sqe->off = request->offset;
+            sqe->user_data = (uint64_t)request;
+            sq_array[index] = index;
+            __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+            error = enter(1);
+            if (error == 0) {
+                inflight++;
+                started_requests.insert(request);
+            } else {
+                // the kernel did not take the entry, so it is taken back off the ring
+                __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+                printf("Fail to submit io: %s.\n", strerror(error));
+            }
+        }
+    }
+    // outside the lock, finish may start the next requests
+    if (error != 0) {
+        finish(request, -error);
+    }
+}
+
+// hand the queued entries to the kernel, called with sq_mtx held, 0 or the errno of the failure
+int UringEngine::enter(unsigned count) {
+    while (count > 0) {
+        int n = io_uring_enter(ring_fd, count, 0, 0);
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                this_thread::yield();
+                continue;
+            }
+            return errno;
+        }
+        count -= n;
+    }
+    return 0;
+}
+
+// wait for completions and wake up whoever waits for them. if the ring breaks,
+// the requests in the kernel fail with its error, and so do the ones started later
+void UringEngine::reap() {
+    while (true) {
+        if (io_uring_enter(ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            int error = errno;
+            printf("Fail to wait for io: %s.\n", strerror(error));
+            set<IoRequest*> failed;
+            {
+                lock_guard<mutex> lock(sq_mtx);
+                broken = error;
+                failed.swap(started_requests);
+                inflight = 0;
+                sq_cv.notify_all();
+            }
+            for (auto it = failed.begin(); it != failed.end(); it++) {
+                finish(*it, -error);
+            }
+            return;
+        }
+        // the ring gets its room back before finish, which may start the next requests from here
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        vector<pair<IoRequest*, int>> reaped;
+        for (; head != tail; head++) {
+            struct io_uring_cqe* cqe = &cqes[head & *cq_mask];
+            reaped.push_back(make_pair((IoRequest*)cqe->user_data, cqe->res));
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        if (!reaped.empty()) {
+            lock_guard<mutex> lock(sq_mtx);
+            inflight -= reaped.size();
+            for (int i = 0; i < reaped.size(); i++) {
+                started_requests.erase(reaped[i].first);
+            }
+            sq_cv.notify_all();
+        }
+        for (int i = 0; i < reaped.size(); i++) {
+            finish(reaped[i].first, reaped[i].second);
+        }
+    }
+}
+
+static mutex engine_mtx;
+static IoEngine* engine = nullptr;
+static bool direct_io = false;
+
+// the engine lives until the process exits, like the pools
+IoEngine& IoEngine::instance() {
+    lock_guard<mutex> lock(engine_mtx);
+    if (engine == nullptr) {
+        engine = UringEngine::create();
+    }
+    if (engine == nullptr) {
+        engine = new PosixEngine();
+    }
+    return *engine;
+}
+
+// the readers and writers keep the engine they started with, so it is never replaced
+bool IoEngine::use(const string& name) {
+    lock_guard<mutex> lock(engine_mtx);
+    if (engine != nullptr) {
+        return false;
+    }
+    if (name == "posix") {
+        engine = new PosixEngine();
+    } else if (name == "uring") {
+        engine = UringEngine::create();
+    } else {
+        return false;
+    }
+    return engine != nullptr;
+}
+
+void IoEngine::set_direct(bool direct) {
+    direct_io = direct;
+}
+
+bool IoEngine::direct() {
+    return direct_io;
+}
+
+// open with O_DIRECT in direct mode, without it on file systems that cannot do direct io
+int open_file(const string& name, int flags, bool& aligned) {
+    aligned = false;
+    if (direct_io) {
+        int fd = open(name.c_str(), flags | O_DIRECT, 0644);
+        if (fd >= 0 || errno != EINVAL) {
+            aligned = fd >= 0;
+            return fd;
+        }
+    }
+    return open(name.c_str(), flags, 0644);
+}
+
+BlockReader::BlockReader(const string& name, long long begin, long long end, int depth)
+    : engine(IoEngine::instance()), next(begin), end(end), current(0), pos(0), failed(false) {
+    fd = open_file(name, O_RDONLY, aligned);
+    block = engine.request_size(fd);
+    requests.resize(max(2, (int)(depth * IO_BLOCK / block)));
+    struct stat stat_buf;
+    if (fd >= 0 && end < 0) {
+        this->end = fstat(fd, &stat_buf) == 0 ? stat_buf.st_size : 0;
+    }
+    // direct reads start at an aligned offset, we skip what comes before begin
+    if (aligned) {
+        next = begin / DIRECT_ALIGN * DIRECT_ALIGN;
+        pos = begin - next;
+    }
+    for (int i = 0; i < requests.size(); i++) {
+        requests[i].buffer = engine.acquire_block(block);
+        request(i);
+    }
+}
+
+BlockReader::~BlockReader() {
+    for (int i = 0; i < requests.size(); i++) {
+        engine.wait(&requests[i]);
+        engine.release_block(requests[i].buffer);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+bool BlockReader::good() {
+    return fd >= 0 && !failed;
+}
+
+// ask for the next block of the range into the slot, or leave it empty at the end.
+// a direct read of the last block asks for whole aligned units, the file may end before them
+void BlockReader::request(int slot) {
+    IoRequest& request = requests[slot];
+    long long left = fd >= 0 ? max(0LL, end - next) : 0;
+    if (aligned) {
+        left = (left + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+    }
+    request.fd = fd;
+    request.write = false;
+    request.len = min((long long)block, left);
+    request.offset = next;
+    if (request.len == 0) {
+        request.result = 0;
+        request.done = true;
+        return;
+    }
+    next += request.len;
+    engine.submit(&request, 1);
+}
+
+ssize_t BlockReader::read(char* data, size_t len) {
+    size_t copied = 0;
+    while (copied < len) {
+        IoRequest& block = requests[current];
+        if (!engine.wait(&block)) {
+            failed = true;
+            return -1;
+        }
+        // the bytes of the block that are in the range
+        long long valid = min((long long)block.result, end - (long long)block.offset);
+        if (valid <= 0) {
+            break;
+        }
+        if (pos >= valid) {
+            // the block is used up, it goes after the blocks in flight
+            request(current);
+            current = (current + 1) % requests.size();
+            pos = 0;
+            continue;
+        }
+        size_t n = min((size_t)valid - pos, len - copied);
+        memcpy(data + copied, block.buffer + pos, n);
+        pos += n;
+        copied += n;
+    }
+    return copied;
+}
+
+BlockWriter::BlockWriter(const string& name, long long offset, bool truncate, int depth)
+    : engine(IoEngine::instance()),
+      name(name),
+      buffered_fd(-1),
+      offset(offset),
+      current(0),
+      filled(0),
+      failed(false) {
+    fd = open_file(name, O_WRONLY | O_CREAT | (truncate ? O_TRUNC : 0), aligned);
+    block = engine.request_size(fd);
+    requests.resize(max(2, (int)(depth * IO_BLOCK / block)));
+    for (int i = 0; i < requests.size(); i++) {
+        requests[i].buffer = engine.acquire_block(block);
+        requests[i].len = 0;
+    }
+}
+
+BlockWriter::~BlockWriter() {
+    close();
+    for (int i = 0; i < requests.size(); i++) {
+        engine.release_block(requests[i].buffer);
+    }
+}
+
+bool BlockWriter::good() {
+    return fd >= 0 && !failed;
+}
+
+// a block ends at the next aligned offset in direct mode, so the blocks after it are aligned
+size_t BlockWriter::capacity() {
+    if (aligned && offset % DIRECT_ALIGN != 0) {
+        return DIRECT_ALIGN - offset % DIRECT_ALIGN;
+    }
+    return block;
+}
+
+bool BlockWriter::write(const char* data, size_t len) {
+    if (fd < 0) {
+        return false;
+    }
+    while (len > 0) {
+        // the block may still be on its way to the disk from the last round
+        IoRequest& request = requests[current];
+        if (filled == 0 && request.len > 0) {
+            failed = !engine.wait(&request) || failed;
+            request.len = 0;
+        }
+        size_t n = min(capacity() - filled, len);
+        memcpy(request.buffer + filled, data, n);
+        filled += n;
+        data += n;
+        len -= n;
+        if (filled == capacity()) {
+            flush();
+        }
+    }
+    return !failed;
+}
+
+void BlockWriter::flush() {
+    if (filled == 0) {
+        return;
+    }
+    IoRequest& request = requests[current];
+    size_t direct_len = filled;
+    if (aligned) {
+        direct_len = offset % DIRECT_ALIGN == 0 ? filled / DIRECT_ALIGN * DIRECT_ALIGN : 0;
+    }
+    // the unaligned head or tail goes through the page cache
+    if (direct_len < filled && !write_buffered(request.buffer + direct_len, filled - direct_len, offset + direct_len)) {
+        failed = true;
+    }
+    if (direct_len > 0) {
+        request.fd = fd;
+        request.write = true;
+        request.len = direct_len;
+        request.offset = offset;
+        engine.submit(&request, 1);
+        current = (current + 1) % requests.size();
+    }
+    offset += filled;
+    filled = 0;
+}
+
+bool BlockWriter::write_buffered(const char* data, size_t len, long long at) {
+    if (buffered_fd < 0) {
+        buffered_fd = open(name.c_str(), O_WRONLY);
+    }
+    while (len > 0) {
+        ssize_t n = pwrite(buffered_fd, data, len, at);
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        len -= n;
+        at += n;
+    }
+    return true;
+}
+
+void BlockWriter::preallocate(long long end) {
+    // not every file system can, the writes allocate as they go there
+    if (fd >= 0 && end > offset) {
+        fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, end - offset);
+    }
+}
+
+bool BlockWriter::close() {
+    if (fd < 0) {
+        return false;
+    }
+    flush();
+    for (int i = 0; i < requests.size(); i++) {
+        if (requests[i].len > 0) {
+            failed = !engine.wait(&requests[i]) || failed;
+            requests[i].len = 0;
+        }
+    }
+    ::close(fd);
+    fd = -1;
+    if (buffered_fd >= 0) {
+        ::close(buffered_fd);
+        buffered_fd = -1;
+    }
+    return !failed;
+}
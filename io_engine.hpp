@@ -0,0 +1,170 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define IO_BLOCK 262144    // bytes per request of the block readers and writers
+#define READ_AHEAD 2       // blocks in flight per block reader
+#define WRITE_BEHIND 4     // blocks in flight per block writer
+#define MERGE_BEHIND 16    // blocks in flight behind a final merge, 4 MB
+#define DIRECT_ALIGN 4096  // offsets, lengths and buffers of direct io are multiples of this
+#define HDD_STREAMS 2      // requests in flight on a rotational disk, more of them only make it seek
+#define SSD_STREAMS 32     // requests in flight on any other device
+#define HDD_REQUEST 4194304  // bytes per request of the readers and writers on a rotational disk
+
+// one read or write of a file, in flight from submit until wait returns
+struct IoRequest {
+    int fd;
+    bool write;
+    char* buffer;
+    size_t len;
+    off_t offset;
+    ssize_t result;  // bytes transferred, or -errno
+    bool done;
+    dev_t device;    // of the file, the request waits in its queue until the device has room
+};
+
+// where the sorts do their file io: io_uring when the kernel has it, else pread and pwrite.
+// the engine keeps a few requests in flight per disk, and the reads go before the writes
+class IoEngine {
+   public:
+    virtual ~IoEngine() {}
+    static IoEngine& instance();
+    // choose the engine by name before the first io, false if it is not available or an engine was already chosen
+    static bool use(const std::string& name);
+    // open the files of the block readers and writers with O_DIRECT, past the page cache
+    static void set_direct(bool direct);
+    static bool direct();
+    virtual const char* name() = 0;
+    // start the requests once their devices have room for them, their buffers must stay valid until wait returns
+    void submit(IoRequest* requests, int count);
+    // wait until the request is done, false if it failed or a write was short
+    bool wait(IoRequest* request);
+    // true if the request is done, without waiting for it
+    bool ready(IoRequest* request);
+    // bytes per request for the disk of the file, larger on rotational disks so they seek less
+    size_t request_size(int fd);
+    // the devices the engine did io on, with their streams and request sizes
+    std::string describe();
+    // aligned blocks of len bytes, the engine may have registered those of IO_BLOCK bytes with the kernel
+    char* acquire_block(size_t len = IO_BLOCK);
+    void release_block(char* block);
+
+   protected:
+    IoEngine();
+    // hand one request to the kernel or to the thread doing it
+    virtual void start(IoRequest* request) = 0;
+    void finish(IoRequest* request, ssize_t result);
+    // index of the registered block holding the buffer, -1 if it is not in one
+    int block_index(const char* buffer, size_t len);
+    char* region;  // the registered blocks, one after the other
+    int region_blocks;
+    int capacity;  // requests in flight on all devices together, at most
+
+   private:
+    // the requests of one device, no more than streams of them are started at a time
+    struct Device {
+        bool rotational;
+        int streams;
+        int inflight;
+        std::deque<IoRequest*> reads;  // the merges wait for them, they go first
+        std::deque<IoRequest*> writes;
+    };
+    std::mutex mtx;
+    std::condition_variable done_cv;
+    std::vector<char*> free_blocks;
+    std::mutex governor_mtx;
+    std::map<dev_t, Device> devices;
+    int started;  // in flight on all devices
+    Device& device(dev_t id);
+    void dispatch();
+};
+
+// true if sysfs says the device is on a rotational disk, false for other and unknown devices
+bool rotational(dev_t device);
+
+// open a file of the readers and writers, with O_DIRECT in direct mode if the file system can do it
+int open_file(const std::string& name, int flags, bool& aligned);
+
+// a range of a file read front to back
+class FileReader {
+   public:
+    virtual ~FileReader() {}
+    virtual bool good() = 0;
+    // copy the next len bytes, fewer at the end of the range, -1 on a read error
+    virtual ssize_t read(char* data, size_t len) = 0;
+};
+
+// a file written front to back
+class FileWriter {
+   public:
+    virtual ~FileWriter() {}
+    virtual bool good() = 0;
+    virtual bool write(const char* data, size_t len) = 0;
+    // write what is left and wait for all of it, false if any write failed
+    virtual bool close() = 0;
+};
+
+// reads [begin, end) of a file front to back, with the next blocks already in flight.
+// in direct mode the reads start at the aligned offset before begin and may go past end
+class BlockReader : public FileReader {
+   public:
+    // end -1 reads to the end of the file. depth counts blocks of IO_BLOCK bytes, a rotational
+    // disk gets as many bytes in fewer, larger blocks
+    BlockReader(const std::string& name, long long begin = 0, long long end = -1, int depth = READ_AHEAD);
+    ~BlockReader();
+    bool good();
+    ssize_t read(char* data, size_t len);
+
+   private:
+    IoEngine& engine;
+    int fd;
+    bool aligned;    // the file is open for direct io
+    size_t block;    // bytes per request, by the disk of the file
+    long long next;  // offset of the next block to ask for
+    long long end;
+    std::vector<IoRequest> requests;
+    int current;  // the block we copy from
+    size_t pos;   // in the current block
+    bool failed;
+    void request(int slot);
+};
+
+// writes a file front to back, with the last blocks still in flight.
+// in direct mode the unaligned head and tail of the range go through the page cache
+class BlockWriter : public FileWriter {
+   public:
+    // truncate starts a new file, otherwise we write into the file from offset on
+    BlockWriter(const std::string& name, long long offset = 0, bool truncate = true, int depth = WRITE_BEHIND);
+    ~BlockWriter();
+    bool good();
+    // reserve the disk space of the file up to end before writing it, so the writes
+    // do not allocate it bit by bit and the file stays in one piece
+    void preallocate(long long end);
+    bool write(const char* data, size_t len);
+    // write the last block and wait for all of them, false if any failed
+    bool close();
+
+   private:
+    IoEngine& engine;
+    std::string name;
+    int fd;
+    int buffered_fd;   // for the unaligned writes in direct mode, opened when needed
+    bool aligned;      // fd is open for direct io
+    size_t block;      // bytes per request, by the disk of the file
+    long long offset;  // of the block being filled
+    std::vector<IoRequest> requests;
+    int current;
+    size_t filled;
+    bool failed;
+    size_t capacity();
+    void flush();
+    bool write_buffered(const char* data, size_t len, long long at);
+};
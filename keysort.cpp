@@ -0,0 +1,232 @@
+/**
+ * Key-only sort.
+ * The slaves sort tuples of the 10 byte key and a 5 byte record id instead of
+ * the 100 byte records, and send back only the ids in key order. The master
+ * then moves every record once, from its place in the input to its place in
+ * the output, so the payloads never cross the network.
+ */
+#include "keysort.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <queue>
+#include <thread>
+
+#include "io_engine.hpp"
+#include "pool.hpp"
+#include "scratch.hpp"
+
+#define TUPLE_MEMORY 150000000  // 10M tuples per run
+#define GATHER_RECORDS 1000000  // records placed per window, 100 MB
+
+using namespace std;
+
+struct Tuple {
+    char value[TUPLE_SIZE];
+};
+
+void make_tuple(char* tuple, const char* key, uint64_t id) {
+    memcpy(tuple, key, KEY_SIZE);
+    for (int i = ID_SIZE - 1; i >= 0; i--) {
+        tuple[KEY_SIZE + i] = (char)(id & 0xff);
+        id >>= 8;
+    }
+}
+
+uint64_t read_id(const char* id) {
+    uint64_t value = 0;
+    for (int i = 0; i < ID_SIZE; i++) {
+        value = (value << 8) | (unsigned char)id[i];
+    }
+    return value;
+}
+
+struct TupleNode {
+    Tuple tuple;
+    int index;
+};
+
+struct TupleComparator {
+    bool operator()(const TupleNode& a, const TupleNode& b) {
+        return memcmp(a.tuple.value, b.tuple.value, TUPLE_SIZE) > 0;
+    }
+};
+
+bool sort_tuples(const string& input_name, const string& output_name, Throttle* throttle) {
+    ifstream input(input_name, ios::in | ios::binary);
+    if (!input.good()) {
+        printf("Fail to open input file.\n");
+        return false;
+    }
+
+    // sort runs of tuples, every thread sorts a slice of the run
+    int num_threads = max(1u, thread::hardware_concurrency());
+    vector<string> run_names;
+    vector<Tuple> tuples(TUPLE_MEMORY / TUPLE_SIZE);
+    bool ok = true;
+    while (ok && (input.read((char*)tuples.data(), tuples.size() * TUPLE_SIZE), input.gcount() > 0)) {
+        long long count = input.gcount() / TUPLE_SIZE;
+        if (throttle != nullptr) {
+            throttle->disk(2 * count * TUPLE_SIZE);
+        }
+        vector<function<void()>> tasks;
+        vector<pair<long long, long long>> slices;
+        for (int i = 0; i < num_threads; i++) {
+            long long begin = count * i / num_threads, end = count * (i + 1) / num_threads;
+            if (begin == end) {
+                continue;
+            }
+            slices.push_back(make_pair(begin, end));
+            tasks.push_back([&tuples, begin, end] {
+                sort(tuples.begin() + begin, tuples.begin() + end,
+                     [](const Tuple& a, const Tuple& b) { return memcmp(a.value, b.value, TUPLE_SIZE) < 0; });
+            });
+        }
+        ThreadPool::instance().run(tasks);
+
+        for (int i = 0; i < slices.size(); i++) {
+            long long run_size = (slices[i].second - slices[i].first) * TUPLE_SIZE;
+            string run_name = Scratch::instance().path(string("tuples_") + to_string(run_names.size()), run_size);
+            ofstream run(run_name, ios::out | ios::binary);
+            run.write((char*)(tuples.data() + slices[i].first), run_size);
+            run.close();
+            run_names.push_back(run_name);
+            ok = ok && run.good();
+        }
+    }
+    input.close();
+    vector<Tuple>().swap(tuples);
+    if (!ok) {
+        printf("Fail to write tuple run.\n");
+        for (int i = 0; i < run_names.size(); i++) {
+            Scratch::instance().remove(run_names[i]);
+        }
+        return false;
+    }
+
+    // k-way merge of the runs, keeping only the ids
+    ofstream output(output_name, ios::out | ios::binary);
+    priority_queue<TupleNode, vector<TupleNode>, TupleComparator> heap;
+    vector<ifstream> runs;
+    for (int i = 0; i < run_names.size(); i++) {
+        runs.push_back(ifstream(run_names[i], ios::in | ios::binary));
+        TupleNode node;
+        node.index = i;
+        if (runs[i].read(node.tuple.value, TUPLE_SIZE)) {
+            heap.push(node);
+        }
+    }
+    DiskMeter meter(throttle);
+    while (!heap.empty()) {
+        TupleNode node = heap.top();
+        heap.pop();
+        output.write(node.tuple.value + KEY_SIZE, ID_SIZE);
+        meter.add(TUPLE_SIZE + ID_SIZE);
+        if (runs[node.index].read(node.tuple.value, TUPLE_SIZE)) {
+            heap.push(node);
+        }
+    }
+    output.close();
+
+    for (int i = 0; i < run_names.size(); i++) {
+        runs[i].close();
+        Scratch::instance().remove(run_names[i]);
+    }
+    if (!output.good()) {
+        printf("Fail to write output file.\n");
+        return false;
+    }
+    return true;
+}
+
+bool gather_records(const vector<string>& id_names, const string& input_name, const string& output_name, Summary* summary) {
+    int fd = open(input_name.c_str(), O_RDONLY);
+    struct stat stat_buf;
+    if (fd < 0 || fstat(fd, &stat_buf) < 0) {
+        printf("Fail to open input file.\n");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+    uint64_t record_num = stat_buf.st_size / SUMMARY_RECORD;
+    const char* records = nullptr;
+    if (stat_buf.st_size > 0) {
+        records = (const char*)mmap(nullptr, stat_buf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (records == MAP_FAILED) {
+            printf("Fail to map input file.\n");
+            close(fd);
+            return false;
+        }
+        // the ids jump around the input
+        madvise((void*)records, stat_buf.st_size, MADV_RANDOM);
+    }
+
+    // fill the output one window at a time, the threads copy a slice of the window each
+    // the output has the size of the input, it is written behind the gathering
+    BlockWriter output(output_name, 0, true, MERGE_BEHIND);
+    output.preallocate(stat_buf.st_size);
+    Summarizer summarizer;
+    int num_threads = max(1u, thread::hardware_concurrency());
+    char* window = BufferPool::instance().acquire(GATHER_RECORDS * SUMMARY_RECORD);
+    char* ids = new char[GATHER_RECORDS * ID_SIZE];
+    // an id past the input came from a slave that sent a broken result
+    atomic<bool> bad_id(false);
+    bool ok = true;
+    for (int f = 0; ok && f < id_names.size(); f++) {
+        ifstream id_file(id_names[f], ios::in | ios::binary);
+        while (ok && (id_file.read(ids, GATHER_RECORDS * ID_SIZE), id_file.gcount() > 0)) {
+            long long count = id_file.gcount() / ID_SIZE;
+            vector<function<void()>> tasks;
+            for (int i = 0; i < num_threads; i++) {
+                long long begin = count * i / num_threads, end = count * (i + 1) / num_threads;
+                tasks.push_back([=, &bad_id] {
+                    for (long long j = begin; j < end; j++) {
+                        uint64_t id = read_id(ids + j * ID_SIZE);
+                        if (id >= record_num) {
+                            printf("Fail to place record %llu, the input has %llu records.\n", (unsigned long long)id,
+                                   (unsigned long long)record_num);
+                            bad_id = true;
+                            return;
+                        }
+                        memcpy(window + j * SUMMARY_RECORD, records + id * SUMMARY_RECORD, SUMMARY_RECORD);
+                    }
+                });
+            }
+            ThreadPool::instance().run(tasks);
+
+            if (bad_id) {
+                ok = false;
+            } else if (!output.write(window, count * SUMMARY_RECORD)) {
+                printf("Fail to write output file.\n");
+                ok = false;
+            } else if (summary != nullptr) {
+                summarizer.update(window, count * SUMMARY_RECORD);
+            }
+        }
+        id_file.close();
+    }
+    delete[] ids;
+    BufferPool::instance().release(window, GATHER_RECORDS * SUMMARY_RECORD);
+    if (!output.close() && ok) {
+        printf("Fail to write output file.\n");
+        ok = false;
+    }
+
+    if (records != nullptr) {
+        munmap((void*)records, stat_buf.st_size);
+    }
+    close(fd);
+    if (summary != nullptr) {
+        *summary = summarizer.summary();
+    }
+    return ok;
+}
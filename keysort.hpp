@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "summary.hpp"
+#include "throttle.hpp"
+
+#define KEY_SIZE 10    // records are sorted by their first 10 bytes
+#define ID_SIZE 5      // record ids up to 2^40, 100 TB of input
+#define TUPLE_SIZE 15  // key followed by the big endian record id
+
+// the tuple of a record, tuples compare with memcmp by key and then by input position
+void make_tuple(char* tuple, const char* key, uint64_t id);
+uint64_t read_id(const char* id);
+
+// sort a file of tuples and write only their ids, in key order, false if the runs or the output could not be written
+bool sort_tuples(const std::string& input_name, const std::string& output_name, Throttle* throttle = nullptr);
+
+// write the records of the input in the order given by the id files, summarizing the output,
+// false if an id is not in the input or the output could not be written
+bool gather_records(const std::vector<std::string>& id_names, const std::string& input_name, const std::string& output_name,
+                    Summary* summary);
@@ -0,0 +1,261 @@
+/**
+ * Transport between processes on the same host.
+ * Slaves and masters sharing a host connect over unix sockets instead of
+ * tcp loopback, and the data frames of a stream between them are copied
+ * through a shared memory ring, so a transfer costs about a memcpy on each
+ * side. Only the frame headers go through the socket.
+ */
+#include "local_transport.hpp"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <ifaddrs.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+
+#define RING_OFFSET 4096  // the data starts one page after the control block
+
+using namespace std;
+
+// unix sockets next to the tcp listeners
+static mutex listeners_mtx;
+static map<int, int> local_listeners;
+
+// abstract socket names, they go away with the socket
+static socklen_t local_address(int port, struct sockaddr_un& addr) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    string name = "distributed_sort." + to_string(port);
+    memcpy(addr.sun_path + 1, name.data(), name.size());
+    return offsetof(struct sockaddr_un, sun_path) + 1 + name.size();
+}
+
+int listen_local(int socket_fd, int port) {
+    int local_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr;
+    socklen_t addr_len = local_address(port, addr);
+    if (local_fd < 0 || bind(local_fd, (struct sockaddr*)&addr, addr_len) < 0 || listen(local_fd, SOMAXCONN) < 0) {
+        // peers on this host use tcp then
+        if (local_fd >= 0) {
+            close(local_fd);
+        }
+        return -1;
+    }
+
+    // several threads may accept at the same time, so nobody may block in accept
+    fcntl(socket_fd, F_SETFL, fcntl(socket_fd, F_GETFL) | O_NONBLOCK);
+    fcntl(local_fd, F_SETFL, fcntl(local_fd, F_GETFL) | O_NONBLOCK);
+    lock_guard<mutex> lock(listeners_mtx);
+    local_listeners[socket_fd] = local_fd;
+    return local_fd;
+}
+
+int accept_peer(int socket_fd, struct sockaddr_in* addr, int timeout_ms) {
+    int local_fd = -1;
+    {
+        lock_guard<mutex> lock(listeners_mtx);
+        auto it = local_listeners.find(socket_fd);
+        if (it != local_listeners.end()) {
+            local_fd = it->second;
+        }
+    }
+    socklen_t addr_len = sizeof(*addr);
+    if (local_fd < 0 && timeout_ms < 0) {
+        return accept(socket_fd, (struct sockaddr*)addr, &addr_len);
+    }
+
+    while (true) {
+        struct pollfd pfds[2];
+        pfds[0].fd = socket_fd;
+        pfds[0].events = POLLIN;
+        pfds[1].fd = local_fd;
+        pfds[1].events = POLLIN;
+        int ready = poll(pfds, local_fd < 0 ? 1 : 2, timeout_ms);
+        if (ready < 0 && errno != EINTR) {
+            return -1;
+        }
+        if (ready == 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        addr_len = sizeof(*addr);
+        int fd = accept(socket_fd, (struct sockaddr*)addr, &addr_len);
+        if (fd >= 0 || local_fd < 0) {
+            return fd;
+        }
+        fd = accept(local_fd, nullptr, nullptr);
+        if (fd >= 0) {
+            memset(addr, 0, sizeof(*addr));
+            addr->sin_family = AF_INET;
+            addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            return fd;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+void close_listener(int socket_fd) {
+    lock_guard<mutex> lock(listeners_mtx);
+    auto it = local_listeners.find(socket_fd);
+    if (it != local_listeners.end()) {
+        close(it->second);
+        local_listeners.erase(it);
+    }
+    close(socket_fd);
+}
+
+bool is_local_address(uint32_t ip) {
+    if ((ntohl(ip) >> 24) == 127) {
+        return true;
+    }
+    struct ifaddrs* addrs;
+    if (getifaddrs(&addrs) < 0) {
+        return false;
+    }
+    bool found = false;
+    for (struct ifaddrs* a = addrs; a != nullptr && !found; a = a->ifa_next) {
+        if (a->ifa_addr != nullptr && a->ifa_addr->sa_family == AF_INET) {
+            found = ((struct sockaddr_in*)a->ifa_addr)->sin_addr.s_addr == ip;
+        }
+    }
+    freeifaddrs(addrs);
+    return found;
+}
+
+bool is_unix_socket(int fd) {
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    return getsockname(fd, (struct sockaddr*)&addr, &addr_len) == 0 && addr.ss_family == AF_UNIX;
+}
+
+int connect_peer(uint32_t ip, int port) {
+    if (is_local_address(ip)) {
+        int socket_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        struct sockaddr_un addr;
+        socklen_t addr_len = local_address(port, addr);
+        if (socket_fd >= 0 && connect(socket_fd, (struct sockaddr*)&addr, addr_len) == 0) {
+            return socket_fd;
+        }
+        // the peer does not listen on a unix socket, try tcp
+        if (socket_fd >= 0) {
+            close(socket_fd);
+        }
+    }
+
+    int socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = ip;
+    addr.sin_port = htons(port);
+    if (socket_fd < 0 || connect(socket_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        if (socket_fd >= 0) {
+            close(socket_fd);
+        }
+        return -1;
+    }
+    return socket_fd;
+}
+
+static void futex_wait(atomic<uint32_t>* addr, uint32_t value) {
+    struct timespec timeout = {0, 100000000};
+    syscall(SYS_futex, (uint32_t*)addr, FUTEX_WAIT, value, &timeout, nullptr, 0);
+}
+
+static void futex_wake(atomic<uint32_t>* addr) {
+    syscall(SYS_futex, (uint32_t*)addr, FUTEX_WAKE, 1, nullptr, nullptr, 0);
+}
+
+ShmRing::ShmRing(void* base) : base(base), control((RingControl*)base), data((char*)base + RING_OFFSET), position(0) {}
+
+ShmRing::~ShmRing() {
+    munmap(base, RING_OFFSET + RING_SIZE);
+}
+
+ShmRing* ShmRing::create(string& name) {
+    static atomic<int> rings(0);
+    name = "/distributed_sort." + to_string(getpid()) + "." + to_string(rings++);
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) {
+        return nullptr;
+    }
+    void* base = MAP_FAILED;
+    if (ftruncate(fd, RING_OFFSET + RING_SIZE) == 0) {
+        base = mmap(nullptr, RING_OFFSET + RING_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (base == MAP_FAILED) {
+        shm_unlink(name.c_str());
+        return nullptr;
+    }
+    // the reader removes the name once it has mapped the ring
+    ShmRing* ring = new ShmRing(base);
+    new (ring->control) RingControl();
+    ring->control->consumed = 0;
+    ring->control->wake = 0;
+    return ring;
+}
+
+ShmRing* ShmRing::open(const string& name) {
+    int fd = shm_open(name.c_str(), O_RDWR, 0600);
+    if (fd < 0) {
+        return nullptr;
+    }
+    shm_unlink(name.c_str());
+    void* base = mmap(nullptr, RING_OFFSET + RING_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return nullptr;
+    }
+    return new ShmRing(base);
+}
+
+bool ShmRing::put(int fd, const char* src, uint32_t len) {
+    // wait until the reader has copied out enough
+    while (position + len - control->consumed.load(memory_order_acquire) > RING_SIZE) {
+        uint32_t wake = control->wake.load();
+        if (position + len - control->consumed.load(memory_order_acquire) <= RING_SIZE) {
+            break;
+        }
+        futex_wait(&control->wake, wake);
+
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLRDHUP;
+        if (poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR))) {
+            return false;
+        }
+    }
+
+    long long offset = position % RING_SIZE;
+    uint32_t first = min((long long)len, RING_SIZE - offset);
+    memcpy(data + offset, src, first);
+    memcpy(data, src + first, len - first);
+    position += len;
+    return true;
+}
+
+void ShmRing::get(char* dst, uint32_t len) {
+    long long offset = position % RING_SIZE;
+    uint32_t first = min((long long)len, RING_SIZE - offset);
+    memcpy(dst, data + offset, first);
+    memcpy(dst + first, data, len - first);
+    position += len;
+
+    control->consumed.store(position, memory_order_release);
+    control->wake++;
+    futex_wake(&control->wake);
+}
\ No newline at end of file
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+
+#define RING_SIZE 8388608  // 8 MB shared memory ring per data stream between processes on one host
+
+// every tcp listener also listens on a unix socket named after its port,
+// peers on the same host connect there instead of going through the tcp stack
+int listen_local(int socket_fd, int port);
+// accept on the tcp listener or its unix socket, unix peers get a loopback address.
+// with a timeout, returns -1 with errno ETIMEDOUT when nobody connected in time
+int accept_peer(int socket_fd, struct sockaddr_in* addr, int timeout_ms = -1);
+// close the tcp listener and its unix socket
+void close_listener(int socket_fd);
+// connect over the unix socket if the address is one of ours, over tcp otherwise, -1 on failure
+int connect_peer(uint32_t ip, int port);
+bool is_local_address(uint32_t ip);
+bool is_unix_socket(int fd);
+
+// shared by the two ends of a ring
+struct RingControl {
+    std::atomic<long long> consumed;  // bytes the reader has copied out
+    std::atomic<uint32_t> wake;       // bumped by the reader, the writer sleeps on it while the ring is full
+};
+
+// shared memory ring carrying the frame payloads of one stream over a unix socket,
+// the socket only carries the frame headers
+class ShmRing {
+   public:
+    // the writer creates the ring and sends its name, the reader opens it
+    static ShmRing* create(std::string& name);
+    static ShmRing* open(const std::string& name);
+    ~ShmRing();
+    // wait for room and copy the data in, false if the reader went away
+    bool put(int fd, const char* data, uint32_t len);
+    void get(char* data, uint32_t len);
+
+   private:
+    ShmRing(void* base);
+    void* base;
+    RingControl* control;
+    char* data;
+    long long position;  // bytes put or got so far
+};
\ No newline at end of file
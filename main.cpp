@@ -4,29 +4,69 @@
  * ./main --mode master --port 8080 --num 5 --input ./input --output ./output
  * ./main -m slave -s 127.0.0.1 -p 8080
  * ./main --mode slave --server 127.0.0.1 --port 8080
+ * ./main -m master -p 8080 -n 5 -i ./input -o ./output -z auto
+ * ./main -m master -p 8080 -n 8 -i ./input -o ./output -f 2
+ * ./main -m master -p 8080 -n 5 -i ./input -o ./output -r
+ * ./main -m master -p 8080 -n 5 -i ./input -o ./output -x
+ * ./main -m master -p 8080 -n 5 -i ./input -o ./output -k
+ * ./main -m master -p 8080 -n 2 -i ./input -o ./output -e
+ * ./main -m master -p 8080 -n 5 -j ./jobs
+ * ./main -m slave -s 127.0.0.1 -p 8080 -d
+ * ./main -m service -p 8080 -u /tmp/distributed_sort.sock
+ * ./main -m submit -i ./input -o ./output -n 2 -u /tmp/distributed_sort.sock
+ * ./main -m master -p 8080 -n 5 -i ./input -o ./output -b 100 -w 200
+ * ./main -m limit -J 3 -b 50 -u /tmp/distributed_sort.sock
+ * ./main -m master -p 8080 -n 5 -i ./input -o ./output -t ./trace.json
+ * ./main -m sort_mt -i ./input -o ./output -q posix
+ * ./main -m sort_mt -i ./input -o ./output -D
+ * ./main -m slave -s 127.0.0.1 -p 8080 -S /mnt/nvme0,/mnt/nvme1 -P space
+ * ./main -m slave -s 127.0.0.1 -p 8080 -S /dev/shm/sort:32000,/mnt/nvme0,/mnt/hdd0
+ * ./main -m sort_mt -i ./input -o ./output -F
+ * ./main -m sort_mt -i object://./bucket/input -o object://./bucket/output -L 20
  *
  */
 
 #include <getopt.h>
+#include <limits.h>
 #include <unistd.h>
 
+#include <fstream>
 #include <iostream>
 #include <string>
 #include <vector>
 
 #include "external_sort.hpp"
 #include "external_sort_mt.hpp"
+#include "io_engine.hpp"
 #include "master.hpp"
+#include "scratch.hpp"
+#include "service.hpp"
 #include "slave.hpp"
+#include "storage.hpp"
 
 using namespace std;
 
 void help() {
-    cout << "Usage: main [-m|--mode <master|slave>] [-p|--port <port>] [-n|--num <num>] [-i|--input <input>] [-o|--output <output>]" << endl;
+    cout << "Usage: main [-m|--mode <master|slave>] [-p|--port <port>] [-n|--num <num>] [-i|--input <input>] [-o|--output <output>] [-z|--compress <off|on|auto>] [-f|--fanin <fanin>] [-r|--range] [-x|--exchange] [-k|--keys] [-e|--elastic] [-j|--jobs <jobs>] [-J|--job <job id>] [-d|--daemon] [-u|--socket <socket>] [-b|--bandwidth <MB/s>] [-w|--disk <MB/s>] [-t|--trace <trace>] [-q|--io <uring|posix>] [-D|--direct] [-S|--scratch <dir[:MB],dir[:MB],...>] [-P|--placement <round|space>] [-F|--footprint] [-L|--latency <ms>]" << endl;
     cout << "Example: ./main -m master -p 8080 -n 5 -i ./input -o ./output" << endl;
     cout << "Example: ./main -m slave -p 8080" << endl;
+    cout << "Example: ./main -m master -p 8080 -n 5 -j ./jobs  (one \"input output\" pair per line)" << endl;
+    cout << "Example: ./main -m slave -s 127.0.0.1 -p 8080 -d" << endl;
+    cout << "Example: ./main -m service -p 8080  (slaves join with -d, jobs are submitted on " << SERVICE_SOCKET << ")" << endl;
+    cout << "Example: ./main -m submit -i ./input -o ./output [-n 2]" << endl;
+    cout << "Example: ./main -m master -p 8080 -n 5 -i ./input -o ./output -b 100 -w 200  (network and disk MB/s of the job)" << endl;
+    cout << "Example: ./main -m slave -s 127.0.0.1 -p 8080 -b 100  (network MB/s of the node)" << endl;
+    cout << "Example: ./main -m limit -J 3 -b 50 -w 0  (change the limits of a running job, without -J of the service node)" << endl;
+    cout << "Example: ./main -m master -p 8080 -n 5 -i ./input -o ./output -t ./trace.json  (timeline of all nodes for chrome://tracing)" << endl;
     cout << "Example: ./main -m sort -i ./input -o ./output" << endl;
     cout << "Example: ./main -m sort_mt -i ./input -o ./output" << endl;
+    cout << "Example: ./main -m sort_mt -i ./input -o ./output -r" << endl;
+    cout << "Example: ./main -m sort_mt -i ./input -o ./output -q posix  (pread, and pwrite in a background thread, instead of io_uring)" << endl;
+    cout << "Example: ./main -m sort_mt -i ./input -o ./output -D  (O_DIRECT file io, past the page cache)" << endl;
+    cout << "Example: ./main -m slave -s 127.0.0.1 -p 8080 -S /mnt/nvme0,/mnt/nvme1 -P space  (runs spread over the disks by free space)" << endl;
+    cout << "Example: ./main -m slave -s 127.0.0.1 -p 8080 -S /dev/shm/sort:32000,/mnt/nvme0,/mnt/hdd0  (32 GB of runs in memory, then ssd, then hdd)" << endl;
+    cout << "Example: ./main -m sort_mt -i ./input -o ./output -F  (disk use near the size of the input, the runs overwrite it)" << endl;
+    cout << "Example: ./main -m master -p 8080 -n 5 -i object://./bucket/input -o object://./bucket/output -L 20  (object store stand-in in ./bucket, 20 ms per request)" << endl;
 }
 
 int main(int argc, char** argv) {
@@ -37,13 +77,35 @@ int main(int argc, char** argv) {
         {"input", required_argument, 0, 'i'},
         {"output", required_argument, 0, 'o'},
         {"server", required_argument, 0, 's'},
+        {"compress", required_argument, 0, 'z'},
+        {"fanin", required_argument, 0, 'f'},
+        {"range", no_argument, 0, 'r'},
+        {"exchange", no_argument, 0, 'x'},
+        {"keys", no_argument, 0, 'k'},
+        {"elastic", no_argument, 0, 'e'},
+        {"jobs", required_argument, 0, 'j'},
+        {"job", required_argument, 0, 'J'},
+        {"daemon", no_argument, 0, 'd'},
+        {"socket", required_argument, 0, 'u'},
+        {"bandwidth", required_argument, 0, 'b'},
+        {"disk", required_argument, 0, 'w'},
+        {"trace", required_argument, 0, 't'},
+        {"io", required_argument, 0, 'q'},
+        {"direct", no_argument, 0, 'D'},
+        {"scratch", required_argument, 0, 'S'},
+        {"placement", required_argument, 0, 'P'},
+        {"footprint", no_argument, 0, 'F'},
+        {"latency", required_argument, 0, 'L'},
         {"help", no_argument, 0, 'h'},
         {0, 0, 0, 0}};
     int option_index = 0;
-    int c, port, num;
-    string mode, input, output, server_ip;
+    int c, port = 0, num = 0, job_id = -1;
+    bool daemon = false;
+    string mode, input, output, server_ip, jobs, socket_path = SERVICE_SOCKET;
+    MasterOptions master_options;
+    IoLimits limits = {0, 0};
 
-    while ((c = getopt_long(argc, argv, "m:p:n:i:o:s:", long_options, &option_index)) != -1) {
+    while ((c = getopt_long(argc, argv, "m:p:n:i:o:s:z:f:rxkej:J:du:b:w:t:q:DS:P:FL:", long_options, &option_index)) != -1) {
         switch (c) {
             case 'm':
                 mode = optarg;
@@ -63,6 +125,84 @@ int main(int argc, char** argv) {
             case 's':
                 server_ip = optarg;
                 break;
+            case 'z':
+                master_options.transfer.compress = parse_compress_mode(optarg);
+                if (master_options.transfer.compress < 0) {
+                    help();
+                    return 1;
+                }
+                break;
+            case 'f':
+                master_options.merge_fanin = atoi(optarg);
+                break;
+            case 'r':
+                master_options.range_partition = true;
+                break;
+            case 'x':
+                master_options.exchange = true;
+                break;
+            case 'k':
+                master_options.key_only = true;
+                break;
+            case 'e':
+                master_options.elastic = true;
+                break;
+            case 'j':
+                jobs = optarg;
+                break;
+            case 'J': {
+                // the number the service gave the job when it was queued
+                char* end;
+                long id = strtol(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || id < 0 || id > INT_MAX) {
+                    printf("Fail to use the job id %s.\n", optarg);
+                    return 1;
+                }
+                job_id = id;
+                break;
+            }
+            case 'd':
+                daemon = true;
+                break;
+            case 'u':
+                socket_path = optarg;
+                break;
+            case 'b':
+                limits.net_rate = atoi(optarg);
+                break;
+            case 'w':
+                limits.disk_rate = atoi(optarg);
+                break;
+            case 't':
+                master_options.trace = optarg;
+                break;
+            case 'q':
+                if (!IoEngine::use(optarg)) {
+                    printf("Fail to use the io engine %s.\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'D':
+                IoEngine::set_direct(true);
+                break;
+            case 'S':
+                if (!Scratch::instance().set_dirs(optarg)) {
+                    printf("Fail to use the scratch directories %s.\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'P':
+                if (!Scratch::instance().set_placement(optarg)) {
+                    help();
+                    return 1;
+                }
+                break;
+            case 'F':
+                ExternalSortMT::set_footprint(true);
+                break;
+            case 'L':
+                Storage::set_latency(atoi(optarg));
+                break;
             case 'h':
                 help();
                 return 0;
@@ -72,29 +212,60 @@ int main(int argc, char** argv) {
         }
     }
 
+    // the limits are of the job for the modes that run or submit one, else of the node
+    master_options.limits = limits;
+    if (mode == "slave" || mode == "service") {
+        Throttle::node().set_limits(limits);
+    }
+
     if (mode == "master") {
-        if (num == 0 || input.empty() || output.empty()) {
+        if (num == 0 || ((input.empty() || output.empty()) && jobs.empty())) {
             help();
             return 1;
         }
-        Master* master = new Master(port, num, input, output);
-        master->run();
+        Master* master = new Master(port, num, input, output, master_options);
+        if (!jobs.empty()) {
+            ifstream jobs_file(jobs);
+            string job_input, job_output;
+            while (jobs_file >> job_input >> job_output) {
+                master->add_job(job_input, job_output);
+            }
+        }
+        int status = master->run();
         delete master;
+        return status;
     } else if (mode == "slave") {
         if (port == 0) {
             help();
             return 1;
         }
-        Slave* slave = new Slave(server_ip, port);
-        slave->run();
+        Slave* slave = new Slave(server_ip, port, daemon);
+        return slave->run();
+    } else if (mode == "service") {
+        if (port == 0) {
+            help();
+            return 1;
+        }
+        Service* service = new Service(port, socket_path);
+        service->run();
+        delete service;
+    } else if (mode == "submit") {
+        if (input.empty() || output.empty()) {
+            help();
+            return 1;
+        }
+        return submit_job(socket_path, input, output, num, master_options);
+    } else if (mode == "limit") {
+        return set_limits(socket_path, job_id, limits);
     } else if (mode == "sort") {
         ExternalSort* external_sort = new ExternalSort(input, output);
         external_sort->run();
         delete external_sort;
     } else if (mode == "sort_mt") {
-        ExternalSortMT* external_sort_mt = new ExternalSortMT(input, output);
-        external_sort_mt->run();
+        ExternalSortMT* external_sort_mt = new ExternalSortMT(input, output, master_options.range_partition);
+        int status = external_sort_mt->run();
         delete external_sort_mt;
+        return status;
     } else {
         help();
         return 1;
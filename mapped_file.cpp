@@ -0,0 +1,131 @@
+/**
+ * Mapped reads of the input and the runs.
+ * When the data fits in memory the sort threads map their slice of the input
+ * and sort pointers into the mapped pages, instead of copying the slice into
+ * a buffer of their own and then into a vector of records. The merges map
+ * their runs the same way. MADV_SEQUENTIAL and MADV_WILLNEED keep the kernel
+ * reading ahead of the cursor, MADV_DONTNEED drops the pages behind it.
+ * A merge that consumes its runs also punches the pages behind the cursor
+ * out of the run files, so the disk space goes back while the output grows.
+ */
+#include "mapped_file.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+static size_t page_size() {
+    static size_t size = sysconf(_SC_PAGESIZE);
+    return size;
+}
+
+MappedReader::MappedReader(const string& name, long long begin, long long end, bool consume)
+    : consume(consume), map(nullptr), map_begin(0), map_len(0), skip(0), size(0), pos(0), advised(0), released(0), punched(0) {
+    // punching holes needs the file open for writing
+    fd = open(name.c_str(), consume ? O_RDWR : O_RDONLY);
+    struct stat stat_buf;
+    if (fd < 0 || fstat(fd, &stat_buf) < 0) {
+        return;
+    }
+    end = end < 0 ? stat_buf.st_size : min(end, (long long)stat_buf.st_size);
+    if (end <= begin) {
+        return;
+    }
+    // mappings start on a page, the bytes before begin are not ours to punch
+    map_begin = begin / page_size() * page_size();
+    skip = begin - map_begin;
+    punched = skip;
+    size = end - begin;
+    map_len = end - map_begin;
+    map = (char*)mmap(nullptr, map_len, PROT_READ, MAP_SHARED, fd, map_begin);
+    if (map == MAP_FAILED) {
+        map = nullptr;
+        return;
+    }
+    madvise(map, map_len, MADV_SEQUENTIAL);
+}
+
+MappedReader::~MappedReader() {
+    // what the merge read is done with, up to the record the cursor stopped at
+    punch(skip + pos);
+    if (map != nullptr) {
+        munmap(map, map_len);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+bool MappedReader::good() {
+    return fd >= 0 && (map != nullptr || size == 0);
+}
+
+const char* MappedReader::next(size_t len, size_t& got) {
+    got = 0;
+    if (map == nullptr) {
+        return nullptr;
+    }
+    got = min((long long)len, size - pos);
+    const char* data = map + skip + pos;
+    pos += got;
+    // keep a window of reads in flight ahead of the cursor
+    size_t ahead = min((size_t)(skip + pos + MAP_WINDOW), map_len);
+    if (advised < ahead) {
+        size_t until = min(ahead + MAP_WINDOW, map_len);
+        until = until == map_len ? until : until / page_size() * page_size();
+        madvise(map + advised, until - advised, MADV_WILLNEED);
+        advised = until;
+    }
+    return data;
+}
+
+void MappedReader::release(long long offset) {
+    size_t until = (skip + min(offset, size)) / page_size() * page_size();
+    if (map != nullptr && until > released) {
+        madvise(map + released, until - released, MADV_DONTNEED);
+        released = until;
+    }
+    punch(until);
+}
+
+// the file bytes of the mapping before until are read and not needed again
+void MappedReader::punch(size_t until) {
+    if (consume && map != nullptr && until > punched) {
+        fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, map_begin + punched, until - punched);
+        punched = until;
+    }
+}
+
+ssize_t MappedReader::read(char* data, size_t len) {
+    if (!good()) {
+        return -1;
+    }
+    size_t got;
+    const char* source = next(len, got);
+    if (got > 0) {
+        memcpy(data, source, got);
+    }
+    if (skip + pos >= released + MAP_WINDOW) {
+        release(pos);
+    } else if (skip + pos >= punched + PUNCH_WINDOW) {
+        // a consumed run gives its space back long before its pages are dropped
+        punch((skip + pos) / page_size() * page_size());
+    }
+    return got;
+}
+
+bool mappable(long long bytes) {
+    static long long memory = (long long)sysconf(_SC_PHYS_PAGES) * page_size();
+    return !IoEngine::direct() && bytes < memory;
+}
+
+bool mappable(const string& name, long long bytes) {
+    struct stat stat_buf;
+    return mappable(bytes) && !(stat(name.c_str(), &stat_buf) == 0 && rotational(stat_buf.st_dev));
+}
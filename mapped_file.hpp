@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include <string>
+
+#include "io_engine.hpp"
+
+#define MAP_WINDOW 16777216  // bytes advised ahead of the cursor, and released once it is this far past them
+#define PUNCH_WINDOW 1048576  // bytes a consuming reader punches out of its file at a time
+
+// reads [begin, end) of a file front to back through a shared mapping. the kernel reads ahead
+// of the cursor, and the pages behind it are dropped from the mapping
+class MappedReader : public FileReader {
+   public:
+    // end -1 maps to the end of the file. consume punches the bytes the cursor is done with
+    // out of the file, for runs that are read once
+    MappedReader(const std::string& name, long long begin = 0, long long end = -1, bool consume = false);
+    ~MappedReader();
+    bool good();
+    ssize_t read(char* data, size_t len);
+    // the next len bytes in place, fewer at the end of the range. they stay mapped
+    // until release passes them, so callers can sort pointers into them
+    const char* next(size_t len, size_t& got);
+    // the bytes of the range before offset are not needed anymore
+    void release(long long offset);
+
+   private:
+    int fd;
+    bool consume;
+    char* map;
+    long long map_begin;  // file offset of the mapping
+    size_t map_len;
+    size_t skip;       // from the page boundary to begin
+    long long size;    // of the range
+    long long pos;     // in the range
+    size_t advised;    // the mapping up to here is advised WILLNEED
+    size_t released;   // the mapping up to here is dropped
+    size_t punched;    // the file is punched up to here of the mapping
+    void punch(size_t until);
+};
+
+// true if a range of this many bytes is better mapped than read, that is it fits in
+// the memory of the machine and the files are not open for direct io
+bool mappable(long long bytes);
+// and the file is not on a rotational disk: the page faults of many threads make a disk seek,
+// the readers go through the queue of the disk with a few large requests
+bool mappable(const std::string& name, long long bytes);
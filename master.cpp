@@ -1,6 +1,18 @@
 /**
  * Server splits the large file into small parts and transfers then to slaves.
  * Later will receive the sorted parts from slaves and merge them into one file.
+ * In range partition mode each slave gets the records of one key range, so
+ * the sorted parts only need to be concatenated.
+ * In exchange mode the slaves get contiguous parts as usual, send back a
+ * quantile sketch of their part, and then exchange records with each other
+ * so that every slave ends up with one key range.
+ * In key-only mode the slaves sort (key, record id) tuples of their key range
+ * and send back the ids, and the master moves the records into place itself.
+ * In elastic mode the input is handed out in work units while it is sent, so
+ * slaves that connect during the job take over units, or half of a unit
+ * another slave is still receiving.
+ * With a trace file the master estimates the clock offset of every slave when
+ * it sends the job, and writes the spans of all nodes into one timeline.
  * The sorting processes happen concurrently.
  * Here we can see the overhead of transferring files.
  *
@@ -13,146 +25,485 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <cerrno>
 #include <chrono>
+#include <condition_variable>
 #include <cstring>
 #include <fstream>
 #include <iostream>
 #include <mutex>
-#include <queue>
+#include <random>
 #include <string>
 #include <thread>
 #include <vector>
 
-#define BUFFER_SIZE 1000
+#include "io_engine.hpp"
+#include "local_transport.hpp"
+#include "keysort.hpp"
+#include "merge.hpp"
+#include "scratch.hpp"
+#include "storage.hpp"
+
 #define DATA_SIZE 100
+#define SAMPLES_PER_SLAVE 1000  // records sampled per slave to choose the splitters
+#define SAMPLE_READS 16         // ranged reads of consecutive records an object input is sampled with
+#define QUEUE_BLOCKS 8          // frames queued per slave in range partition mode
+#define RESULT_STREAMS 2        // results received at the same time in exchange mode
+#define UNITS_PER_SLAVE 4       // work units per slave in elastic mode
+#define MIN_SPLIT (16 * FRAME_SIZE)  // a unit with less left is not split for another slave
+#define JOIN_POLL_MS 100        // how often the elastic mode checks whether the input is sent, and a waiting receiver whether the job failed
 
 using namespace std;
 
-mutex mtx;
+Master::Master(int port, int slaveNum, string inputName, string outputName, MasterOptions options)
+    : port(port),
+      slaveNum(slaveNum),
+      inputName(inputName),
+      outputName(outputName),
+      options(options),
+      throttle(&Throttle::node()),
+      traceName(options.trace),
+      free_slots(RESULT_STREAMS) {
+    throttle.set_limits(options.limits);
+    // the key-only mode partitions the tuples by key range itself
+    if (options.key_only) {
+        this->options.range_partition = false;
+        this->options.exchange = false;
+    }
+    // the other modes fix the slaves of a job before it starts
+    if (options.range_partition || options.exchange || options.key_only || options.merge_fanin > 1) {
+        this->options.elastic = false;
+    }
+    if (!inputName.empty()) {
+        jobs.push_back(make_pair(inputName, outputName));
+    }
+}
+
+void Master::add_job(string inputName, string outputName) {
+    jobs.push_back(make_pair(inputName, outputName));
+}
+
+Master::~Master() {}
 
-struct HeapNode {
-    int index;
-    char value[DATA_SIZE];
-    HeapNode(int index, char* value) {
-        this->index = index;
-        memcpy(this->value, value, DATA_SIZE);
+// slaves on our host connected over a unix socket or loopback,
+// slaves on other hosts reach them at the address they reach us at
+uint32_t Master::peer_ip(int peer_idx, int client_idx) {
+    uint32_t ip = client_addrs[peer_idx].sin_addr.s_addr;
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    if ((ntohl(ip) >> 24) == 127 && getsockname(client_fds[client_idx], (struct sockaddr*)&addr, &addr_len) == 0 &&
+        addr.sin_family == AF_INET) {
+        ip = addr.sin_addr.s_addr;
     }
-};
+    return ip;
+}
 
-// comparator for the heap
-struct Comparator {
-    bool operator()(const HeapNode* node1, const HeapNode* node2) {
-        return memcmp(node1->value, node2->value, DATA_SIZE) > 0;
+// count the corrupt frames of a client, false once we give up after a few retransmits
+bool Master::report_corrupt(int client_idx, int frames, const char* what, int attempt) {
+    printf("Client %d: %d corrupt frames in the %s, %s.\n", client_idx, frames, what,
+           attempt < MAX_RETRANSMITS ? "sending it again" : "giving up");
+    if (attempt >= MAX_RETRANSMITS) {
+        return false;
     }
-};
+    lock_guard<mutex> lock(mtx);
+    corrupt_frames[client_idx] += frames;
+    return true;
+}
 
-Master::Master(int port, int slaveNum, string inputName, string outputName)
-    : port(port),
-      slaveNum(slaveNum),
-      inputName(inputName),
-      outputName(outputName) {}
+// the job failed: keep the first reason, and break the connections of the job,
+// so the threads waiting on the other slaves give up as well instead of waiting forever
+void Master::fail(const string& reason) {
+    lock_guard<mutex> lock(mtx);
+    if (!failure.empty()) {
+        return;
+    }
+    printf("Job failed: %s.\n", reason.c_str());
+    failure = reason;
+    for (int i = 0; i < client_fds.size(); i++) {
+        if (client_fds[i] >= 0) {
+            shutdown(client_fds[i], SHUT_RDWR);
+        }
+    }
+}
 
-Master::~Master() {}
+// close the connections we still have, the persistent clients connect again
+void Master::drop_clients() {
+    lock_guard<mutex> lock(mtx);
+    for (int i = 0; i < client_fds.size(); i++) {
+        if (client_fds[i] >= 0) {
+            close(client_fds[i]);
+        }
+    }
+    client_fds.clear();
+    client_addrs.clear();
+    listen_ports.clear();
+    persistent.clear();
+}
+
+// a client that only runs this job is done with its connection
+void Master::close_client(int client_idx) {
+    lock_guard<mutex> lock(mtx);
+    close(client_fds[client_idx]);
+    client_fds[client_idx] = -1;
+}
+
+bool Master::failed() {
+    lock_guard<mutex> lock(mtx);
+    return !failure.empty();
+}
+
+string Master::error() {
+    lock_guard<mutex> lock(mtx);
+    return failure;
+}
+
+// tell the client who it is and where to send the result
+bool Master::send_job(int client_fd, int client_idx) {
+    // the client answers our pings before it reads the job, to line up its spans with ours
+    if (tracer.enabled()) {
+        int64_t offset;
+        if (!measure_clock_offset(client_fd, offset)) {
+            fail("fail to measure the clock of client " + to_string(client_idx));
+            return false;
+        }
+        lock_guard<mutex> lock(mtx);
+        if (clock_offsets.size() <= client_idx) {
+            clock_offsets.resize(client_idx + 1, 0);
+        }
+        clock_offsets[client_idx] = offset;
+    }
+
+    JobHeader job;
+    job.slave_id = client_idx;
+    job.compress = options.transfer.compress;
+    job.parent_ip = 0;
+    job.parent_port = 0;
+    if (parents[client_idx] >= 0) {
+        job.parent_ip = peer_ip(parents[client_idx], client_idx);
+        job.parent_port = listen_ports[parents[client_idx]];
+    }
+    job.children = children[client_idx];
+    job.exchange = options.exchange;
+    job.key_only = options.key_only;
+    job.elastic = options.elastic;
+    job.limits = throttle.limits();
+    job.trace = tracer.enabled();
+    job.job_id = job_id;
+    if (!send_frame(client_fd, FRAME_JOB, &job, sizeof(job))) {
+        fail("fail to send the job to client " + to_string(client_idx));
+        return false;
+    }
+
+    // the slaves connect to each other in exchange mode
+    if (options.exchange) {
+        vector<PeerAddress> peers(slaveNum);
+        for (int i = 0; i < slaveNum; i++) {
+            peers[i].ip = peer_ip(i, client_idx);
+            peers[i].port = listen_ports[i];
+        }
+        if (!send_frame(client_fd, FRAME_PEERS, peers.data(), peers.size() * sizeof(PeerAddress))) {
+            fail("fail to send the peers to client " + to_string(client_idx));
+            return false;
+        }
+    }
+    return true;
+}
 
 void Master::thread_send(string inputName, long long pos, long long size, int client_fd, int client_idx) {
     printf("Send file to client %d...\n", client_idx);
-    ifstream input;
-    input.open(inputName, ios::in | ios::binary);
-    if (!input.good()) {
-        printf("Fail to open input file.\n");
-        close(client_fd);
-        exit(1);
-    }
 
     // calculate the time of sending file
     auto start = chrono::high_resolution_clock::now();
 
-    // read the file chunk and send to client
-    char* buffer = new char[BUFFER_SIZE];
-    input.seekg(pos);
-    while (size > 0) {
-        if (size > BUFFER_SIZE) {
-            input.read(buffer, BUFFER_SIZE);
-        } else {
-            input.read(buffer, size);
+    if (!send_job(client_fd, client_idx)) {
+        return;
+    }
+    int64_t trace_start = trace_clock();
+
+    // read the file chunk and send to client, again if the client found corrupt frames
+    char* buffer = new char[FRAME_SIZE];
+    for (int attempt = 0;; attempt++) {
+        FrameWriter writer(client_fd, options.transfer.compress);
+        writer.set_throttle(&throttle, true);
+        FileReader* input = Storage::of(inputName).open_range(inputName, pos, pos + size);
+        bool ok = input->good();
+        if (!ok) {
+            fail("fail to open the input file");
         }
-        int read_size = input.gcount();
-        int send_size = send(client_fd, buffer, read_size, 0);
-        if (send_size < 0) {
-            printf("Fail to send file to client.\n");
-            close(client_fd);
-            exit(1);
+        long long remain = size;
+        uint64_t checksum = 0;
+        while (ok && remain > 0) {
+            // whole records, so we can checksum them for the validation
+            int read_size = input->read(buffer, min(remain, (long long)FRAME_SIZE / DATA_SIZE * DATA_SIZE));
+            if (read_size <= 0) {
+                break;
+            }
+            checksum += records_checksum(buffer, read_size);
+            if (!writer.write(buffer, read_size)) {
+                fail("fail to send file to client " + to_string(client_idx));
+                ok = false;
+            }
+            remain -= read_size;
         }
-        // printf("Send %d bytes to client %d\n", send_size, client_idx);
-        memset(buffer, 0, BUFFER_SIZE);
-        size -= read_size;
-    }
 
-    // send 0 to client to indicate the end of file
-    int send_size = send(client_fd, buffer, 0, 0);
-    if (send_size < 0) {
-        printf("Fail to send file to client.\n");
-        close(client_fd);
-        exit(1);
+        delete input;
+
+        // send the end frame to indicate the end of file
+        if (ok && !writer.finish()) {
+            fail("fail to send file to client " + to_string(client_idx));
+            ok = false;
+        }
+        if (!ok) {
+            delete[] buffer;
+            return;
+        }
+        if (writer.verified()) {
+            writer.print_stats((string("Client ") + to_string(client_idx)).c_str());
+            lock_guard<mutex> lock(mtx);
+            input_checksum += checksum;
+            break;
+        }
+        if (!report_corrupt(client_idx, writer.corrupt_frames(), "shard", attempt)) {
+            fail("too many corrupt frames in the shard of client " + to_string(client_idx));
+            delete[] buffer;
+            return;
+        }
     }
 
     // calculate the time of sending file
     auto end = chrono::high_resolution_clock::now();
     auto duration = chrono::duration_cast<chrono::microseconds>(end - start);
     printf("Send file to client %d in %.2f seconds.\n", client_idx, duration.count() * 1.0 / 1000000);
-
-    // close input file
-    input.close();
+    tracer.add("send shard " + to_string(client_idx), "net", trace_start, trace_clock(), size);
 
     // free buffer
     delete[] buffer;
 
-    // close client socket
-    close(client_fd);
+    // in exchange mode the client sends a sketch of its part, and gets the splitters later
+    if (options.exchange) {
+        FrameHeader header;
+        vector<char> payload;
+        if (!recv_frame(client_fd, header, payload) || header.type != FRAME_SKETCH || !sketches[client_idx]->deserialize(payload)) {
+            fail("fail to receive the sketch of client " + to_string(client_idx));
+        }
+        return;
+    }
+
+    // close client socket, unless it runs more jobs
+    if (!persistent[client_idx]) {
+        close_client(client_idx);
+    }
+}
+
+// send the client pieces of the input until no work is left, then receive its sorted part
+// over the same connection
+void Master::thread_send_units(int client_fd, int client_idx, bool keep) {
+    printf("Send work units to client %d...\n", client_idx);
+
+    // calculate the time of sending file
+    auto start = chrono::high_resolution_clock::now();
+
+    int64_t trace_start = trace_clock();
+
+    // the first attempt takes new work, the next ones send the same ranges again
+    char* buffer = new char[FRAME_SIZE];
+    vector<WorkUnit> sent;
+    long long sent_bytes = 0;
+    for (int attempt = 0;; attempt++) {
+        FrameWriter writer(client_fd, options.transfer.compress);
+        writer.set_throttle(&throttle, true);
+        uint64_t checksum = 0;
+        int range = 0;
+        long long pos, size;
+        while (attempt == 0 ? next_chunk(client_idx, pos, size) : range < sent.size()) {
+            if (attempt == 0) {
+                if (!sent.empty() && sent.back().end == pos) {
+                    sent.back().end += size;
+                } else {
+                    sent.push_back(WorkUnit{pos, pos + size});
+                }
+                sent_bytes += size;
+            } else {
+                pos = sent[range].pos;
+                size = sent[range].end - pos;
+                range++;
+            }
+            // every piece is a ranged read of its own, a few large ones against an object store
+            FileReader* input = Storage::of(inputName).open_range(inputName, pos, pos + size);
+            bool ok = input->good();
+            if (!ok) {
+                fail("fail to open the input file");
+            }
+            while (ok && size > 0) {
+                int read_size = input->read(buffer, min(size, (long long)FRAME_SIZE / DATA_SIZE * DATA_SIZE));
+                if (read_size <= 0) {
+                    break;
+                }
+                checksum += records_checksum(buffer, read_size);
+                if (!writer.write(buffer, read_size)) {
+                    fail("fail to send file to client " + to_string(client_idx));
+                    ok = false;
+                }
+                size -= read_size;
+            }
+            delete input;
+            if (!ok) {
+                delete[] buffer;
+                return;
+            }
+        }
+
+        // send the end frame to indicate the end of file
+        if (!writer.finish()) {
+            fail("fail to send file to client " + to_string(client_idx));
+            delete[] buffer;
+            return;
+        }
+        if (writer.verified()) {
+            writer.print_stats((string("Client ") + to_string(client_idx)).c_str());
+            lock_guard<mutex> lock(mtx);
+            input_checksum += checksum;
+            break;
+        }
+        if (!report_corrupt(client_idx, writer.corrupt_frames(), "shard", attempt)) {
+            fail("too many corrupt frames in the shard of client " + to_string(client_idx));
+            delete[] buffer;
+            return;
+        }
+    }
+    delete[] buffer;
+    tracer.add("send units " + to_string(client_idx), "net", trace_start, trace_clock(), sent_bytes);
+
+    // calculate the time of sending file
+    auto end = chrono::high_resolution_clock::now();
+    auto duration = chrono::duration_cast<chrono::microseconds>(end - start);
+    printf("Send %.2f GB in %d pieces to client %d in %.2f seconds.\n", sent_bytes / 1024.0 / 1024.0 / 1024.0, (int)sent.size(),
+           client_idx, duration.count() * 1.0 / 1000000);
+
+    receive_result(client_fd, client_idx);
+    if (!keep) {
+        close_client(client_idx);
+    }
 }
 
 void Master::thread_recv(int socket_fd, int client_idx) {
-    // accept incoming connection
+    // accept incoming connection, a slave of a failed job may never connect
     struct sockaddr_in client_addr;
-    socklen_t client_addr_len = sizeof(client_addr);
-    int client_fd = accept(socket_fd, (struct sockaddr*)&client_addr, &client_addr_len);
-    if (client_fd < 0) {
-        printf("Fail to accept incoming connection.");
-        close(socket_fd);
-        exit(1);
+    int client_fd;
+    while ((client_fd = accept_peer(socket_fd, &client_addr, JOIN_POLL_MS)) < 0) {
+        if (errno != ETIMEDOUT) {
+            fail("fail to accept incoming connection");
+            return;
+        }
+        if (failed()) {
+            return;
+        }
     }
     printf("Get connection from client: [%s:%d]\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
 
+    receive_result(client_fd, client_idx);
+
+    // close client socket
+    close(client_fd);
+}
+
+// receive a sorted part, from a new connection or from the connection of a persistent client
+void Master::receive_result(int client_fd, int client_idx) {
     // calculate the time of receiving file
     auto start = chrono::high_resolution_clock::now();
 
     printf("Receive file from client %d...\n", client_idx);
 
+    // the client tells us which part it sends
+    FrameHeader header;
+    vector<char> payload;
+    if (!recv_frame(client_fd, header, payload) || header.type != FRAME_RESULT || payload.size() != sizeof(ResultHeader)) {
+        fail("fail to receive the result header of client " + to_string(client_idx));
+        return;
+    }
+    ResultHeader result;
+    memcpy(&result, payload.data(), sizeof(result));
+    if (result.slave_id >= part_names.size() || result.job_id != job_id) {
+        fail("fail to receive the result of unknown client " + to_string(result.slave_id));
+        return;
+    }
+    TraceScope span(tracer, "receive result " + to_string(result.slave_id), "net");
+
     // receive sorted parts from clients
-    string part_name = "slave";
-    part_name.append(to_string(client_idx)).append(".part");
+    string part_name = Scratch::instance().path(part_prefix + "slave" + to_string(result.slave_id) + ".part");
 
     // add mutex lock
     mtx.lock();
-    part_names.push_back(part_name);
+    part_names[result.slave_id] = part_name;
     mtx.unlock();
 
-    ofstream output(part_name, ios::out | ios::binary);
-    char* buffer = new char[4096];
-    ssize_t len;
-    while (true) {
-        len = recv(client_fd, buffer, sizeof(buffer), 0);
+    // in exchange mode only a few clients may send at the same time
+    if (options.exchange) {
+        unique_lock<mutex> lock(mtx);
+        slot_cv.wait(lock, [this] { return free_slots > 0; });
+        free_slots--;
+    }
+
+    // the client sends the part again if we found corrupt frames in it
+    char* buffer = new char[FRAME_SIZE];
+    string error;
+    for (int attempt = 0; error.empty(); attempt++) {
+        BlockWriter output(part_name);
+        FrameReader reader(client_fd);
+        reader.set_throttle(&throttle, true);
+        if (options.exchange && !reader.set_flow_control(CREDIT_WINDOW)) {
+            error = "fail to receive file from client " + to_string(client_idx);
+            break;
+        }
+        ssize_t len;
+        while ((len = reader.read(buffer, FRAME_SIZE)) > 0) {
+            throttle.disk(len);
+            output.write(buffer, len);
+            span.add_bytes(len);
+        }
         if (len < 0) {
-            printf("Fail to receive file.\n");
-            close(client_fd);
-            exit(1);
-        } else if (len == 0) {
+            error = "fail to receive file from client " + to_string(client_idx);
+        } else if (!output.close()) {
+            error = "fail to write the received part of client " + to_string(client_idx);
+        } else if (reader.verified()) {
             break;
+        } else if (!report_corrupt(result.slave_id, reader.corrupt_frames(), "result", attempt)) {
+            error = "too many corrupt frames in the result of client " + to_string(result.slave_id);
         }
-        // printf("Received %ld bytes.\n", len);
-        output.write(buffer, len);
     }
-    output.close();
+
+    // the client summarized its part while sending it
+    if (error.empty() && (!recv_frame(client_fd, header, payload) || header.type != FRAME_SUMMARY || payload.size() != sizeof(Summary))) {
+        error = "fail to receive the summary of client " + to_string(client_idx);
+    }
+    if (error.empty()) {
+        lock_guard<mutex> lock(mtx);
+        memcpy(&summaries[result.slave_id], payload.data(), sizeof(Summary));
+    }
+
+    // and then its spans and those of its children
+    if (error.empty() && tracer.enabled()) {
+        if (!recv_frame(client_fd, header, payload) || header.type != FRAME_TRACE || payload.size() % sizeof(TraceSpan) != 0) {
+            error = "fail to receive the trace of client " + to_string(client_idx);
+        } else {
+            vector<TraceSpan> spans(payload.size() / sizeof(TraceSpan));
+            memcpy(spans.data(), payload.data(), payload.size());
+            tracer.add_spans(spans);
+        }
+    }
+
+    // the slot is given back on failure too, the other results are still received
+    if (options.exchange) {
+        lock_guard<mutex> lock(mtx);
+        free_slots++;
+        slot_cv.notify_one();
+    }
+    if (!error.empty()) {
+        fail(error);
+        delete[] buffer;
+        return;
+    }
 
     // calculate the time of receiving file
     auto end = chrono::high_resolution_clock::now();
@@ -161,127 +512,516 @@ void Master::thread_recv(int socket_fd, int client_idx) {
 
     // free buffer
     delete[] buffer;
-
-    // close client socket
-    close(client_fd);
 }
 
-// k-way merge
-void Master::merge() {
+// k-way merge, false if the output could not be written or is not valid
+bool Master::merge() {
     printf("Merge the sorted parts...\n");
 
-    // open the output file
-    ofstream output(outputName, ios::out | ios::binary);
-    priority_queue<HeapNode*, vector<HeapNode*>, Comparator> heap;
-
     // calculate the time of merging
     auto start = chrono::high_resolution_clock::now();
+    TraceScope span(tracer, options.key_only ? "gather" : options.range_partition || options.exchange ? "concat" : "merge", "disk");
 
-    // open all the part files
-    vector<ifstream> part_files;
+    // slaves that merged the results of other slaves leave gaps
+    vector<string> names;
     for (int i = 0; i < part_names.size(); i++) {
-        ifstream part_file(part_names[i], ios::in | ios::binary);
-        part_files.push_back(move(part_file));
+        if (!part_names[i].empty()) {
+            names.push_back(part_names[i]);
+        }
+    }
+    // the summary of the output: the parts are in key order when they are concatenated,
+    // otherwise we summarize what we merge
+    Summary total;
+    memset(&total, 0, sizeof(total));
+    // an output in the object store is put together in scratch, then uploaded in parallel parts
+    string target = Storage::local(outputName) ? outputName : Scratch::instance().path("staged.output");
+    bool written;
+    if (options.key_only) {
+        // the slave results are the record ids in key order, the records are still in the input
+        written = gather_records(names, inputName, target, &total);
+    } else if (options.range_partition || options.exchange) {
+        written = concat_files(names, target, &throttle);
+        for (int i = 0; i < part_names.size(); i++) {
+            if (!part_names[i].empty()) {
+                combine_summaries(total, summaries[i]);
+            }
+        }
+    } else {
+        written = merge_files(names, target, &total, &throttle);
+    }
+    if (target != outputName) {
+        written = written && Storage::copy(target, outputName);
+        Scratch::instance().remove(target);
+    }
+    if (!written) {
+        fail("fail to write the output file");
+        return false;
+    }
+
+    // calculate the time of merging
+    auto end = chrono::high_resolution_clock::now();
+    auto duration = chrono::duration_cast<chrono::microseconds>(end - start);
+    printf("Merge the sorted parts in %.2f seconds.\n", duration.count() * 1.0 / 1000000);
+
+    // a job whose output lost or reordered records failed like one whose output could not be written
+    if (!validate(total)) {
+        fail("validation failed");
+        return false;
     }
+    return true;
+}
 
-    // read the first record of each part file
-    char* buffer = new char[DATA_SIZE];
-    for (int i = 0; i < part_files.size(); i++) {
-        part_files[i].read(buffer, DATA_SIZE);
-        if (part_files[i].gcount() > 0) {
-            HeapNode* node = new HeapNode(i, buffer);
-            heap.push(node);
+// the output is valid if it is in order and has the records of the input
+bool Master::validate(const Summary& output) {
+    printf("Validate the output...\n");
+    bool valid = print_summary(output);
+    if (output.rec_count != input_records || output.checksum != input_checksum) {
+        printf("ERROR - the output has %llu records with checksum %llx, the input has %llu records with checksum %llx\n",
+               (unsigned long long)output.rec_count, (unsigned long long)output.checksum, (unsigned long long)input_records,
+               (unsigned long long)input_checksum);
+        valid = false;
+    }
+    return valid;
+}
+
+void Master::thread_send_queue(int client_fd, int client_idx) {
+    // a failed sender takes the blocks off its queue all the same, so the routing does not wait for it
+    vector<char> block;
+    if (!send_job(client_fd, client_idx)) {
+        while (queues[client_idx]->pop(block)) {
         }
+        return;
     }
+    TraceScope span(tracer, "send range " + to_string(client_idx), "net");
 
-    // get the smallest record from the heap and write it to the output file
-    while (!heap.empty()) {
-        HeapNode* node = heap.top();
-        heap.pop();
-        output.write(node->value, DATA_SIZE);
+    // the routed blocks are gone once sent, so a corrupt stream is routed again from the input
+    bool ok = true;
+    for (int attempt = 0;; attempt++) {
+        FrameWriter writer(client_fd, options.transfer.compress);
+        writer.set_throttle(&throttle, true);
+        if (attempt == 0) {
+            while (queues[client_idx]->pop(block)) {
+                span.add_bytes(block.size());
+                ok = ok && writer.write(block.data(), block.size());
+            }
+        } else {
+            ok = reroute(writer, client_idx);
+        }
+        if (!ok || !writer.finish()) {
+            fail("fail to send file to client " + to_string(client_idx));
+            return;
+        }
+        if (writer.verified()) {
+            writer.print_stats((string("Client ") + to_string(client_idx)).c_str());
+            break;
+        }
+        if (!report_corrupt(client_idx, writer.corrupt_frames(), "key range", attempt)) {
+            fail("too many corrupt frames in the key range of client " + to_string(client_idx));
+            return;
+        }
+    }
+    if (!persistent[client_idx]) {
+        close_client(client_idx);
+    }
+}
 
-        // read the next record of the part file
-        // if the part file is not empty, push the record to the heap
-        part_files[node->index].read(buffer, DATA_SIZE);
-        if (part_files[node->index].gcount() > 0) {
-            HeapNode* next_node = new HeapNode(node->index, buffer);
-            heap.push(next_node);
+// send the key range of a client again, read from the input like route does
+bool Master::reroute(FrameWriter& writer, int client_idx) {
+    FileReader* input = Storage::of(inputName).open_range(inputName);
+    bool ok = input->good();
+    char* buffer = new char[FRAME_SIZE];
+    vector<char> block;
+    block.reserve(FRAME_SIZE);
+    char tuple[TUPLE_SIZE];
+    uint64_t id = 0;
+    int read_size = 0;
+    while (ok && !failed() && (read_size = input->read(buffer, FRAME_SIZE / DATA_SIZE * DATA_SIZE)) > 0) {
+        block.clear();
+        for (int off = 0; off + DATA_SIZE <= read_size; off += DATA_SIZE, id++) {
+            const char* record = buffer + off;
+            if (range_of(record) != client_idx) {
+                continue;
+            }
+            if (options.key_only) {
+                make_tuple(tuple, record, id);
+                block.insert(block.end(), tuple, tuple + TUPLE_SIZE);
+            } else {
+                block.insert(block.end(), record, record + DATA_SIZE);
+            }
         }
+        ok = block.empty() || writer.write(block.data(), block.size());
+    }
+    delete[] buffer;
+    delete input;
+    return ok && read_size == 0;
+}
 
-        delete node;
+// choose slaveNum - 1 splitters from records spread evenly over the input
+void Master::sample_splitters(long long recNum) {
+    long long sampleNum = min(recNum, (long long)SAMPLES_PER_SLAVE * slaveNum);
+    vector<string> samples;
+    char record[DATA_SIZE];
+    if (Storage::local(inputName)) {
+        ifstream input(inputName, ios::in | ios::binary);
+        for (long long i = 0; i < sampleNum; i++) {
+            input.seekg(i * recNum / sampleNum * DATA_SIZE);
+            input.read(record, DATA_SIZE);
+            samples.push_back(string(record, DATA_SIZE));
+        }
+    } else {
+        // a request per record takes the latency of the object store thousands of times,
+        // a few ranged reads of consecutive records spread over the input take it a few times
+        Storage& storage = Storage::of(inputName);
+        long long reads = min(sampleNum, (long long)SAMPLE_READS);
+        for (long long r = 0; r < reads; r++) {
+            long long first = r * recNum / reads;
+            long long count = (r + 1) * sampleNum / reads - r * sampleNum / reads;
+            FileReader* input = storage.open_range(inputName, first * DATA_SIZE, (first + count) * DATA_SIZE);
+            while (input->read(record, DATA_SIZE) == DATA_SIZE) {
+                samples.push_back(string(record, DATA_SIZE));
+            }
+            delete input;
+        }
     }
+    sort(samples.begin(), samples.end());
 
-    // free buffer
+    splitters.clear();
+    for (int i = 1; i < slaveNum && !samples.empty(); i++) {
+        splitters.push_back(samples[i * samples.size() / slaveNum]);
+    }
+}
+
+// the client owning the key range of a record, by the key alone in key-only mode so equal keys stay together
+int Master::range_of(const char* record) {
+    int compare_size = options.key_only ? KEY_SIZE : DATA_SIZE;
+    return upper_bound(splitters.begin(), splitters.end(), record,
+                       [compare_size](const char* r, const string& splitter) {
+                           return memcmp(r, splitter.data(), compare_size) < 0;
+                       }) -
+           splitters.begin();
+}
+
+// read the input once and send each record to the slave owning its key range,
+// in key-only mode the tuple of the record, routed by the key alone so equal keys stay together
+void Master::route() {
+    auto start = chrono::high_resolution_clock::now();
+    TraceScope span(tracer, "route", "cpu");
+
+    vector<thread> threads;
+    for (int i = 0; i < slaveNum; i++) {
+        queues.push_back(new BlockQueue(QUEUE_BLOCKS));
+        threads.push_back(thread(&Master::thread_send_queue, this, client_fds[i], i));
+    }
+
+    FileReader* input = Storage::of(inputName).open_range(inputName);
+    if (!input->good()) {
+        fail("fail to open the input file");
+    }
+
+    int item_size = options.key_only ? TUPLE_SIZE : DATA_SIZE;
+    vector<vector<char>> blocks(slaveNum);
+    vector<long long> counts(slaveNum, 0);
+    char* buffer = new char[FRAME_SIZE];
+    char tuple[TUPLE_SIZE];
+    uint64_t id = 0;
+    int read_size;
+    while (!failed() && (read_size = input->read(buffer, FRAME_SIZE / DATA_SIZE * DATA_SIZE)) > 0) {
+        for (int off = 0; off + DATA_SIZE <= read_size; off += DATA_SIZE, id++) {
+            const char* record = buffer + off;
+            int idx = range_of(record);
+            vector<char>& block = blocks[idx];
+            if (options.key_only) {
+                make_tuple(tuple, record, id);
+                block.insert(block.end(), tuple, tuple + TUPLE_SIZE);
+            } else {
+                block.insert(block.end(), record, record + DATA_SIZE);
+            }
+            counts[idx]++;
+            input_checksum += records_checksum(record, DATA_SIZE);
+            if (block.size() + item_size > FRAME_SIZE) {
+                queues[idx]->push(move(block));
+                block = vector<char>();
+            }
+        }
+    }
     delete[] buffer;
+    delete input;
 
-    // close all the part files
-    for (int i = 0; i < part_files.size(); i++) {
-        part_files[i].close();
+    for (int i = 0; i < slaveNum; i++) {
+        if (!blocks[i].empty()) {
+            queues[i]->push(move(blocks[i]));
+        }
+        queues[i]->close();
+    }
+    for (int i = 0; i < threads.size(); i++) {
+        threads[i].join();
     }
-    output.close();
+    for (int i = 0; i < slaveNum; i++) {
+        printf("Client %d gets %lld records.\n", i, counts[i]);
+        delete queues[i];
+    }
+    queues.clear();
 
-    // calculate the time of merging
     auto end = chrono::high_resolution_clock::now();
     auto duration = chrono::duration_cast<chrono::microseconds>(end - start);
-    printf("Merge the sorted parts in %.2f seconds.\n", duration.count() * 1.0 / 1000000);
+    printf("Route file to clients in %.2f seconds.\n", duration.count() * 1.0 / 1000000);
 }
 
-int Master::run() {
-    // calculate the total time of running
-    auto start = chrono::high_resolution_clock::now();
+// merge the sketches of the clients and tell every client the key ranges
+void Master::send_splitters() {
+    if (failed()) {
+        for (int i = 0; i < sketches.size(); i++) {
+            delete sketches[i];
+        }
+        sketches.clear();
+        return;
+    }
+    for (int i = 1; i < slaveNum; i++) {
+        sketches[0]->merge(*sketches[i]);
+    }
+    vector<string> splitters = sketches[0]->splitters(slaveNum);
+    string payload;
+    for (int i = 0; i < splitters.size(); i++) {
+        payload += splitters[i];
+    }
+    for (int i = 0; i < slaveNum; i++) {
+        if (!send_frame(client_fds[i], FRAME_SPLITTERS, payload.data(), payload.size())) {
+            fail("fail to send the splitters to client " + to_string(i));
+        }
+        if (!persistent[i]) {
+            close_client(i);
+        }
+        delete sketches[i];
+    }
+    sketches.clear();
+}
 
-    // create socket, AF_INET = IPv4, SOCK_STREAM = TCP
-    int socket_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (socket_fd < 0) {
-        printf("Fail to create a socket.");
+// hand out the input in work units to the slaves we have, and to slaves that join while we send
+void Master::send_units(int socket_fd, long long recNum) {
+    long long unitRecNum = max(1LL, recNum / ((long long)slaveNum * UNITS_PER_SLAVE));
+    units.clear();
+    for (long long rec = 0; rec < recNum; rec += unitRecNum) {
+        units.push_back(WorkUnit{rec * DATA_SIZE, min(rec + unitRecNum, recNum) * DATA_SIZE});
     }
+    current.assign(slaveNum, WorkUnit{0, 0});
 
-    // set reuse address
-    int reuse_addr = 1;
-    setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, (void*)&reuse_addr, sizeof(reuse_addr));
+    vector<thread> threads;
+    // a slave we could not send the job fails the job, its sender finds the connection broken
+    for (int i = 0; i < slaveNum; i++) {
+        send_job(client_fds[i], i);
+        threads.push_back(thread(&Master::thread_send_units, this, client_fds[i], i, (bool)persistent[i]));
+    }
+    accepting = true;
+    thread joins(&Master::accept_joins, this, socket_fd);
 
-    // set server address
-    struct sockaddr_in server_addr;
-    server_addr.sin_family = AF_INET;          // IPv4
-    server_addr.sin_port = htons(port);        // port
-    server_addr.sin_addr.s_addr = INADDR_ANY;  // Any IP address
+    // once the first slaves found no more work, slaves joining now would not find any either
+    for (int i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+    mtx.lock();
+    accepting = false;
+    mtx.unlock();
+    joins.join();
+    for (int i = 0; i < joined.size(); i++) {
+        joined[i].join();
+    }
+    joined.clear();
+}
 
-    // bind socket to address
-    if (bind(socket_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        printf("Fail to bind socket to address.");
-        close(socket_fd);
-        exit(1);
+// register the slaves that connect during the job, and give them work if there is enough left
+void Master::accept_joins(int socket_fd) {
+    while (true) {
+        mtx.lock();
+        bool stop = !accepting;
+        mtx.unlock();
+        if (stop) {
+            return;
+        }
+        if (!accept_slave(socket_fd, JOIN_POLL_MS)) {
+            continue;
+        }
+
+        int client_idx = client_fds.size() - 1;
+        mtx.lock();
+        current.resize(client_idx + 1, WorkUnit{0, 0});
+        bool has_work = accepting && take_unit(client_idx);
+        if (has_work) {
+            part_names.resize(client_idx + 1);
+            summaries.resize(client_idx + 1);
+            corrupt_frames.resize(client_idx + 1);
+            parents.resize(client_idx + 1, -1);
+            children.resize(client_idx + 1, 0);
+            slaveNum = client_idx + 1;
+        }
+        mtx.unlock();
+
+        // it waits for the next job like any other slave
+        if (!has_work) {
+            printf("Client %d joined too late for this job.\n", client_idx);
+            continue;
+        }
+        printf("Client %d joins the job.\n", client_idx);
+        if (!send_job(client_fds[client_idx], client_idx)) {
+            continue;
+        }
+        joined.push_back(thread(&Master::thread_send_units, this, client_fds[client_idx], client_idx, (bool)persistent[client_idx]));
     }
+}
 
-    printf("Server is listening on port %d\n", port);
+// give the client the next unit, or split off the second half of what another
+// client has left of its unit when all units are handed out. called with mtx held
+bool Master::take_unit(int client_idx) {
+    if (!units.empty()) {
+        current[client_idx] = units.front();
+        units.pop_front();
+        return true;
+    }
+    int victim = -1;
+    long long most = MIN_SPLIT;
+    for (int i = 0; i < current.size(); i++) {
+        if (current[i].end - current[i].pos > most) {
+            victim = i;
+            most = current[i].end - current[i].pos;
+        }
+    }
+    if (victim < 0) {
+        return false;
+    }
+    long long mid = current[victim].pos + most / 2 / DATA_SIZE * DATA_SIZE;
+    current[client_idx] = WorkUnit{mid, current[victim].end};
+    current[victim].end = mid;
+    printf("Client %d takes over %.2f MB from client %d.\n", client_idx, (current[client_idx].end - mid) / 1024.0 / 1024.0, victim);
+    return true;
+}
 
-    // listen for incoming connections
-    if (listen(socket_fd, slaveNum) < 0) {
-        printf("Fail to listen.");
-        close(socket_fd);
-        exit(1);
+// the next piece of the input to send to the client, false when no work is left
+bool Master::next_chunk(int client_idx, long long& pos, long long& size) {
+    lock_guard<mutex> lock(mtx);
+    WorkUnit& unit = current[client_idx];
+    if (unit.pos == unit.end && !take_unit(client_idx)) {
+        return false;
     }
+    pos = unit.pos;
+    size = min(unit.end - pos, (long long)FRAME_SIZE / DATA_SIZE * DATA_SIZE);
+    unit.pos += size;
+    return true;
+}
 
-    // wait until we have reached the number of slaves
+// group the slaves so that each group leader merges the results of its group,
+// until at most merge_fanin results are left for the master to merge
+int Master::build_merge_tree() {
+    parents.assign(slaveNum, -1);
+    children.assign(slaveNum, 0);
+    if (options.merge_fanin < 2 || options.range_partition || options.exchange || options.key_only) {
+        return slaveNum;
+    }
+
+    vector<int> streams;
+    for (int i = 0; i < slaveNum; i++) {
+        streams.push_back(i);
+    }
+    while (streams.size() > options.merge_fanin) {
+        vector<int> leaders;
+        for (int i = 0; i < streams.size(); i += options.merge_fanin) {
+            int leader = streams[i];
+            for (int j = i + 1; j < streams.size() && j < i + options.merge_fanin; j++) {
+                parents[streams[j]] = leader;
+                children[leader]++;
+                printf("Client %d sends its result to client %d\n", streams[j], leader);
+            }
+            leaders.push_back(leader);
+        }
+        streams = leaders;
+    }
+    return streams.size();
+}
+
+void Master::add_slave(int client_fd, struct sockaddr_in client_addr, int listen_port) {
+    lock_guard<mutex> lock(mtx);
+    client_fds.push_back(client_fd);
+    client_addrs.push_back(client_addr);
+    listen_ports.push_back(listen_port);
+    persistent.push_back(true);
+}
+
+// new limits for the running job, passed on to the slaves on the streams to and from them
+void Master::set_limits(const IoLimits& limits) {
+    throttle.set_limits(limits);
+}
+
+// keeps the part files of jobs running at the same time apart
+void Master::set_part_prefix(string prefix) {
+    part_prefix = prefix;
+}
+
+// wait until we have reached the number of slaves
+void Master::accept_slaves(int socket_fd) {
     while (client_fds.size() < slaveNum) {
-        // accept incoming connection
-        struct sockaddr_in client_addr;
-        socklen_t client_addr_len = sizeof(client_addr);
-        int client_fd = accept(socket_fd, (struct sockaddr*)&client_addr, &client_addr_len);
-        if (client_fd < 0) {
-            printf("Fail to accept incoming connection.");
-            close(socket_fd);
-            exit(1);
+        accept_slave(socket_fd, -1);
+    }
+}
+
+// accept one slave, false if nobody connected within timeout_ms or the slave did not say hello
+bool Master::accept_slave(int socket_fd, int timeout_ms) {
+    // accept incoming connection
+    struct sockaddr_in client_addr;
+    int client_fd = accept_peer(socket_fd, &client_addr, timeout_ms);
+    if (client_fd < 0) {
+        if (errno != ETIMEDOUT) {
+            printf("Fail to accept incoming connection.\n");
         }
+        return false;
+    }
+
+    // the client tells us the port other clients can reach it on
+    FrameHeader header;
+    vector<char> payload;
+    if (!recv_frame(client_fd, header, payload) || header.type != FRAME_HELLO || payload.size() != sizeof(SlaveHello)) {
+        printf("Fail to receive hello from client.\n");
+        close(client_fd);
+        return false;
+    }
+    SlaveHello hello;
+    memcpy(&hello, payload.data(), sizeof(hello));
+
+    // add client socket fd to vector, a failing job may be breaking the connections in the list
+    lock_guard<mutex> lock(mtx);
+    client_fds.push_back(client_fd);
+    client_addrs.push_back(client_addr);
+    listen_ports.push_back(hello.listen_port);
+    persistent.push_back(hello.persistent);
+    printf("Get connection from %sclient: [%s:%d]\n", hello.persistent ? "persistent " : "", inet_ntoa(client_addr.sin_addr),
+           ntohs(client_addr.sin_port));
+    return true;
+}
 
-        // add client socket fd to vector
-        client_fds.push_back(client_fd);
-        printf("Get connection from client: [%s:%d]\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+int Master::run_job(int socket_fd) {
+    // calculate the total time of running
+    auto start = chrono::high_resolution_clock::now();
+    tracer.start(!traceName.empty(), -1);
+    clock_offsets.clear();
+    int64_t trace_start = trace_clock();
+    failure.clear();
+    job_id = random_device()();
+
+    // in elastic mode the job runs on every slave we have, and the ones joining later;
+    // slaveNum is only the number of slaves to start with
+    int minSlaves = slaveNum;
+    if (options.elastic) {
+        slaveNum = client_fds.size();
+    }
+
+    // the key-only mode gathers the records from the input one by one, too many requests for an object store
+    if (options.key_only && !Storage::local(inputName)) {
+        printf("Fail to sort the keys of an object input, the key-only mode needs a local input.\n");
+        failure = "the key-only mode needs a local input";
+        return 1;
     }
 
-    struct stat stat_buf;
-    int rc = stat(inputName.c_str(), &stat_buf);
-    double file_size = rc == 0 ? stat_buf.st_size : -1;
+    // decide who sends the sorted result to whom
+    build_merge_tree();
+
+    double file_size = Storage::of(inputName).size(inputName);
     printf("file size: %.2f GB\n", file_size / 1024.0 / 1024.0 / 1024.0);
 
     // divide the file into 5 parts and send to clients
@@ -291,31 +1031,61 @@ int Master::run() {
     int remainRecNum = (int)recNum % slaveNum;
 
     vector<thread> threads;
-    long long currPos = 0;
-    for (int i = 0; i < slaveNum; i++) {
-        long long size = partRecNum * 100;
-        if (remainRecNum > 0) {
-            size += 100;
-            remainRecNum--;
+    corrupt_frames.assign(slaveNum, 0);
+    summaries.assign(slaveNum, Summary());
+    part_names.assign(slaveNum, "");
+    input_records = recNum;
+    input_checksum = 0;
+    if (options.elastic) {
+        // the senders receive the sorted parts too
+        send_units(socket_fd, recNum);
+    } else if (options.range_partition || options.key_only) {
+        sample_splitters(recNum);
+        route();
+    } else {
+        for (int i = 0; options.exchange && i < slaveNum; i++) {
+            sketches.push_back(new QuantileSketch(DATA_SIZE));
         }
-        threads.push_back(thread(&Master::thread_send, this, inputName, currPos, size, client_fds[i], i));
-        currPos += size;
-    }
 
-    for (int i = 0; i < threads.size(); i++) {
-        threads[i].join();
-    }
-    threads.clear();
+        long long currPos = 0;
+        for (int i = 0; i < slaveNum; i++) {
+            long long size = partRecNum * 100;
+            if (remainRecNum > 0) {
+                size += 100;
+                remainRecNum--;
+            }
+            threads.push_back(thread(&Master::thread_send, this, inputName, currPos, size, client_fds[i], i));
+            currPos += size;
+        }
 
-    // remove the original input file
-    remove(inputName.c_str());
+        for (int i = 0; i < threads.size(); i++) {
+            threads[i].join();
+        }
+        threads.clear();
 
-    // clear client socket fds
-    client_fds.clear();
+        if (options.exchange) {
+            send_splitters();
+        }
+    }
 
-    // receive sorted parts from clients
-    for (int i = 0; i < slaveNum; i++) {
-        threads.push_back(thread(&Master::thread_recv, this, socket_fd, i));
+    // remove the original input file, unless the records still have to be moved to the output
+    // or the job failed before the slaves had them all. an input in the object store stays where it is
+    if (!options.key_only && Storage::local(inputName) && !failed()) {
+        remove(inputName.c_str());
+    }
+
+    // receive sorted parts from clients, persistent clients send them over their own connection
+    int streamNum = 0;
+    for (int i = 0; i < slaveNum && !options.elastic && !failed(); i++) {
+        if (parents[i] >= 0) {
+            continue;
+        }
+        if (persistent[i]) {
+            threads.push_back(thread(&Master::receive_result, this, client_fds[i], i));
+        } else {
+            threads.push_back(thread(&Master::thread_recv, this, socket_fd, streamNum));
+        }
+        streamNum++;
     }
 
     for (int i = 0; i < threads.size(); i++) {
@@ -325,20 +1095,125 @@ int Master::run() {
     threads.clear();
 
     // merge all parts from slaves
-    merge();
+    if (!failed() && merge() && options.key_only) {
+        remove(inputName.c_str());
+    }
 
     // remove the part files
     for (int i = 0; i < part_names.size(); i++) {
-        remove(part_names[i].c_str());
+        if (!part_names[i].empty()) {
+            Scratch::instance().remove(part_names[i]);
+        }
     }
 
-    // closing the listening socket
-    close(socket_fd);
+    // the connections of a failed job are broken, whoever owns them closes them
+    if (failed()) {
+        slaveNum = minSlaves;
+        return 1;
+    }
+
+    // only persistent clients stay for the next job, and the ones that joined too late for this one
+    int kept = 0;
+    for (int i = 0; i < client_fds.size(); i++) {
+        if (persistent[i] || i >= slaveNum) {
+            client_fds[kept] = client_fds[i];
+            client_addrs[kept] = client_addrs[i];
+            listen_ports[kept] = listen_ports[i];
+            persistent[kept] = persistent[i];
+            kept++;
+        }
+    }
+    client_fds.resize(kept);
+    client_addrs.resize(kept);
+    listen_ports.resize(kept);
+    persistent.resize(kept);
+
+    for (int i = 0; i < slaveNum; i++) {
+        if (corrupt_frames[i] > 0) {
+            printf("Client %d: %d corrupt frames, sent again.\n", i, corrupt_frames[i]);
+        }
+    }
 
     // calculate the total time of running
     auto end = chrono::high_resolution_clock::now();
     auto duration = chrono::duration_cast<chrono::microseconds>(end - start);
     printf("Total running time: %.2f seconds for file size: %.2f GB with %d slaves\n", duration.count() * 1.0 / 1000000, file_size / 1024.0 / 1024.0 / 1024.0, slaveNum);
+    slaveNum = minSlaves;
+
+    // one timeline of all nodes, on our clock
+    if (tracer.enabled()) {
+        tracer.add("job", "job", trace_start, trace_clock());
+        if (!write_trace(traceName, tracer.spans(), clock_offsets)) {
+            printf("Fail to write trace to %s.\n", traceName.c_str());
+        } else {
+            printf("Trace written to %s\n", traceName.c_str());
+        }
+    }
 
     return 0;
 }
+
+int Master::run() {
+    // create socket, AF_INET = IPv4, SOCK_STREAM = TCP
+    int socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (socket_fd < 0) {
+        printf("Fail to create a socket.");
+    }
+
+    // set reuse address
+    int reuse_addr = 1;
+    setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, (void*)&reuse_addr, sizeof(reuse_addr));
+
+    // set server address
+    struct sockaddr_in server_addr;
+    server_addr.sin_family = AF_INET;          // IPv4
+    server_addr.sin_port = htons(port);        // port
+    server_addr.sin_addr.s_addr = INADDR_ANY;  // Any IP address
+
+    // bind socket to address
+    if (bind(socket_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        printf("Fail to bind socket to address.");
+        close(socket_fd);
+        exit(1);
+    }
+
+    printf("Server is listening on port %d\n", port);
+    listen_local(socket_fd, port);
+
+    // listen for incoming connections
+    if (listen(socket_fd, slaveNum) < 0) {
+        printf("Fail to listen.");
+        close(socket_fd);
+        exit(1);
+    }
+
+    // run the jobs one after the other, slaves that only run one job are replaced by new ones,
+    // and so are all slaves of a failed job
+    int failed_jobs = 0;
+    for (int i = 0; i < jobs.size(); i++) {
+        inputName = jobs[i].first;
+        outputName = jobs[i].second;
+        printf("Job %d: %s -> %s\n", i, inputName.c_str(), outputName.c_str());
+        // every job gets a trace of its own
+        if (!options.trace.empty() && jobs.size() > 1) {
+            traceName = options.trace + "." + to_string(i);
+        }
+        accept_slaves(socket_fd);
+        if (run_job(socket_fd) != 0) {
+            failed_jobs++;
+            drop_clients();
+        }
+    }
+
+    // persistent clients wait for the next master when we close their connection
+    drop_clients();
+
+    // closing the listening socket
+    close_listener(socket_fd);
+
+    if (failed_jobs > 0) {
+        printf("%d of %d jobs failed.\n", failed_jobs, (int)jobs.size());
+        return 1;
+    }
+    return 0;
+}
\ No newline at end of file
@@ -1,20 +1,115 @@
+#pragma once
+
+#include <netinet/in.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 
+#include "quantile_sketch.hpp"
+#include "summary.hpp"
+#include "throttle.hpp"
+#include "trace.hpp"
+#include "transfer.hpp"
+
+struct MasterOptions {
+    TransferOptions transfer;
+    int merge_fanin = 0;           // > 1: slaves merge each other's results in groups of this size
+    bool range_partition = false;  // send each slave a key range, so the results are only concatenated
+    bool exchange = false;         // slaves exchange key ranges with each other, so the results are only concatenated
+    bool key_only = false;         // slaves sort (key, record id) tuples by key range, the master moves the records
+    bool elastic = false;          // slaves may join while the input is sent and take over part of the work
+    IoLimits limits = {0, 0};      // network and scratch disk limits of the job
+    std::string trace;             // chrome trace of the job across all nodes, empty for none
+};
+
+// a contiguous piece of the input, in bytes
+struct WorkUnit {
+    long long pos;
+    long long end;
+};
+
 class Master {
    public:
-    Master(int port, int slaveNum, std::string inputName, std::string outputName);
+    Master(int port, int slaveNum, std::string inputName, std::string outputName, MasterOptions options);
     ~Master();
+    // queue another input/output pair, run() sorts them one after the other
+    void add_job(std::string inputName, std::string outputName);
     int run();
+    // used by the service: run the current job on slaves registered elsewhere
+    void add_slave(int client_fd, struct sockaddr_in client_addr, int listen_port);
+    void set_part_prefix(std::string prefix);
+    void set_limits(const IoLimits& limits);
+    // 0, or 1 if the job failed: the slaves of a failed job are left with broken connections
+    int run_job(int socket_fd);
+    // why the last job failed
+    std::string error();
     void thread_send(std::string inputName, long long pos, long long size, int client_fd, int client_idx);
+    void thread_send_queue(int client_fd, int client_idx);
+    void thread_send_units(int client_fd, int client_idx, bool keep);
     void thread_recv(int socket_fd, int client_idx);
-    void merge();
+    void receive_result(int client_fd, int client_idx);
+    bool merge();
 
    private:
     int port;
     int slaveNum;
     std::string inputName;
     std::string outputName;
+    MasterOptions options;
+    Throttle throttle;
+    Tracer tracer;
+    std::string traceName;               // of the current job
+    // the jobs of the service run side by side, each with its own lock and result slots
+    std::mutex mtx;
+    std::condition_variable slot_cv;  // limits the results received at the same time in exchange mode
+    int free_slots;
+    std::vector<int64_t> clock_offsets;  // clock of each slave minus ours, in microseconds
     std::vector<int> client_fds;
+    std::vector<struct sockaddr_in> client_addrs;
+    std::vector<int> listen_ports;
+    std::vector<bool> persistent;
+    std::vector<std::pair<std::string, std::string>> jobs;
+    std::string part_prefix;
+    std::vector<int> parents;
+    std::vector<int> children;
     std::vector<std::string> part_names;
+    std::vector<std::string> splitters;
+    std::vector<BlockQueue*> queues;
+    std::vector<QuantileSketch*> sketches;
+    void accept_slaves(int socket_fd);
+    bool accept_slave(int socket_fd, int timeout_ms);
+    int build_merge_tree();
+    uint32_t peer_ip(int peer_idx, int client_idx);
+    std::vector<int> corrupt_frames;
+    std::vector<Summary> summaries;
+    uint64_t input_records;
+    uint64_t input_checksum;  // of the records we sent, to check the output against
+    bool validate(const Summary& output);
+    bool report_corrupt(int client_idx, int frames, const char* what, int attempt);
+    std::string failure;  // why the current job failed, empty while it runs
+    uint32_t job_id;      // new for every job, the slaves put it on their results
+    void fail(const std::string& reason);
+    bool failed();
+    void close_client(int client_idx);
+    void drop_clients();
+    bool send_job(int client_fd, int client_idx);
+    void sample_splitters(long long recNum);
+    void route();
+    int range_of(const char* record);
+    bool reroute(FrameWriter& writer, int client_idx);
+    void send_splitters();
+    // elastic mode
+    std::deque<WorkUnit> units;         // not handed out yet
+    std::vector<WorkUnit> current;      // what each slave has left of its unit
+    std::vector<std::thread> joined;    // senders of the slaves that joined
+    bool accepting;
+    void send_units(int socket_fd, long long recNum);
+    void accept_joins(int socket_fd);
+    bool take_unit(int client_idx);
+    bool next_chunk(int client_idx, long long& pos, long long& size);
 };
\ No newline at end of file
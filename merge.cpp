@@ -0,0 +1,196 @@
+#include "merge.hpp"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <queue>
+#include <string>
+#include <vector>
+
+#include "external_sort_mt.hpp"
+#include "forecast.hpp"
+#include "io_engine.hpp"
+
+#define THROTTLED_COPY 4194304  // bytes copied at a time under a disk limit
+
+using namespace std;
+
+// bytes of the files together, the size of what we merge or concatenate them into
+static long long files_size(const vector<string>& names) {
+    long long size = 0;
+    for (int i = 0; i < names.size(); i++) {
+        struct stat stat_buf;
+        if (stat(names[i].c_str(), &stat_buf) == 0) {
+            size += stat_buf.st_size;
+        }
+    }
+    return size;
+}
+
+// k-way merge
+bool merge_files(const vector<string>& part_names, const string& output_name, Summary* summary, Throttle* throttle) {
+    BlockWriter output(output_name, 0, true, MERGE_BEHIND);
+    output.preallocate(files_size(part_names));
+    Summarizer summarizer;
+    priority_queue<HeapNode*, vector<HeapNode*>, Comparator> heap;
+
+    // open all the part files, mapped or read ahead of the merge
+    vector<FileReader*> part_files;
+    ForecastReader* forecast = open_runs(part_names, part_files);
+
+    // read the first record of each part file
+    char buffer[DATA_SIZE];
+    for (int i = 0; i < part_files.size(); i++) {
+        if (part_files[i]->read(buffer, DATA_SIZE) == DATA_SIZE) {
+            HeapNode* node = new HeapNode(i, buffer);
+            heap.push(node);
+        }
+    }
+
+    // get the smallest record from the heap and write it to the output file
+    DiskMeter meter(throttle);
+    while (!heap.empty()) {
+        HeapNode* node = heap.top();
+        heap.pop();
+        output.write(node->value, DATA_SIZE);
+        if (summary != nullptr) {
+            summarizer.update(node->value, DATA_SIZE);
+        }
+
+        // read the next record of the part file
+        // if the part file is not empty, push the record to the heap
+        meter.add(DATA_SIZE);
+        if (part_files[node->index]->read(buffer, DATA_SIZE) == DATA_SIZE) {
+            HeapNode* next_node = new HeapNode(node->index, buffer);
+            heap.push(next_node);
+        }
+
+        delete node;
+    }
+
+    // close all the part files
+    for (int i = 0; i < part_files.size(); i++) {
+        delete part_files[i];
+    }
+    delete forecast;
+    if (!output.close()) {
+        printf("Fail to write output file.\n");
+        return false;
+    }
+    if (summary != nullptr) {
+        *summary = summarizer.summary();
+    }
+    return true;
+}
+
+bool merge_ranges(const vector<RunRange>& runs, const string& output_name, long long output_offset, bool consume) {
+    BlockWriter output(output_name, output_offset, false, MERGE_BEHIND);
+    priority_queue<HeapNode*, vector<HeapNode*>, Comparator> heap;
+
+    // read only the range of each run, mapped or ahead of the merge
+    vector<FileReader*> run_files;
+    ForecastReader* forecast = open_runs(runs, run_files, consume);
+
+    // read the first record of each range
+    char buffer[DATA_SIZE];
+    for (int i = 0; i < run_files.size(); i++) {
+        if (run_files[i]->read(buffer, DATA_SIZE) == DATA_SIZE) {
+            heap.push(new HeapNode(i, buffer));
+        }
+    }
+
+    // get the smallest record from the heap and write it to the output file
+    while (!heap.empty()) {
+        HeapNode* node = heap.top();
+        heap.pop();
+        output.write(node->value, DATA_SIZE);
+
+        if (run_files[node->index]->read(buffer, DATA_SIZE) == DATA_SIZE) {
+            heap.push(new HeapNode(node->index, buffer));
+        }
+        delete node;
+    }
+
+    for (int i = 0; i < run_files.size(); i++) {
+        delete run_files[i];
+    }
+    delete forecast;
+    if (!output.close()) {
+        printf("Fail to write output file.\n");
+        return false;
+    }
+    return true;
+}
+
+long long run_lower_bound(const RunRange& run, const string& key) {
+    ifstream run_file(run.name, ios::in | ios::binary);
+    char buffer[DATA_SIZE];
+    long long lo = run.begin, hi = run.end;
+    while (lo < hi) {
+        long long mid = lo + (hi - lo) / 2;
+        run_file.seekg(mid * DATA_SIZE);
+        run_file.read(buffer, DATA_SIZE);
+        if (memcmp(buffer, key.data(), key.size()) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+bool concat_files(const vector<string>& part_names, const string& output_name, Throttle* throttle) {
+    int out_fd = open(output_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0) {
+        printf("Fail to open output file.\n");
+        return false;
+    }
+    fallocate(out_fd, FALLOC_FL_KEEP_SIZE, 0, files_size(part_names));
+
+    char* buffer = nullptr;
+    for (int i = 0; i < part_names.size(); i++) {
+        int in_fd = open(part_names[i].c_str(), O_RDONLY);
+        if (in_fd < 0) {
+            printf("Fail to open part file %s.\n", part_names[i].c_str());
+            delete[] buffer;
+            close(out_fd);
+            return false;
+        }
+
+        // let the kernel copy the bytes, fall back to read/write if it can't.
+        // a throttled copy goes in small steps, so it does not burst
+        size_t step = throttle != nullptr ? THROTTLED_COPY : 1 << 30;
+        ssize_t n;
+        while ((n = copy_file_range(in_fd, nullptr, out_fd, nullptr, step, 0)) > 0) {
+            if (throttle != nullptr) {
+                throttle->disk(n);
+            }
+        }
+        if (n < 0) {
+            if (buffer == nullptr) {
+                buffer = new char[DATA_SIZE * 10000];
+            }
+            while ((n = read(in_fd, buffer, DATA_SIZE * 10000)) > 0) {
+                if (throttle != nullptr) {
+                    throttle->disk(n);
+                }
+                if (write(out_fd, buffer, n) != n) {
+                    n = -1;
+                    break;
+                }
+            }
+        }
+        close(in_fd);
+        if (n < 0) {
+            printf("Fail to copy part file %s.\n", part_names[i].c_str());
+            delete[] buffer;
+            close(out_fd);
+            return false;
+        }
+    }
+
+    delete[] buffer;
+    return close(out_fd) == 0;
+}
\ No newline at end of file
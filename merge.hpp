@@ -0,0 +1,30 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "summary.hpp"
+#include "throttle.hpp"
+
+// records [begin, end) of a sorted run file
+struct RunRange {
+    std::string name;
+    long long begin;
+    long long end;
+};
+
+// k-way merge of sorted part files into one sorted output file, summarizing the output if asked,
+// reading the parts at the disk rate of the throttle, false if the output could not be written
+bool merge_files(const std::vector<std::string>& part_names, const std::string& output_name, Summary* summary = nullptr,
+                 Throttle* throttle = nullptr);
+
+// concatenate files whose key ranges are disjoint and in order, false if a file could not be copied
+bool concat_files(const std::vector<std::string>& part_names, const std::string& output_name, Throttle* throttle = nullptr);
+
+// k-way merge of ranges of sorted runs, written at output_offset of an existing output file.
+// consume punches the ranges out of the runs behind the merge, false if the output could not be written
+bool merge_ranges(const std::vector<RunRange>& runs, const std::string& output_name, long long output_offset,
+                  bool consume = false);
+
+// index of the first record of the range of a sorted run that is not less than key
+long long run_lower_bound(const RunRange& run, const std::string& key);
\ No newline at end of file
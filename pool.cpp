@@ -0,0 +1,92 @@
+#include "pool.hpp"
+
+#include <unistd.h>
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// the pools live until the process exits, they are never destroyed so that
+// exit() from any thread does not wait for the workers
+BufferPool& BufferPool::instance() {
+    static BufferPool* pool = new BufferPool();
+    return *pool;
+}
+
+// keep at most a quarter of the physical memory in cached buffers
+BufferPool::BufferPool() : cached(0), limit((size_t)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGE_SIZE) / 4) {}
+
+BufferPool::~BufferPool() {}
+
+char* BufferPool::acquire(size_t size) {
+    lock_guard<mutex> lock(mtx);
+    for (int i = 0; i < free_buffers.size(); i++) {
+        if (free_buffers[i].first == size) {
+            char* buffer = free_buffers[i].second;
+            free_buffers.erase(free_buffers.begin() + i);
+            cached -= size;
+            return buffer;
+        }
+    }
+    return new char[size];
+}
+
+void BufferPool::release(char* buffer, size_t size) {
+    lock_guard<mutex> lock(mtx);
+    if (cached + size > limit) {
+        delete[] buffer;
+        return;
+    }
+    free_buffers.push_back(make_pair(size, buffer));
+    cached += size;
+}
+
+ThreadPool& ThreadPool::instance() {
+    static ThreadPool* pool = new ThreadPool();
+    return *pool;
+}
+
+ThreadPool::ThreadPool() : idle(0) {}
+ThreadPool::~ThreadPool() {}
+
+void ThreadPool::worker() {
+    unique_lock<mutex> lock(mtx);
+    while (true) {
+        cv.wait(lock, [this] { return !queue.empty(); });
+        function<void()> task = move(queue.front());
+        queue.pop_front();
+        idle--;
+        lock.unlock();
+        task();
+        lock.lock();
+        idle++;
+    }
+}
+
+void ThreadPool::run(const vector<function<void()>>& tasks) {
+    unique_lock<mutex> lock(mtx);
+    int remaining = tasks.size();
+    condition_variable finished;
+
+    // the tasks may wait for each other, so every task gets its own thread
+    while (idle < (int)(queue.size() + tasks.size())) {
+        workers.push_back(thread(&ThreadPool::worker, this));
+        idle++;
+    }
+    for (int i = 0; i < tasks.size(); i++) {
+        function<void()> task = tasks[i];
+        queue.push_back([this, task, &remaining, &finished] {
+            task();
+            lock_guard<mutex> lock(mtx);
+            if (--remaining == 0) {
+                finished.notify_all();
+            }
+        });
+    }
+    cv.notify_all();
+    finished.wait(lock, [&remaining] { return remaining == 0; });
+}
\ No newline at end of file
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// keeps large buffers around after use, so a long running slave does not
+// allocate and fault in its sort buffers again for every job
+class BufferPool {
+   public:
+    static BufferPool& instance();
+    char* acquire(size_t size);
+    void release(char* buffer, size_t size);
+
+   private:
+    BufferPool();
+    ~BufferPool();
+    std::mutex mtx;
+    std::vector<std::pair<size_t, char*>> free_buffers;
+    size_t cached;
+    size_t limit;
+};
+
+// threads that stay alive between jobs
+class ThreadPool {
+   public:
+    static ThreadPool& instance();
+    // run the tasks in parallel and wait until all of them are done
+    void run(const std::vector<std::function<void()>>& tasks);
+
+   private:
+    ThreadPool();
+    ~ThreadPool();
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<std::function<void()>> queue;
+    std::vector<std::thread> workers;
+    int idle;
+    void worker();
+};
\ No newline at end of file
@@ -0,0 +1,146 @@
+#include "quantile_sketch.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+QuantileSketch::QuantileSketch(int key_size, int k) : key_size(key_size), k(k), n(0), seed(0x9e3779b97f4a7c15ULL), levels(1) {}
+QuantileSketch::~QuantileSketch() {}
+
+// lower levels get smaller capacities, the top level gets k
+int QuantileSketch::capacity(int level) const {
+    int depth = levels.size() - 1 - level;
+    return max(2, (int)(k * pow(2.0 / 3.0, depth)));
+}
+
+void QuantileSketch::compress() {
+    for (int h = 0; h < levels.size(); h++) {
+        if (levels[h].size() < capacity(h)) {
+            continue;
+        }
+        if (h + 1 == levels.size()) {
+            levels.push_back(vector<string>());
+        }
+        vector<string>& level = levels[h];
+        sort(level.begin(), level.end());
+
+        // keep an item back if the count is odd, promote every other item of the rest
+        string spare;
+        bool has_spare = level.size() % 2 == 1;
+        if (has_spare) {
+            spare = move(level.back());
+            level.pop_back();
+        }
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        for (size_t i = seed & 1; i < level.size(); i += 2) {
+            levels[h + 1].push_back(move(level[i]));
+        }
+        level.clear();
+        if (has_spare) {
+            level.push_back(move(spare));
+        }
+    }
+}
+
+void QuantileSketch::update(const char* key) {
+    levels[0].push_back(string(key, key_size));
+    n++;
+    if (levels[0].size() >= capacity(0)) {
+        compress();
+    }
+}
+
+void QuantileSketch::merge(const QuantileSketch& other) {
+    while (levels.size() < other.levels.size()) {
+        levels.push_back(vector<string>());
+    }
+    for (int h = 0; h < other.levels.size(); h++) {
+        levels[h].insert(levels[h].end(), other.levels[h].begin(), other.levels[h].end());
+    }
+    n += other.n;
+    compress();
+}
+
+long long QuantileSketch::count() const {
+    return n;
+}
+
+vector<string> QuantileSketch::splitters(int parts) const {
+    vector<pair<string, long long>> items;
+    long long total = 0;
+    for (int h = 0; h < levels.size(); h++) {
+        for (int i = 0; i < levels[h].size(); i++) {
+            items.push_back(make_pair(levels[h][i], 1LL << h));
+            total += 1LL << h;
+        }
+    }
+    sort(items.begin(), items.end());
+
+    vector<string> result;
+    long long rank = 0;
+    int next = 1;
+    for (int i = 0; i < items.size() && next < parts; i++) {
+        rank += items[i].second;
+        while (next < parts && rank * parts >= total * next) {
+            result.push_back(items[i].first);
+            next++;
+        }
+    }
+    return result;
+}
+
+// layout: key_size, k, n, number of levels, then per level the item count and the items
+vector<char> QuantileSketch::serialize() const {
+    vector<char> data;
+    auto put = [&data](long long value) {
+        data.insert(data.end(), (char*)&value, (char*)&value + sizeof(value));
+    };
+    put(key_size);
+    put(k);
+    put(n);
+    put(levels.size());
+    for (int h = 0; h < levels.size(); h++) {
+        put(levels[h].size());
+        for (int i = 0; i < levels[h].size(); i++) {
+            data.insert(data.end(), levels[h][i].begin(), levels[h][i].end());
+        }
+    }
+    return data;
+}
+
+bool QuantileSketch::deserialize(const vector<char>& data) {
+    size_t pos = 0;
+    auto get = [&data, &pos](long long& value) {
+        if (pos + sizeof(value) > data.size()) {
+            return false;
+        }
+        memcpy(&value, data.data() + pos, sizeof(value));
+        pos += sizeof(value);
+        return true;
+    };
+    long long size, sketch_k, count, level_num;
+    if (!get(size) || !get(sketch_k) || !get(count) || !get(level_num) || size != key_size) {
+        return false;
+    }
+    k = sketch_k;
+    n = count;
+    levels.assign(level_num, vector<string>());
+    for (int h = 0; h < level_num; h++) {
+        long long item_num;
+        if (!get(item_num) || pos + item_num * key_size > data.size()) {
+            return false;
+        }
+        for (long long i = 0; i < item_num; i++) {
+            levels[h].push_back(string(data.data() + pos, key_size));
+            pos += key_size;
+        }
+    }
+    return pos == data.size();
+}
\ No newline at end of file
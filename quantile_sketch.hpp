@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+// mergeable quantile sketch over fixed-width byte-string keys (KLL style)
+// level h holds items that each stand for 2^h keys. When a level is full it
+// is sorted and every other item moves up a level, so the sketch stays small
+// while the rank error of the quantiles stays around 1/k.
+class QuantileSketch {
+   public:
+    QuantileSketch(int key_size, int k = 400);
+    ~QuantileSketch();
+    void update(const char* key);
+    void merge(const QuantileSketch& other);
+    long long count() const;
+    // parts - 1 keys splitting the keys seen into parts of equal size
+    std::vector<std::string> splitters(int parts) const;
+    std::vector<char> serialize() const;
+    bool deserialize(const std::vector<char>& data);
+
+   private:
+    int key_size;
+    int k;
+    long long n;
+    uint64_t seed;
+    std::vector<std::vector<std::string>> levels;
+    int capacity(int level) const;
+    void compress();
+};
\ No newline at end of file
@@ -1,15 +1,32 @@
-# script to run server, slave
+# script to benchmark master and slaves on one host over loopback
+# usage: ./run.sh <records> <slaves> [master options]
+# e.g.   ./run.sh 10000000 8 -x
+
+RECORDS=${1:-1000000}
+SLAVES=${2:-4}
+shift 2
+PORT=12345
+MAIN=$(pwd)/main
 
 # make c++
 make
 
+# every process needs its own working directory
+rm -rf bench && mkdir -p bench/master
+for i in $(seq 1 $SLAVES); do mkdir -p bench/slave$i; done
+./gensort-1.5/gensort $RECORDS bench/master/input
+
 # run server
-./server input2 output & \
+(cd bench/master && $MAIN -m master -p $PORT -n $SLAVES -i ./input -o ./output "$@" > log) &
+sleep 1
 
 # run slaves
-./slave part1 & ./slave part2 & ./slave part3 & ./slave part4 & ./slave part5 &
+for i in $(seq 1 $SLAVES); do
+    (cd bench/slave$i && $MAIN -m slave -s 127.0.0.1 -p $PORT > log) &
+done
 
 wait
 
-# show parts
-ls -lh | grep '[(part)|(input)]*'
\ No newline at end of file
+# show result
+grep "Total running time" bench/master/log
+./gensort-1.5/valsort bench/master/output
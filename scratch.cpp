@@ -0,0 +1,192 @@
+/**
+ * Scratch directories.
+ * A node with several disks lists one directory per disk, and every new run
+ * or part goes to the next of them, or to one picked in proportion to the
+ * free space of the directories. The merges read their runs from all disks
+ * at once, so spilling and merging get the bandwidth of all the disks. The
+ * files are named after the process, so nodes can share the directories.
+ * The directories are tiered: a tmpfs directory keeps the runs in memory up
+ * to its budget, then the runs spill to the ssds and finally to the hdds,
+ * which sysfs tells apart. A job that fits the memory budget hardly touches
+ * the disks, a huge one still finishes on the hdds.
+ */
+#include "scratch.hpp"
+
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <sstream>
+
+#include "io_engine.hpp"
+
+#define TMPFS_MAGIC 0x01021994
+#define RAMFS_MAGIC 0x858458f6
+
+using namespace std;
+
+static const char* tier_names[TIERS] = {"memory", "ssd", "hdd"};
+
+static long long free_space(const string& path) {
+    struct statvfs fs;
+    return statvfs(path.c_str(), &fs) == 0 ? (long long)fs.f_bavail * fs.f_frsize : 0;
+}
+
+Scratch::Scratch() : by_space(false) {
+    for (int t = 0; t < TIERS; t++) {
+        next[t] = 0;
+    }
+}
+
+// lives until the process exits, like the pools
+Scratch& Scratch::instance() {
+    static Scratch* scratch = new Scratch();
+    return *scratch;
+}
+
+bool Scratch::set_dirs(const string& dirs) {
+    vector<ScratchDir> parsed;
+    stringstream stream(dirs);
+    string dir;
+    while (getline(stream, dir, ',')) {
+        if (dir.empty()) {
+            continue;
+        }
+        long long budget = 0;
+        size_t colon = dir.rfind(':');
+        if (colon != string::npos) {
+            budget = atoll(dir.c_str() + colon + 1) * 1024 * 1024;
+            dir = dir.substr(0, colon);
+        }
+        struct stat stat_buf;
+        struct statfs fs;
+        if (stat(dir.c_str(), &stat_buf) != 0 || !S_ISDIR(stat_buf.st_mode) || access(dir.c_str(), W_OK) != 0 ||
+            statfs(dir.c_str(), &fs) != 0) {
+            return false;
+        }
+        // network and virtual file systems count as ssds
+        bool memory = fs.f_type == TMPFS_MAGIC || fs.f_type == RAMFS_MAGIC;
+        int tier = memory ? TIER_MEMORY : rotational(stat_buf.st_dev) ? TIER_HDD : TIER_SSD;
+        parsed.push_back(ScratchDir{dir, stat_buf.st_dev, tier, budget, 0, 0});
+    }
+    lock_guard<mutex> lock(mtx);
+    list = parsed;
+    files.clear();
+    return true;
+}
+
+bool Scratch::set_placement(const string& placement) {
+    if (placement != "round" && placement != "space") {
+        return false;
+    }
+    lock_guard<mutex> lock(mtx);
+    by_space = placement == "space";
+    return true;
+}
+
+// one of the candidate directories of a tier, called with mtx held
+int Scratch::pick(const vector<int>& candidates, int tier, long long size) {
+    if (!by_space) {
+        return candidates[next[tier]++ % candidates.size()];
+    }
+    // every directory gains its free space and the one picked gives back the total,
+    // so files that are placed at the same time still spread by free space
+    long long total = 0;
+    int best = -1;
+    for (int i = 0; i < candidates.size(); i++) {
+        ScratchDir& dir = list[candidates[i]];
+        long long free_bytes = free_space(dir.path);
+        if (free_bytes < size) {
+            continue;
+        }
+        dir.weight += free_bytes;
+        total += free_bytes;
+        if (best < 0 || dir.weight > list[best].weight) {
+            best = candidates[i];
+        }
+    }
+    // no directory has room, the write fails wherever it goes
+    if (best < 0) {
+        return candidates[next[tier]++ % candidates.size()];
+    }
+    list[best].weight -= total;
+    return best;
+}
+
+string Scratch::path(const string& name, long long size) {
+    lock_guard<mutex> lock(mtx);
+    if (list.empty()) {
+        return name;
+    }
+    // what our files take in each directory, those of unknown size count with what they grew to
+    for (int i = 0; i < list.size(); i++) {
+        list[i].used = 0;
+    }
+    for (auto it = files.begin(); it != files.end(); it++) {
+        struct stat stat_buf;
+        long long grown = stat(it->first.c_str(), &stat_buf) == 0 ? stat_buf.st_size : 0;
+        list[it->second.first].used += max(grown, it->second.second);
+    }
+
+    // the fastest tier with budget and room left, a file of unknown size fits while the budget is not used up
+    int chosen = -1;
+    int slowest = -1;
+    for (int tier = 0; tier < TIERS && chosen < 0; tier++) {
+        vector<int> all, candidates;
+        for (int i = 0; i < list.size(); i++) {
+            if (list[i].tier != tier) {
+                continue;
+            }
+            all.push_back(i);
+            bool in_budget = list[i].budget == 0 || list[i].used + max(size, 1LL) <= list[i].budget;
+            if (in_budget && free_space(list[i].path) >= size) {
+                candidates.push_back(i);
+            }
+        }
+        if (!candidates.empty()) {
+            chosen = pick(candidates, tier, size);
+        } else if (!all.empty()) {
+            slowest = tier;
+        }
+    }
+    // every budget is used up, the slowest tier takes the rest of a huge job
+    if (chosen < 0) {
+        vector<int> all;
+        for (int i = 0; i < list.size(); i++) {
+            if (list[i].tier == slowest) {
+                all.push_back(i);
+            }
+        }
+        chosen = pick(all, slowest, size);
+    }
+    string path = list[chosen].path + "/" + to_string(getpid()) + "." + name;
+    files[path] = make_pair(chosen, size);
+    return path;
+}
+
+void Scratch::remove(const string& path) {
+    ::remove(path.c_str());
+    lock_guard<mutex> lock(mtx);
+    files.erase(path);
+}
+
+vector<ScratchDir> Scratch::dirs() {
+    lock_guard<mutex> lock(mtx);
+    return list;
+}
+
+string Scratch::describe() {
+    lock_guard<mutex> lock(mtx);
+    string text;
+    for (int i = 0; i < list.size(); i++) {
+        text += (i > 0 ? ", " : "") + list[i].path + " (" + tier_names[list[i].tier];
+        if (list[i].budget > 0) {
+            text += ", " + to_string(list[i].budget / 1024 / 1024) + " MB";
+        }
+        text += ")";
+    }
+    return text;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+// the kinds of scratch directories, the faster ones fill up first
+#define TIER_MEMORY 0  // tmpfs or ramfs
+#define TIER_SSD 1
+#define TIER_HDD 2     // rotational, from sysfs
+#define TIERS 3
+
+// a directory the runs and parts of this node are spilled to, one per disk
+struct ScratchDir {
+    std::string path;
+    dev_t device;
+    int tier;
+    long long budget;  // bytes we may put there, 0 for as much as fits
+    long long used;    // by the files we put there and did not remove yet, as of the last placement
+    long long weight;  // of the smooth weighted round robin of the space placement
+};
+
+// where the runs, parts and received files of a node go: the working directory,
+// or spread over a list of scratch directories so that every disk takes its share.
+// the files go to the fastest tier with budget left, memory first, then ssd, then hdd
+class Scratch {
+   public:
+    static Scratch& instance();
+    // comma separated directories, each with an optional budget in MB after a colon,
+    // false if one of them is not a directory we can write
+    bool set_dirs(const std::string& dirs);
+    // round: one directory after the other, space: in proportion to the free space of the directories
+    bool set_placement(const std::string& placement);
+    // a path for a new scratch file, size is how much we will write into it if we know
+    std::string path(const std::string& name, long long size = 0);
+    // remove a file, and give its budget back if it is a scratch file
+    void remove(const std::string& path);
+    std::vector<ScratchDir> dirs();
+    // the directories with their tiers and budgets, empty without scratch directories
+    std::string describe();
+
+   private:
+    Scratch();
+    std::mutex mtx;
+    std::vector<ScratchDir> list;
+    std::map<std::string, std::pair<int, long long>> files;  // path to directory and expected size
+    bool by_space;
+    int next[TIERS];
+    int pick(const std::vector<int>& candidates, int tier, long long size);
+};
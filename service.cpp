@@ -0,0 +1,378 @@
+/**
+ * Sort service: a long running master that sorts the jobs of many clients.
+ * Persistent slaves register on the TCP port, clients submit jobs on a unix
+ * socket. Jobs wait in a queue and each one runs on its own subset of the idle
+ * slaves, so small jobs run next to each other instead of one after the other.
+ * Jobs start in the order they were submitted, but a smaller job may start
+ * ahead of the first job when that one does not fit yet, a few times at most.
+ * The unix socket is also the control channel to change the io limits of a
+ * running job, or of the service node, while it runs.
+ */
+#include "service.hpp"
+
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "local_transport.hpp"
+
+#define WORKER_BYTES 1073741824LL  // input bytes per slave when the client does not choose
+#define MAX_OVERTAKES 4             // smaller jobs that may start ahead of the first job
+
+using namespace std;
+
+Service::Service(int port, string socket_path) : port(port), socket_path(socket_path), registered(0), next_id(0) {}
+Service::~Service() {}
+
+static void send_status(int client_fd, string status) {
+    send_frame(client_fd, FRAME_STATUS, status.data(), status.size());
+}
+
+// register persistent slaves, they stay until their connection breaks
+void Service::accept_workers(int socket_fd) {
+    while (true) {
+        Worker worker;
+        worker.fd = accept_peer(socket_fd, &worker.addr);
+        if (worker.fd < 0) {
+            printf("Fail to accept incoming connection.\n");
+            continue;
+        }
+
+        FrameHeader header;
+        vector<char> payload;
+        if (!recv_frame(worker.fd, header, payload) || header.type != FRAME_HELLO || payload.size() != sizeof(SlaveHello)) {
+            printf("Fail to receive hello from client.\n");
+            close(worker.fd);
+            continue;
+        }
+        SlaveHello hello;
+        memcpy(&hello, payload.data(), sizeof(hello));
+        if (!hello.persistent) {
+            printf("Only persistent clients (-d) can join the service.\n");
+            close(worker.fd);
+            continue;
+        }
+        worker.listen_port = hello.listen_port;
+        printf("Get connection from persistent client: [%s:%d]\n", inet_ntoa(worker.addr.sin_addr), ntohs(worker.addr.sin_port));
+
+        lock_guard<mutex> lock(mtx);
+        idle.push_back(worker);
+        registered++;
+        cv.notify_all();
+    }
+}
+
+// queue the jobs of clients, the client connection stays open until the job is done
+void Service::accept_clients(int socket_fd) {
+    while (true) {
+        int client_fd = accept(socket_fd, nullptr, nullptr);
+        if (client_fd < 0) {
+            printf("Fail to accept incoming connection.\n");
+            continue;
+        }
+
+        FrameHeader header;
+        vector<char> payload;
+        bool received = recv_frame(client_fd, header, payload);
+        if (received && header.type == FRAME_LIMITS && payload.size() == sizeof(LimitsRequest)) {
+            LimitsRequest request;
+            memcpy(&request, payload.data(), sizeof(request));
+            change_limits(client_fd, request);
+            close(client_fd);
+            continue;
+        }
+        if (!received || header.type != FRAME_SUBMIT || payload.size() != sizeof(JobRequest)) {
+            printf("Fail to receive job from client.\n");
+            close(client_fd);
+            continue;
+        }
+        QueuedJob job;
+        memcpy(&job.request, payload.data(), sizeof(job.request));
+        job.request.input[PATH_MAX - 1] = 0;
+        job.request.output[PATH_MAX - 1] = 0;
+
+        struct stat stat_buf;
+        if (stat(job.request.input, &stat_buf) != 0) {
+            send_status(client_fd, string("error: cannot read ") + job.request.input);
+            close(client_fd);
+            continue;
+        }
+        job.size = stat_buf.st_size;
+        job.client_fd = client_fd;
+        job.overtaken = 0;
+
+        lock_guard<mutex> lock(mtx);
+        job.id = next_id++;
+        send_status(client_fd, "queued as job " + to_string(job.id) + ", " + to_string(queue.size()) + " jobs ahead");
+        printf("Job %d queued: %s -> %s\n", job.id, job.request.input, job.request.output);
+        queue.push_back(job);
+        cv.notify_all();
+    }
+}
+
+void Service::change_limits(int client_fd, const LimitsRequest& request) {
+    string what = request.job_id < 0 ? string("the node") : "job " + to_string(request.job_id);
+    if (request.job_id < 0) {
+        Throttle::node().set_limits(request.limits);
+    } else {
+        lock_guard<mutex> lock(mtx);
+        auto it = running.find(request.job_id);
+        if (it == running.end()) {
+            send_status(client_fd, "error: job " + to_string(request.job_id) + " is not running");
+            return;
+        }
+        it->second->set_limits(request.limits);
+    }
+    printf("Limits of %s: network %u MB/s, disk %u MB/s\n", what.c_str(), request.limits.net_rate, request.limits.disk_rate);
+    send_status(client_fd, "limits of " + what + " set");
+}
+
+// number of slaves the job runs on, 0 while there are none
+int Service::workers_for(const QueuedJob& job) {
+    long long wanted = job.request.workers;
+    if (wanted == 0) {
+        wanted = max(1LL, (job.size + WORKER_BYTES - 1) / WORKER_BYTES);
+    }
+    return min(wanted, (long long)registered);
+}
+
+// idle slaves send nothing, so a readable connection means the slave went away
+void Service::drop_dead_workers() {
+    for (int i = 0; i < idle.size();) {
+        struct pollfd pfd;
+        pfd.fd = idle[i].fd;
+        pfd.events = POLLIN | POLLRDHUP;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, 0) != 0) {
+            printf("Client [%s:%d] went away.\n", inet_ntoa(idle[i].addr.sin_addr), ntohs(idle[i].addr.sin_port));
+            close(idle[i].fd);
+            idle.erase(idle.begin() + i);
+            registered--;
+        } else {
+            i++;
+        }
+    }
+}
+
+void Service::schedule() {
+    unique_lock<mutex> lock(mtx);
+    while (true) {
+        // woken up by new jobs, new slaves and finished jobs, and now and then to check the idle slaves
+        cv.wait_for(lock, chrono::seconds(1));
+        drop_dead_workers();
+
+        for (auto it = queue.begin(); it != queue.end();) {
+            int needed = workers_for(*it);
+            if (needed > 0 && needed <= idle.size()) {
+                vector<Worker> workers(idle.end() - needed, idle.end());
+                idle.resize(idle.size() - needed);
+                if (it != queue.begin()) {
+                    queue.front().overtaken++;
+                }
+                thread(&Service::run_job, this, *it, workers).detach();
+                it = queue.erase(it);
+                continue;
+            }
+            // the first job gets the next idle slaves once it was overtaken often enough
+            if (it == queue.begin() && it->overtaken >= MAX_OVERTAKES) {
+                break;
+            }
+            it++;
+        }
+    }
+}
+
+// run one job with its own master on its slaves, then give the slaves back
+void Service::run_job(QueuedJob job, vector<Worker> workers) {
+    auto start = chrono::high_resolution_clock::now();
+
+    MasterOptions options;
+    options.transfer.compress = job.request.compress;
+    options.merge_fanin = job.request.merge_fanin;
+    options.range_partition = job.request.range_partition;
+    options.exchange = job.request.exchange;
+    options.key_only = job.request.key_only;
+    options.limits = job.request.limits;
+    options.trace = job.request.trace;
+    printf("Job %d: %s -> %s on %d slaves\n", job.id, job.request.input, job.request.output, (int)workers.size());
+
+    Master master(port, workers.size(), job.request.input, job.request.output, options);
+    for (int i = 0; i < workers.size(); i++) {
+        master.add_slave(workers[i].fd, workers[i].addr, workers[i].listen_port);
+    }
+    master.set_part_prefix("job" + to_string(job.id) + ".");
+    mtx.lock();
+    running[job.id] = &master;
+    mtx.unlock();
+    int failed = master.run_job(-1);
+    mtx.lock();
+    running.erase(job.id);
+    mtx.unlock();
+
+    // a failed job only fails its client, the slaves whose connections it broke are dropped
+    // with the next check of the idle slaves, and connect again
+    auto end = chrono::high_resolution_clock::now();
+    auto duration = chrono::duration_cast<chrono::microseconds>(end - start);
+    char status[64];
+    snprintf(status, sizeof(status), "done in %.2f seconds on %d slaves", duration.count() * 1.0 / 1000000, (int)workers.size());
+    if (failed) {
+        printf("Job %d failed: %s\n", job.id, master.error().c_str());
+        send_status(job.client_fd, "error: " + master.error());
+    } else {
+        send_status(job.client_fd, status);
+    }
+    close(job.client_fd);
+
+    lock_guard<mutex> lock(mtx);
+    idle.insert(idle.end(), workers.begin(), workers.end());
+    cv.notify_all();
+}
+
+int Service::run() {
+    // create socket, AF_INET = IPv4, SOCK_STREAM = TCP
+    int worker_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (worker_fd < 0) {
+        printf("Fail to create a socket.\n");
+        exit(1);
+    }
+
+    // set reuse address
+    int reuse_addr = 1;
+    setsockopt(worker_fd, SOL_SOCKET, SO_REUSEADDR, (void*)&reuse_addr, sizeof(reuse_addr));
+
+    // set server address
+    struct sockaddr_in server_addr;
+    server_addr.sin_family = AF_INET;          // IPv4
+    server_addr.sin_port = htons(port);        // port
+    server_addr.sin_addr.s_addr = INADDR_ANY;  // Any IP address
+
+    if (bind(worker_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0 || listen(worker_fd, SOMAXCONN) < 0) {
+        printf("Fail to bind socket to address.\n");
+        close(worker_fd);
+        exit(1);
+    }
+
+    listen_local(worker_fd, port);
+
+    // clients submit jobs on a unix socket
+    int client_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un client_addr;
+    memset(&client_addr, 0, sizeof(client_addr));
+    client_addr.sun_family = AF_UNIX;
+    strncpy(client_addr.sun_path, socket_path.c_str(), sizeof(client_addr.sun_path) - 1);
+    unlink(socket_path.c_str());
+    if (client_fd < 0 || bind(client_fd, (struct sockaddr*)&client_addr, sizeof(client_addr)) < 0 || listen(client_fd, SOMAXCONN) < 0) {
+        printf("Fail to bind socket to %s.\n", socket_path.c_str());
+        close(worker_fd);
+        exit(1);
+    }
+
+    printf("Service is listening on port %d for slaves and on %s for jobs\n", port, socket_path.c_str());
+
+    thread workers(&Service::accept_workers, this, worker_fd);
+    thread clients(&Service::accept_clients, this, client_fd);
+    schedule();
+
+    workers.join();
+    clients.join();
+    return 0;
+}
+
+static bool absolute_path(string path, char* out) {
+    if (path[0] != '/') {
+        char cwd[PATH_MAX];
+        if (getcwd(cwd, sizeof(cwd)) == nullptr) {
+            return false;
+        }
+        path = string(cwd) + "/" + path;
+    }
+    if (path.size() >= PATH_MAX) {
+        return false;
+    }
+    strcpy(out, path.c_str());
+    return true;
+}
+
+int submit_job(string socket_path, string input, string output, int workers, MasterOptions options) {
+    JobRequest request;
+    memset(&request, 0, sizeof(request));
+    if (!absolute_path(input, request.input) || !absolute_path(output, request.output)) {
+        printf("Fail to resolve the input and output paths.\n");
+        return 1;
+    }
+    request.workers = workers;
+    request.compress = options.transfer.compress;
+    request.merge_fanin = options.merge_fanin;
+    request.range_partition = options.range_partition;
+    request.exchange = options.exchange;
+    request.key_only = options.key_only;
+    request.limits = options.limits;
+    if (!options.trace.empty() && !absolute_path(options.trace, request.trace)) {
+        printf("Fail to resolve the trace path.\n");
+        return 1;
+    }
+
+    int socket_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+    if (socket_fd < 0 || connect(socket_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        printf("Fail to connect to the service on %s.\n", socket_path.c_str());
+        return 1;
+    }
+    if (!send_frame(socket_fd, FRAME_SUBMIT, &request, sizeof(request))) {
+        printf("Fail to submit job.\n");
+        close(socket_fd);
+        return 1;
+    }
+
+    // print the status updates until the service closes the connection
+    string status;
+    FrameHeader header;
+    vector<char> payload;
+    while (recv_frame(socket_fd, header, payload) && header.type == FRAME_STATUS) {
+        status.assign(payload.begin(), payload.end());
+        printf("%s\n", status.c_str());
+    }
+    close(socket_fd);
+    return status.compare(0, 4, "done") == 0 ? 0 : 1;
+}
+
+int set_limits(string socket_path, int job_id, IoLimits limits) {
+    LimitsRequest request;
+    request.job_id = job_id;
+    request.limits = limits;
+
+    int socket_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+    if (socket_fd < 0 || connect(socket_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        printf("Fail to connect to the service on %s.\n", socket_path.c_str());
+        return 1;
+    }
+    FrameHeader header;
+    vector<char> payload;
+    if (!send_frame(socket_fd, FRAME_LIMITS, &request, sizeof(request)) || !recv_frame(socket_fd, header, payload) ||
+        header.type != FRAME_STATUS) {
+        printf("Fail to set limits.\n");
+        close(socket_fd);
+        return 1;
+    }
+    string status(payload.begin(), payload.end());
+    printf("%s\n", status.c_str());
+    close(socket_fd);
+    return status.compare(0, 5, "error") == 0 ? 1 : 0;
+}
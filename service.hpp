@@ -0,0 +1,62 @@
+#pragma once
+
+#include <netinet/in.h>
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "master.hpp"
+#include "transfer.hpp"
+
+#define SERVICE_SOCKET "/tmp/distributed_sort.sock"  // where clients submit jobs
+
+// a persistent slave registered with the service
+struct Worker {
+    int fd;
+    struct sockaddr_in addr;
+    int listen_port;
+};
+
+struct QueuedJob {
+    int id;
+    int client_fd;  // the client waiting for the job to finish
+    JobRequest request;
+    long long size;
+    int overtaken;  // smaller jobs started ahead of this one
+};
+
+// runs the jobs submitted by clients on the registered slaves,
+// several at a time as long as there are idle slaves for them
+class Service {
+   public:
+    Service(int port, std::string socket_path);
+    ~Service();
+    int run();
+
+   private:
+    int port;
+    std::string socket_path;
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::vector<Worker> idle;
+    int registered;
+    std::deque<QueuedJob> queue;
+    std::map<int, Master*> running;  // by job id, to change their limits
+    int next_id;
+    void accept_workers(int socket_fd);
+    void accept_clients(int socket_fd);
+    void schedule();
+    int workers_for(const QueuedJob& job);
+    void drop_dead_workers();
+    void change_limits(int client_fd, const LimitsRequest& request);
+    void run_job(QueuedJob job, std::vector<Worker> workers);
+};
+
+// submit a job to the service and wait until it is done
+int submit_job(std::string socket_path, std::string input, std::string output, int workers, MasterOptions options);
+// change the limits of a running job, or of the service node with job_id -1
+int set_limits(std::string socket_path, int job_id, IoLimits limits);
\ No newline at end of file
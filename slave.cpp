@@ -1,108 +1,266 @@
 /**
  * Slave node receives the file from server and sort it.
- * After sorting, it sends the sorted part back to server.
+ * After sorting, it sends the sorted part back to server, merging its sorted
+ * runs straight into the connection instead of writing the result to disk first.
+ * In tree merge mode it may instead send the sorted part to another slave,
+ * or receive the sorted parts of other slaves and merge them with its own.
+ * In exchange mode it splits its part into the key ranges of all slaves and
+ * exchanges them with the other slaves before sorting.
+ * In key-only mode it sorts (key, record id) tuples and sends back the ids.
+ * When the master traces the job, the slave sends the spans of its phases and
+ * transfers, and those of its children, after its result.
  * The sorting processes happen concurrently.
+ * A persistent slave keeps its connection to the master and runs one job
+ * after the other, reusing its sort buffers and threads. When a job fails it
+ * drops the connection, the master breaks it too, and connects again.
  */
 #include "slave.hpp"
 
 #include <arpa/inet.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <cerrno>
 #include <chrono>
 #include <cstring>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include "exchange.hpp"
 #include "external_sort_mt.hpp"
-#define BUFFER_SIZE 4096
+#include "keysort.hpp"
+#include "local_transport.hpp"
+#include "quantile_sketch.hpp"
+#include "scratch.hpp"
+#include "summary.hpp"
+
+#define PEER_POLL_MS 100  // how often a slave waiting for another slave checks whether the job failed
 
 using namespace std;
 
-Slave::Slave(string server_ip, int port) : server_ip(server_ip), port(port) {}
+Slave::Slave(string server_ip, int port, bool persistent)
+    : server_ip(server_ip),
+      port(port),
+      persistent(persistent),
+      sketch(nullptr),
+      throttle(&Throttle::node()),
+      master_fd(-1),
+      job_failed(false) {}
 Slave::~Slave() {}
 
-void Slave::receive(int socket_fd, string input_name) {
-    // receive file and write to disk
-    ofstream output(input_name, ios::out | ios::binary);
+bool Slave::receive(int socket_fd, string input_name) {
+    // the job header comes before the file, and the pings of a master that traces the job before that
+    FrameHeader header;
+    vector<char> payload;
+    bool received;
+    while ((received = recv_frame(socket_fd, header, payload)) && header.type == FRAME_CLOCK) {
+        if (!answer_clock(socket_fd)) {
+            printf("Fail to answer clock ping.\n");
+            return false;
+        }
+    }
+    if (!received) {
+        // a persistent slave waits here for the next job until the master goes away
+        if (!persistent) {
+            printf("Fail to receive job.\n");
+        }
+        return false;
+    }
+    if (header.type != FRAME_JOB || payload.size() != sizeof(job)) {
+        printf("Fail to receive job.\n");
+        return false;
+    }
+    memcpy(&job, payload.data(), sizeof(job));
+    throttle.set_limits(job.limits);
+    tracer.start(job.trace, job.slave_id);
+
+    // in exchange mode we need the addresses of the other slaves and a sketch of our part
+    char record[DATA_SIZE];
+    if (job.exchange) {
+        if (!recv_frame(socket_fd, header, payload) || header.type != FRAME_PEERS) {
+            printf("Fail to receive peers.\n");
+            return false;
+        }
+        peers.resize(payload.size() / sizeof(PeerAddress));
+        memcpy(peers.data(), payload.data(), peers.size() * sizeof(PeerAddress));
+    }
 
-    char* buffer = new char[BUFFER_SIZE];
+    char* buffer = new char[FRAME_SIZE];
     ssize_t len;
 
     // calculate time for receiving file
     auto start = chrono::high_resolution_clock::now();
+    TraceScope span(tracer, "receive shard", "net");
 
+    // receive file and write to disk, the master sends it again if we found corrupt frames
     printf("Receiving file...\n");
-    while (true) {
-        len = recv(socket_fd, buffer, sizeof(buffer), 0);
-        if (len < 0) {
-            printf("Fail to receive file.\n");
-            close(socket_fd);
-            exit(1);
-        } else if (len == 0) {
+    for (int attempt = 0;; attempt++) {
+        BlockWriter output(input_name);
+        FrameReader reader(socket_fd);
+        reader.set_throttle(&throttle);
+        if (job.exchange) {
+            delete sketch;
+            sketch = new QuantileSketch(DATA_SIZE);
+        }
+        int filled = 0;
+        while (true) {
+            len = reader.read(buffer, FRAME_SIZE);
+            if (len < 0) {
+                printf("Fail to receive file.\n");
+                delete[] buffer;
+                return false;
+            } else if (len == 0) {
+                break;
+            }
+            throttle.disk(len);
+            output.write(buffer, len);
+            span.add_bytes(len);
+
+            // records may be split between frames
+            for (ssize_t off = 0; sketch != nullptr && off < len;) {
+                int n = min((ssize_t)(DATA_SIZE - filled), len - off);
+                memcpy(record + filled, buffer + off, n);
+                filled += n;
+                off += n;
+                if (filled == DATA_SIZE) {
+                    sketch->update(record);
+                    filled = 0;
+                }
+            }
+        }
+        if (!output.close()) {
+            printf("Fail to write the received shard.\n");
+            delete[] buffer;
+            return false;
+        }
+        if (reader.verified()) {
             break;
         }
-        // printf("Received %ld bytes.\n", len);
-        output.write(buffer, len);
+        printf("%d corrupt frames in the shard, attempt %d.\n", reader.corrupt_frames(), attempt + 1);
+        if (attempt >= MAX_RETRANSMITS) {
+            delete[] buffer;
+            return false;
+        }
     }
     printf("Received file finished.\n");
 
     // free buffer
     delete[] buffer;
 
-    output.close();
-    // close socket
-    close(socket_fd);
+    // close socket, unless the exchange mode or the next job still need it
+    if (!job.exchange && !job.elastic && !persistent) {
+        close(socket_fd);
+    }
 
     // calculate time for receiving file
     auto end = chrono::high_resolution_clock::now();
     auto duration = chrono::duration_cast<chrono::milliseconds>(end - start);
     printf("Time for receiving file: %.2f seconds.\n", duration.count() / 1000.0);
+    return true;
 }
 
-void Slave::sendback(int socket_fd, string sort_out_name) {
-    ifstream input;
-    input.open(sort_out_name, ios::in | ios::binary);
+// sends the data written to it as the result stream, summarizing the records on the way
+class ResultSink : public OutputSink {
+   public:
+    ResultSink(FrameWriter& writer, Summarizer* summarizer) : writer(writer), summarizer(summarizer), bytes(0) {}
+    bool write(const char* data, size_t len) {
+        if (summarizer != nullptr) {
+            summarizer->update(data, len);
+        }
+        bytes += len;
+        return writer.write(data, len);
+    }
+    uint64_t written() { return bytes; }
+
+   private:
+    FrameWriter& writer;
+    Summarizer* summarizer;
+    uint64_t bytes;
+};
+
+static bool send_file(const string& name, OutputSink* sink, Throttle* throttle) {
+    BlockReader input(name);
     if (!input.good()) {
         printf("Fail to open input file.\n");
-        close(socket_fd);
-        exit(1);
+        return false;
     }
+    char* buffer = new char[FRAME_SIZE];
+    ssize_t len;
+    while ((len = input.read(buffer, FRAME_SIZE)) > 0) {
+        throttle->disk(len);
+        if (!sink->write(buffer, len)) {
+            printf("Fail to send file to server.\n");
+            break;
+        }
+    }
+    delete[] buffer;
+    return len == 0;
+}
 
+bool Slave::sendback(int socket_fd, const function<bool(OutputSink*)>& produce) {
     // calculate time for sending file
     auto start = chrono::high_resolution_clock::now();
-
-    struct stat stat_buf;
-    int rc = stat(sort_out_name.c_str(), &stat_buf);
-    double file_size = rc == 0 ? stat_buf.st_size : -1;
-    printf("file size: %.2f GB\n", file_size / 1024.0 / 1024.0 / 1024.0);
+    int64_t trace_start = trace_clock();
 
     printf("Sending file...\n");
 
-    // send file to server
-    char* buffer = new char[BUFFER_SIZE];
-    while (!input.eof()) {
-        input.read(buffer, BUFFER_SIZE);
-        int read_size = input.gcount();
-        int send_size = send(socket_fd, buffer, read_size, 0);
-        if (send_size < 0) {
+    // tell the receiver which part this is
+    ResultHeader result;
+    result.slave_id = job.slave_id;
+    result.job_id = job.job_id;
+    if (!send_frame(socket_fd, FRAME_RESULT, &result, sizeof(result))) {
+        printf("Fail to send file to server.\n");
+        return false;
+    }
+
+    // send the result to server as it is produced, again if the receiver found corrupt frames,
+    // and summarize it on the way, so the receiver can validate the output without reading it.
+    // record ids are not records, the master summarizes the output it builds from them
+    Summarizer summarizer;
+    uint64_t bytes = 0;
+    for (int attempt = 0;; attempt++) {
+        FrameWriter writer(socket_fd, job.compress);
+        writer.set_flow_control(job.exchange);
+        writer.set_throttle(&throttle);
+        summarizer = Summarizer();
+        ResultSink sink(writer, job.key_only ? nullptr : &summarizer);
+        bool produced = produce(&sink);
+        bytes = sink.written();
+
+        // send the end frame to indicate the end of file
+        if (!produced || !writer.finish()) {
             printf("Fail to send file to server.\n");
-            close(socket_fd);
-            exit(1);
+            return false;
+        }
+        if (writer.verified()) {
+            writer.print_stats("Result");
+            break;
+        }
+        printf("%d corrupt frames in the result, attempt %d.\n", writer.corrupt_frames(), attempt + 1);
+        if (attempt >= MAX_RETRANSMITS) {
+            return false;
         }
-        // printf("Send %d bytes to server\n", send_size);
-        memset(buffer, 0, BUFFER_SIZE);
+    }
+    if (!send_frame(socket_fd, FRAME_SUMMARY, &summarizer.summary(), sizeof(Summary))) {
+        printf("Fail to send summary to server.\n");
+        return false;
     }
 
-    // send 0 bytes to server to indicate the end of file
-    int send_size = send(socket_fd, buffer, 0, 0);
-    if (send_size < 0) {
-        printf("Fail to send file to server.\n");
-        close(socket_fd);
-        exit(1);
+    // the result stream includes our final merge, the spans of our children came with their parts
+    if (job.trace) {
+        tracer.add("send result", "net", trace_start, trace_clock(), bytes);
+        vector<TraceSpan> spans = tracer.spans();
+        if (!send_frame(socket_fd, FRAME_TRACE, spans.data(), spans.size() * sizeof(TraceSpan))) {
+            printf("Fail to send trace to server.\n");
+            return false;
+        }
     }
     printf("Send file finished.\n");
 
@@ -110,84 +268,574 @@ void Slave::sendback(int socket_fd, string sort_out_name) {
     auto end = chrono::high_resolution_clock::now();
     auto duration = chrono::duration_cast<chrono::milliseconds>(end - start);
     printf("Time for sending file: %.2f seconds.\n", duration.count() / 1000.0);
+    return true;
+}
+
+// the master broke off the job, or went away
+bool Slave::master_gone() {
+    if (master_fd < 0) {
+        return false;
+    }
+    struct pollfd pfd;
+    pfd.fd = master_fd;
+    pfd.events = POLLRDHUP;
+    pfd.revents = 0;
+    return poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR));
+}
+
+// give up the job here: stop waiting for peers and break the connections to them,
+// so the threads blocked on a peer that will never answer see an error
+void Slave::fail_job() {
+    lock_guard<mutex> lock(peers_mtx);
+    job_failed = true;
+    for (int i = 0; i < peer_fds.size(); i++) {
+        shutdown(peer_fds[i], SHUT_RDWR);
+    }
+}
+
+void Slave::add_peer(int fd) {
+    lock_guard<mutex> lock(peers_mtx);
+    peer_fds.push_back(fd);
+    if (job_failed) {
+        shutdown(fd, SHUT_RDWR);
+    }
+}
+
+// forget the fd before closing it, fail_job must not shut down a reused fd
+void Slave::close_peer(int fd) {
+    {
+        lock_guard<mutex> lock(peers_mtx);
+        peer_fds.erase(find(peer_fds.begin(), peer_fds.end(), fd));
+    }
+    close(fd);
+}
+
+// accept the connection of another slave of the job and read its result header,
+// -1 once the job failed here or at the master, since a slave of a failed job may never connect.
+// a slave of an earlier, failed job may still connect to us, we drop it
+int Slave::accept_job_peer(int listen_fd, struct sockaddr_in* addr) {
+    while (true) {
+        int fd = accept_peer(listen_fd, addr, PEER_POLL_MS);
+        if (fd < 0 && errno != ETIMEDOUT) {
+            return -1;
+        }
+        if (fd < 0) {
+            if (job_failed || master_gone()) {
+                return -1;
+            }
+            continue;
+        }
+        add_peer(fd);
+        FrameHeader header;
+        vector<char> payload;
+        ResultHeader result;
+        if (recv_frame(fd, header, payload) && header.type == FRAME_RESULT && payload.size() == sizeof(result)) {
+            memcpy(&result, payload.data(), sizeof(result));
+            if (result.job_id == job.job_id) {
+                return fd;
+            }
+        }
+        printf("Dropped a connection of an earlier job.\n");
+        close_peer(fd);
+    }
+}
+
+// receive the sorted part of a child slave
+bool Slave::receive_child(int listen_fd, string part_name) {
+    struct sockaddr_in child_addr;
+    int child_fd = accept_job_peer(listen_fd, &child_addr);
+    if (child_fd < 0) {
+        printf("Fail to accept incoming connection.\n");
+        fail_job();
+        return false;
+    }
+    printf("Receiving sorted part from [%s:%d]...\n", inet_ntoa(child_addr.sin_addr), ntohs(child_addr.sin_port));
+
+    FrameHeader header;
+    vector<char> payload;
+
+    // the child sends its part again if we found corrupt frames
+    TraceScope span(tracer, "receive child part", "net");
+    char* buffer = new char[FRAME_SIZE];
+    string error;
+    for (int attempt = 0; error.empty(); attempt++) {
+        BlockWriter output(part_name);
+        FrameReader reader(child_fd);
+        reader.set_throttle(&throttle);
+        ssize_t len;
+        while ((len = reader.read(buffer, FRAME_SIZE)) > 0) {
+            throttle.disk(len);
+            output.write(buffer, len);
+            span.add_bytes(len);
+        }
+        if (len < 0) {
+            error = "Fail to receive sorted part.";
+        } else if (!output.close()) {
+            error = "Fail to write the received part.";
+        } else if (reader.verified()) {
+            break;
+        } else {
+            printf("%d corrupt frames in the sorted part of a child, attempt %d.\n", reader.corrupt_frames(), attempt + 1);
+            if (attempt >= MAX_RETRANSMITS) {
+                error = "Fail to receive sorted part, too many corrupt frames.";
+            }
+        }
+    }
+
+    // we summarize the merged part when we send it, so the summary of the child is not needed
+    if (error.empty() && (!recv_frame(child_fd, header, payload) || header.type != FRAME_SUMMARY)) {
+        error = "Fail to receive summary of sorted part.";
+    }
+    // we pass the spans of the child on to the master with ours
+    if (error.empty() && job.trace) {
+        if (!recv_frame(child_fd, header, payload) || header.type != FRAME_TRACE || payload.size() % sizeof(TraceSpan) != 0) {
+            error = "Fail to receive trace of sorted part.";
+        } else {
+            vector<TraceSpan> spans(payload.size() / sizeof(TraceSpan));
+            memcpy(spans.data(), payload.data(), payload.size());
+            tracer.add_spans(spans);
+        }
+    }
 
     // free buffer
     delete[] buffer;
 
-    // close input file
+    close_peer(child_fd);
+    if (!error.empty()) {
+        printf("%s\n", error.c_str());
+        fail_job();
+        return false;
+    }
+    return true;
+}
+
+// receive the key range of every other slave, one at a time
+bool Slave::exchange_receive(int listen_fd, ExchangeBuffer* buffer) {
+    char* data = new char[FRAME_SIZE];
+    bool ok = true;
+    for (int i = 1; ok && i < peers.size(); i++) {
+        struct sockaddr_in peer_addr;
+        int peer_fd = accept_job_peer(listen_fd, &peer_addr);
+        if (peer_fd < 0) {
+            printf("Fail to receive records from peer.\n");
+            ok = false;
+            break;
+        }
+
+        // the peer sends its range again if we found corrupt frames, so its records
+        // stay in the buffer only once the stream checks out
+        long long mark = buffer->size();
+        for (int attempt = 0;; attempt++) {
+            // the credit window bounds the bytes in flight to us
+            FrameReader reader(peer_fd);
+            reader.set_throttle(&throttle);
+            if (!reader.set_flow_control(CREDIT_WINDOW)) {
+                printf("Fail to receive records from peer.\n");
+                ok = false;
+                break;
+            }
+            ssize_t len;
+            while ((len = reader.read(data, FRAME_SIZE)) > 0) {
+                buffer->append(data, len);
+            }
+            if (len < 0) {
+                printf("Fail to receive records from peer.\n");
+                ok = false;
+                break;
+            }
+            if (reader.verified()) {
+                break;
+            }
+            buffer->truncate(mark);
+            printf("%d corrupt frames in the records of a peer, attempt %d.\n", reader.corrupt_frames(), attempt + 1);
+            if (attempt >= MAX_RETRANSMITS) {
+                printf("Fail to receive records from peer, too many corrupt frames.\n");
+                ok = false;
+                break;
+            }
+        }
+        close_peer(peer_fd);
+    }
+    delete[] data;
+    if (!ok) {
+        fail_job();
+    }
+    return ok;
+}
+
+// split our part into the key ranges of all slaves and exchange them with the other slaves
+bool Slave::exchange(int socket_fd, int listen_fd, string input_name, string exchange_name) {
+    auto start = chrono::high_resolution_clock::now();
+    TraceScope span(tracer, "exchange", "net");
+
+    // the master merges the sketches of all slaves into the key ranges
+    vector<char> payload = sketch->serialize();
+    FrameHeader header;
+    if (!send_frame(socket_fd, FRAME_SKETCH, payload.data(), payload.size()) || !recv_frame(socket_fd, header, payload) ||
+        header.type != FRAME_SPLITTERS) {
+        printf("Fail to get splitters from server.\n");
+        return false;
+    }
+    if (!persistent) {
+        close(socket_fd);
+    }
+    delete sketch;
+    sketch = nullptr;
+    vector<string> splitters;
+    for (size_t off = 0; off + DATA_SIZE <= payload.size(); off += DATA_SIZE) {
+        splitters.push_back(string(payload.data() + off, DATA_SIZE));
+    }
+
+    // split our part into one bucket file per slave, our own range goes straight to the buffer
+    ExchangeBuffer buffer(exchange_name);
+    buffer.set_throttle(&throttle);
+    int slave_num = peers.size();
+    vector<string> bucket_names;
+    vector<ofstream> buckets;
+    for (int i = 0; i < slave_num; i++) {
+        bucket_names.push_back(Scratch::instance().path(string("bucket") + to_string(i)));
+        buckets.push_back(ofstream(bucket_names[i], ios::out | ios::binary));
+    }
+    ifstream input(input_name, ios::in | ios::binary);
+    char* data = new char[FRAME_SIZE];
+    // our own records go to the buffer a frame at a time, like the ranges of the peers
+    vector<char> own;
+    own.reserve(FRAME_SIZE);
+    DiskMeter meter(&throttle);
+    while (input.read(data, FRAME_SIZE / DATA_SIZE * DATA_SIZE), input.gcount() > 0) {
+        int read_size = input.gcount();
+        throttle.disk(read_size);
+        for (int off = 0; off + DATA_SIZE <= read_size; off += DATA_SIZE) {
+            const char* rec = data + off;
+            int idx = upper_bound(splitters.begin(), splitters.end(), rec, [](const char* r, const string& splitter) {
+                          return memcmp(r, splitter.data(), DATA_SIZE) < 0;
+                      }) -
+                      splitters.begin();
+            if (idx == job.slave_id) {
+                own.insert(own.end(), rec, rec + DATA_SIZE);
+                if (own.size() + DATA_SIZE > FRAME_SIZE) {
+                    buffer.append(own.data(), own.size());
+                    own.clear();
+                }
+            } else {
+                meter.add(DATA_SIZE);
+                buckets[idx].write(rec, DATA_SIZE);
+            }
+        }
+    }
     input.close();
+    if (!own.empty()) {
+        buffer.append(own.data(), own.size());
+    }
+    // a bucket that could not be written fails the job before anything is sent
+    bool sent = true;
+    for (int i = 0; i < slave_num; i++) {
+        buckets[i].close();
+        if (!buckets[i].good()) {
+            printf("Fail to write bucket for peer %d.\n", i);
+            sent = false;
+        }
+    }
+    meter.charge();
+
+    // in round r we send to slave id + r while slave id - r sends to us,
+    // so no slave gets records from more than one slave at a time
+    bool received = false;
+    thread receiver([this, listen_fd, &buffer, &received] { received = exchange_receive(listen_fd, &buffer); });
+    for (int round = 1; sent && round < slave_num; round++) {
+        int peer = exchange_send_peer(job.slave_id, slave_num, round);
+        string bucket_name = bucket_names[peer];
+        int peer_fd = connect_to(peers[peer].ip, peers[peer].port);
+        if (peer_fd < 0) {
+            sent = false;
+            break;
+        }
+        add_peer(peer_fd);
+
+        ResultHeader result;
+        result.slave_id = job.slave_id;
+        result.job_id = job.job_id;
+        // the bucket is kept until the peer got it intact, and sent again if it found corrupt frames
+        sent = send_frame(peer_fd, FRAME_RESULT, &result, sizeof(result));
+        for (int attempt = 0; sent; attempt++) {
+            FrameWriter writer(peer_fd, job.compress);
+            writer.set_flow_control(true);
+            writer.set_throttle(&throttle);
+            ifstream bucket(bucket_name, ios::in | ios::binary);
+            while (sent && (bucket.read(data, FRAME_SIZE), bucket.gcount() > 0)) {
+                throttle.disk(bucket.gcount());
+                sent = writer.write(data, bucket.gcount());
+            }
+            sent = sent && !bucket.bad() && writer.finish();
+            if (!sent || writer.verified()) {
+                break;
+            }
+            printf("%d corrupt frames in the records for peer %d, attempt %d.\n", writer.corrupt_frames(), peer, attempt + 1);
+            sent = attempt < MAX_RETRANSMITS;
+        }
+        if (!sent) {
+            printf("Fail to send records to peer %d.\n", peer);
+        }
+        close_peer(peer_fd);
+        if (sent) {
+            Scratch::instance().remove(bucket_name);
+        }
+    }
+    // the receiver gives up waiting for the peers once we failed
+    if (!sent) {
+        fail_job();
+    }
+    receiver.join();
+    buffer.finish();
+    delete[] data;
+    // our own bucket stays empty, and a failed exchange leaves the buckets it did not send
+    for (int i = 0; i < slave_num; i++) {
+        Scratch::instance().remove(bucket_names[i]);
+    }
+    if (!sent || !received) {
+        return false;
+    }
 
-    // close socket
-    close(socket_fd);
+    auto end = chrono::high_resolution_clock::now();
+    auto duration = chrono::duration_cast<chrono::milliseconds>(end - start);
+    printf("Time for exchanging records: %.2f seconds.\n", duration.count() / 1000.0);
+    return true;
 }
 
-int Slave::run() {
-    // create socket, AF_INET = IPv4, SOCK_STREAM = TCP
-    int socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+// -1 if the other slave is not there
+int Slave::connect_to(uint32_t ip, int port) {
+    int socket_fd = connect_peer(ip, port);
     if (socket_fd < 0) {
+        struct in_addr addr;
+        addr.s_addr = ip;
+        printf("Fail to connect to %s:%d.\n", inet_ntoa(addr), port);
+    }
+    return socket_fd;
+}
+
+// listen on any port so other slaves can send us their sorted parts
+int Slave::open_listener(int& listen_port) {
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
         printf("Fail to create a socket.\n");
+        exit(1);
     }
 
-    // set reuse address
-    int reuse_addr = 1;
-    setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, (void*)&reuse_addr, sizeof(reuse_addr));
+    struct sockaddr_in my_addr;
+    my_addr.sin_family = AF_INET;
+    my_addr.sin_port = 0;
+    my_addr.sin_addr.s_addr = INADDR_ANY;
+    socklen_t my_addr_len = sizeof(my_addr);
+    if (bind(listen_fd, (struct sockaddr*)&my_addr, my_addr_len) < 0 || listen(listen_fd, SOMAXCONN) < 0 ||
+        getsockname(listen_fd, (struct sockaddr*)&my_addr, &my_addr_len) < 0) {
+        printf("Fail to listen.\n");
+        close(listen_fd);
+        exit(1);
+    }
+    listen_port = ntohs(my_addr.sin_port);
+    listen_local(listen_fd, listen_port);
+    return listen_fd;
+}
 
-    // set server address
-    struct sockaddr_in server_addr, my_addr;
-    server_addr.sin_family = AF_INET;                            // IPv4
-    server_addr.sin_addr.s_addr = inet_addr(server_ip.c_str());  // server IP address
-    server_addr.sin_port = htons(port);                          // port
-    socklen_t server_addr_len = sizeof(server_addr);
+// connect to the master and register, return -1 if the master is not there
+int Slave::connect_master(int listen_port) {
+    // over a unix socket if the master is on this host
+    int socket_fd = connect_peer(inet_addr(server_ip.c_str()), port);
+    if (socket_fd < 0) {
+        return -1;
+    }
+    printf("Connected to server%s.\n", is_unix_socket(socket_fd) ? " over a unix socket" : "");
 
-    // connect to server
-    int err = connect(socket_fd, (struct sockaddr*)&server_addr, server_addr_len);
-    if (err < 0) {
-        printf("Fail to connect to server.\n");
+    SlaveHello hello;
+    hello.listen_port = listen_port;
+    hello.persistent = persistent;
+    if (!send_frame(socket_fd, FRAME_HELLO, &hello, sizeof(hello))) {
         close(socket_fd);
-        exit(1);
+        return -1;
     }
-    printf("Connected to server.\n");
+    return socket_fd;
+}
+
+// receive, sort and send back one part, return false if the master closed the connection instead
+bool Slave::run_job(int socket_fd, int listen_fd) {
+    job_failed = false;
+    master_fd = persistent ? socket_fd : -1;
 
     // receive file and write to disk
-    string input_name = "slave.input";
-    receive(socket_fd, input_name);
+    string input_name = Scratch::instance().path("slave.input");
+    if (!receive(socket_fd, input_name)) {
+        return false;
+    }
+
+    // a peer of a failed job may block us forever, so we watch for the master to break off the job
+    atomic<bool> done(false);
+    thread watchdog;
+    if (master_fd >= 0) {
+        watchdog = thread([this, &done] {
+            while (!done && !job_failed) {
+                if (master_gone()) {
+                    fail_job();
+                    break;
+                }
+                this_thread::sleep_for(chrono::milliseconds(PEER_POLL_MS));
+            }
+        });
+    }
+    bool sent = sort_and_send(socket_fd, listen_fd, input_name);
+    done = true;
+    if (watchdog.joinable()) {
+        watchdog.join();
+    }
+    return sent;
+}
+
+// sort the received part, with those of our children, and send the result on
+bool Slave::sort_and_send(int socket_fd, int listen_fd, string input_name) {
+    // trade key ranges with the other slaves, then sort what we got
+    if (job.exchange) {
+        string exchange_name = Scratch::instance().path("slave.exchange");
+        bool exchanged = exchange(socket_fd, listen_fd, input_name, exchange_name);
+        Scratch::instance().remove(input_name);
+        input_name = exchange_name;
+        if (!exchanged) {
+            Scratch::instance().remove(input_name);
+            return false;
+        }
+    }
+
+    // receive the sorted parts of our children while sorting our own part
+    vector<string> child_names;
+    vector<thread> threads;
+    vector<char> received(job.children, false);
+    string sort_out_name = Scratch::instance().path("sorted.output");
+    for (int i = 0; i < job.children; i++) {
+        string part_name = Scratch::instance().path(string("child") + to_string(i) + ".part");
+        child_names.push_back(part_name);
+        threads.push_back(thread([this, listen_fd, part_name, &received, i] { received[i] = receive_child(listen_fd, part_name); }));
+    }
 
     printf("Sorting file...\n");
-    // using external sort to sort records
-    string sort_out_name = "sorted.output";
-    ExternalSortMT* es = new ExternalSortMT(input_name, sort_out_name);
-    es->run();
-    delete es;
+    int64_t trace_start = trace_clock();
+    ExternalSortMT* es = nullptr;
+    bool sorted;
+    if (job.key_only) {
+        // sort the tuples, the result is the record ids in key order
+        sorted = sort_tuples(input_name, sort_out_name, &throttle);
+    } else {
+        // using external sort to sort records into one part per thread,
+        // the final merge writes straight into the result stream
+        es = new ExternalSortMT(input_name, sort_out_name);
+        es->set_throttle(&throttle);
+        sorted = es->sort_parts();
+    }
 
     // remove input file
-    remove(input_name.c_str());
+    Scratch::instance().remove(input_name);
+
+    // a scratch disk that is full or failing fails the job, the children stop waiting for us
+    if (!sorted) {
+        printf("Fail to sort file.\n");
+        fail_job();
+    } else {
+        printf("Sorting file finished.\n");
+    }
+    tracer.add(job.key_only ? "sort tuples" : "sort runs", "cpu", trace_start, trace_clock());
 
-    printf("Sorting file finished.\n");
+    for (int i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+    if (job_failed) {
+        for (int i = 0; i < child_names.size(); i++) {
+            Scratch::instance().remove(child_names[i]);
+        }
+        if (es != nullptr) {
+            es->remove_parts();
+            delete es;
+        }
+        Scratch::instance().remove(sort_out_name);
+        return false;
+    }
 
-    // send sorted data back to master
-    // create socket, AF_INET = IPv4, SOCK_STREAM = TCP
-    socket_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (socket_fd < 0) {
-        printf("Fail to create a socket.\n");
+    // the sorted parts of our children are merged along with ours
+    if (job.children > 0) {
+        printf("Merging with %d sorted parts of children...\n", job.children);
+        for (int i = 0; i < child_names.size(); i++) {
+            es->add_part(child_names[i]);
+        }
     }
 
-    // set reuse address
-    reuse_addr = 1;
-    setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, (void*)&reuse_addr, sizeof(reuse_addr));
+    // send sorted data to the slave merging our group, or back to master:
+    // persistent slaves use their connection, the others connect again
+    int result_fd;
+    if (job.parent_port != 0) {
+        result_fd = connect_to(job.parent_ip, job.parent_port);
+        if (result_fd >= 0) {
+            printf("Connected to parent slave.\n");
+            add_peer(result_fd);
+        }
+    } else if (persistent || job.elastic) {
+        result_fd = socket_fd;
+    } else {
+        result_fd = connect_to(inet_addr(server_ip.c_str()), port);
+        if (result_fd >= 0) {
+            printf("Connected to server%s.\n", is_unix_socket(result_fd) ? " over a unix socket" : "");
+        }
+    }
 
-    // connect to server
-    err = connect(socket_fd, (struct sockaddr*)&server_addr, server_addr_len);
-    if (err < 0) {
-        printf("Fail to connect to server.\n");
-        close(socket_fd);
-        exit(1);
+    bool sent = false;
+    if (es != nullptr) {
+        sent = result_fd >= 0 && sendback(result_fd, [es](OutputSink* sink) { return es->merge(sink); });
+        es->remove_parts();
+        delete es;
+    } else {
+        sent = result_fd >= 0 && sendback(result_fd, [this, &sort_out_name](OutputSink* sink) { return send_file(sort_out_name, sink, &throttle); });
+        Scratch::instance().remove(sort_out_name);
+    }
+    if (job.parent_port != 0 && result_fd >= 0) {
+        close_peer(result_fd);
+    } else if (result_fd >= 0 && result_fd != socket_fd) {
+        close(result_fd);
     }
-    printf("Connected to server.\n");
 
-    sendback(socket_fd, sort_out_name);
+    return sent;
+}
 
-    // remove sorted file
-    remove(sort_out_name.c_str());
+int Slave::run() {
+    // listen for the sorted parts of other slaves
+    int listen_port;
+    int listen_fd = open_listener(listen_port);
+
+    if (!persistent) {
+        int socket_fd = connect_master(listen_port);
+        if (socket_fd < 0) {
+            printf("Fail to connect to server.\n");
+            exit(1);
+        }
+        // the job closes the connection when it is done with it, so a failed job just exits
+        if (!run_job(socket_fd, listen_fd)) {
+            return 1;
+        }
+        if (job.elastic) {
+            close(socket_fd);
+        }
+        close_listener(listen_fd);
+        return 0;
+    }
 
+    // keep serving jobs, and wait for the next master when this one is gone
+    while (true) {
+        int socket_fd = connect_master(listen_port);
+        if (socket_fd < 0) {
+            sleep(1);
+            continue;
+        }
+        // a failed job drops the connection too, the master of the next job gets us on a new one
+        int jobs = 0;
+        while (run_job(socket_fd, listen_fd)) {
+            jobs++;
+        }
+        close(socket_fd);
+        printf("Server closed the connection after %d jobs, waiting for the next server.\n", jobs);
+    }
     return 0;
-}
+}
\ No newline at end of file
@@ -1,14 +1,54 @@
+#include <netinet/in.h>
+
+#include <atomic>
+#include <functional>
+#include <mutex>
 #include <string>
+#include <vector>
+
+#include "throttle.hpp"
+#include "trace.hpp"
+#include "transfer.hpp"
+
+class ExchangeBuffer;
+class OutputSink;
+class QuantileSketch;
 
 class Slave {
    public:
-    Slave(std::string server_ip, int port);
+    // persistent: keep serving jobs instead of exiting after one
+    Slave(std::string server_ip, int port, bool persistent = false);
     ~Slave();
     int run();
-    void receive(int socket_fd, std::string input_name);
-    void sendback(int socket_fd, std::string sort_out_name);
+    // these return false when the job failed, a persistent slave then connects again for the next job
+    bool receive(int socket_fd, std::string input_name);
+    bool receive_child(int listen_fd, std::string part_name);
+    // produce writes the result into the sink, again if the receiver asks for it
+    bool sendback(int socket_fd, const std::function<bool(OutputSink*)>& produce);
+    bool exchange(int socket_fd, int listen_fd, std::string input_name, std::string exchange_name);
+    bool exchange_receive(int listen_fd, ExchangeBuffer* buffer);
 
    private:
     std::string server_ip;
     int port;
+    bool persistent;
+    JobHeader job;
+    std::vector<PeerAddress> peers;
+    QuantileSketch* sketch;
+    Throttle throttle;  // of the current job
+    Tracer tracer;      // spans of the current job, sent to the master with the result
+    int master_fd;      // connection the master breaks when the job fails, -1 if we do not keep it
+    std::atomic<bool> job_failed;  // a thread of the job failed, the others stop waiting for peers
+    std::mutex peers_mtx;
+    std::vector<int> peer_fds;  // open connections to the other slaves of the job
+    bool master_gone();
+    void fail_job();
+    void add_peer(int fd);
+    void close_peer(int fd);
+    int accept_job_peer(int listen_fd, struct sockaddr_in* addr);
+    bool sort_and_send(int socket_fd, int listen_fd, std::string input_name);
+    int open_listener(int& listen_port);
+    int connect_master(int listen_port);
+    bool run_job(int socket_fd, int listen_fd);
+    int connect_to(uint32_t ip, int port);
 };
\ No newline at end of file
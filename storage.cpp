@@ -0,0 +1,383 @@
+/**
+ * Storage backends of the inputs and outputs.
+ * The sorts read their input and write their output through a backend: posix
+ * files, or an object store. The object store is a stand-in on a local
+ * directory that behaves like a real one. Every request waits a fixed
+ * latency, reads are ranged GETs of 8 MB with several in flight, and writes
+ * are multipart PUTs whose parts upload in parallel and whose object shows
+ * up only once the upload completes. A sort that runs well against it makes
+ * few, large and parallel requests, as it must against blob storage.
+ */
+#include "storage.hpp"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <thread>
+
+using namespace std;
+
+static int object_latency = OBJECT_LATENCY;
+
+// the round trip of one request to the object store
+static void object_request() {
+    this_thread::sleep_for(chrono::milliseconds(object_latency));
+}
+
+// the files of a directory whose names start with the last part of the prefix
+static vector<string> list_files(const string& prefix) {
+    size_t slash = prefix.rfind('/');
+    string dir = slash == string::npos ? "." : prefix.substr(0, slash + 1);
+    string base = slash == string::npos ? prefix : prefix.substr(slash + 1);
+    vector<string> names;
+    DIR* handle = opendir(dir.c_str());
+    if (handle == nullptr) {
+        return names;
+    }
+    for (struct dirent* entry = readdir(handle); entry != nullptr; entry = readdir(handle)) {
+        string name = entry->d_name;
+        struct stat stat_buf;
+        string path = slash == string::npos ? name : dir + name;
+        if (name.compare(0, base.size(), base) == 0 && stat(path.c_str(), &stat_buf) == 0 && S_ISREG(stat_buf.st_mode)) {
+            names.push_back(path);
+        }
+    }
+    closedir(handle);
+    sort(names.begin(), names.end());
+    return names;
+}
+
+class PosixStorage : public Storage {
+   public:
+    const char* name() { return "posix"; }
+
+    long long size(const string& name) {
+        struct stat stat_buf;
+        return stat(name.c_str(), &stat_buf) == 0 ? stat_buf.st_size : -1;
+    }
+
+    FileReader* open_range(const string& name, long long begin, long long end) { return new BlockReader(name, begin, end); }
+
+    // the outputs are written like the final merges, with their space allocated up front
+    FileWriter* create(const string& name, long long size) {
+        BlockWriter* writer = new BlockWriter(name, 0, true, MERGE_BEHIND);
+        writer->preallocate(size);
+        return writer;
+    }
+
+    vector<string> list(const string& prefix) { return list_files(prefix); }
+
+    bool remove(const string& name) { return ::remove(name.c_str()) == 0; }
+};
+
+// reads a range of an object with ranged GETs, the next ones in flight while the first is copied
+class ObjectReader : public FileReader {
+   public:
+    ObjectReader(const string& path, long long begin, long long end) : next(begin), end(end), pos(0), failed(false) {
+        // opening the object is a HEAD request, it also tells the size
+        object_request();
+        fd = open(path.c_str(), O_RDONLY);
+        struct stat stat_buf;
+        if (fd >= 0 && end < 0) {
+            this->end = fstat(fd, &stat_buf) == 0 ? stat_buf.st_size : 0;
+        }
+        for (int i = 0; i < OBJECT_PARALLEL && fd >= 0; i++) {
+            get();
+        }
+    }
+
+    ~ObjectReader() {
+        for (int i = 0; i < gets.size(); i++) {
+            if (gets[i]->worker.joinable()) {
+                gets[i]->worker.join();
+            }
+            delete gets[i];
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    bool good() { return fd >= 0 && !failed; }
+
+    ssize_t read(char* data, size_t len) {
+        size_t copied = 0;
+        while (copied < len && !gets.empty()) {
+            Get* front = gets.front();
+            if (front->worker.joinable()) {
+                front->worker.join();
+            }
+            if (front->result < 0) {
+                failed = true;
+                return -1;
+            }
+            if (pos >= front->result) {
+                gets.pop_front();
+                delete front;
+                pos = 0;
+                get();
+                continue;
+            }
+            size_t n = min((size_t)front->result - pos, len - copied);
+            memcpy(data + copied, front->data.data() + pos, n);
+            pos += n;
+            copied += n;
+        }
+        return copied;
+    }
+
+   private:
+    struct Get {
+        long long offset;
+        vector<char> data;
+        ssize_t result;  // bytes we got, or -errno
+        thread worker;
+    };
+    int fd;
+    long long next;  // offset of the next GET
+    long long end;
+    deque<Get*> gets;
+    size_t pos;  // in the front GET
+    bool failed;
+
+    // ask for the next part of the range, nothing at its end
+    void get() {
+        if (next >= end) {
+            return;
+        }
+        Get* request = new Get();
+        request->offset = next;
+        request->data.resize(min((long long)OBJECT_PART, end - next));
+        request->result = 0;
+        next += request->data.size();
+        int fd = this->fd;
+        request->worker = thread([request, fd] {
+            object_request();
+            size_t done = 0;
+            while (done < request->data.size()) {
+                ssize_t n = pread(fd, request->data.data() + done, request->data.size() - done, request->offset + done);
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n < 0) {
+                    request->result = -errno;
+                    return;
+                }
+                if (n == 0) {
+                    break;
+                }
+                done += n;
+            }
+            request->result = done;
+        });
+        gets.push_back(request);
+    }
+};
+
+// writes an object as a multipart upload: the parts go up in parallel into an upload
+// of their own, and the object appears with all its parts once the upload completes.
+// size is that of the object if known, a small object does not take the memory of a whole part
+class ObjectWriter : public FileWriter {
+   public:
+    ObjectWriter(const string& path, long long size) : path(path), size(size), offset(0), failed(false), closed(false) {
+        static atomic<int> uploads(0);
+        upload = path + ".upload." + to_string(getpid()) + "." + to_string(uploads++);
+        object_request();
+        fd = open(upload.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        current = new Put();
+        current->data.reserve(part_size());
+    }
+
+    ~ObjectWriter() {
+        close();
+        delete current;
+    }
+
+    bool good() { return fd >= 0 && !failed; }
+
+    bool write(const char* data, size_t len) {
+        if (fd < 0 || closed) {
+            return false;
+        }
+        while (len > 0) {
+            size_t n = min(OBJECT_PART - current->data.size(), len);
+            current->data.insert(current->data.end(), data, data + n);
+            data += n;
+            len -= n;
+            if (current->data.size() == OBJECT_PART) {
+                put();
+            }
+        }
+        return !failed;
+    }
+
+    bool close() {
+        if (closed) {
+            return !failed;
+        }
+        closed = true;
+        if (fd < 0) {
+            return false;
+        }
+        if (!current->data.empty()) {
+            put();
+        }
+        while (!puts.empty()) {
+            wait();
+        }
+        ::close(fd);
+        // completing the upload is one more request, a failed upload is aborted
+        object_request();
+        if (failed || rename(upload.c_str(), path.c_str()) != 0) {
+            unlink(upload.c_str());
+            failed = true;
+        }
+        return !failed;
+    }
+
+   private:
+    struct Put {
+        long long offset;
+        vector<char> data;
+        bool ok;
+        thread worker;
+    };
+    string path;
+    string upload;  // where the parts go until the upload completes
+    long long size;  // 0 if not known
+    int fd;
+    long long offset;  // of the part being filled
+    Put* current;
+    deque<Put*> puts;  // in flight
+    bool failed;
+    bool closed;
+
+    // what is left of the object fits in a smaller part
+    size_t part_size() {
+        if (size <= offset) {
+            return OBJECT_PART;
+        }
+        return min((long long)OBJECT_PART, size - offset);
+    }
+
+    void wait() {
+        Put* front = puts.front();
+        puts.pop_front();
+        front->worker.join();
+        failed = !front->ok || failed;
+        delete front;
+    }
+
+    // upload the part being filled, after the oldest one if all are in flight
+    void put() {
+        if (puts.size() == OBJECT_PARALLEL) {
+            wait();
+        }
+        Put* request = current;
+        request->offset = offset;
+        request->ok = false;
+        offset += request->data.size();
+        int fd = this->fd;
+        request->worker = thread([request, fd] {
+            object_request();
+            size_t done = 0;
+            while (done < request->data.size()) {
+                ssize_t n = pwrite(fd, request->data.data() + done, request->data.size() - done, request->offset + done);
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n <= 0) {
+                    return;
+                }
+                done += n;
+            }
+            request->ok = true;
+        });
+        puts.push_back(request);
+        current = new Put();
+        current->data.reserve(part_size());
+    }
+};
+
+// the objects live at the path after the prefix
+class ObjectStorage : public Storage {
+   public:
+    const char* name() { return "object store"; }
+
+    long long size(const string& name) {
+        object_request();
+        struct stat stat_buf;
+        return stat(path(name).c_str(), &stat_buf) == 0 ? stat_buf.st_size : -1;
+    }
+
+    FileReader* open_range(const string& name, long long begin, long long end) {
+        return new ObjectReader(path(name), begin, end);
+    }
+
+    FileWriter* create(const string& name, long long size) { return new ObjectWriter(path(name), size); }
+
+    // the uploads that did not complete yet are not objects
+    vector<string> list(const string& prefix) {
+        object_request();
+        vector<string> paths = list_files(path(prefix));
+        vector<string> names;
+        for (int i = 0; i < paths.size(); i++) {
+            if (paths[i].find(".upload.") == string::npos) {
+                names.push_back(OBJECT_PREFIX + paths[i]);
+            }
+        }
+        return names;
+    }
+
+    bool remove(const string& name) {
+        object_request();
+        return ::remove(path(name).c_str()) == 0;
+    }
+
+   private:
+    string path(const string& name) { return name.substr(strlen(OBJECT_PREFIX)); }
+};
+
+// the backends live until the process exits, like the pools
+Storage& Storage::of(const string& name) {
+    static Storage* posix = new PosixStorage();
+    static Storage* objects = new ObjectStorage();
+    return local(name) ? *posix : *objects;
+}
+
+bool Storage::local(const string& name) {
+    return name.compare(0, strlen(OBJECT_PREFIX), OBJECT_PREFIX) != 0;
+}
+
+void Storage::set_latency(int ms) {
+    object_latency = ms;
+}
+
+bool Storage::copy(const string& from, const string& to) {
+    FileReader* input = of(from).open_range(from);
+    FileWriter* output = of(to).create(to, of(from).size(from));
+    bool ok = input->good() && output->good();
+    char* buffer = new char[OBJECT_PART];
+    while (ok) {
+        ssize_t n = input->read(buffer, OBJECT_PART);
+        if (n <= 0) {
+            ok = n == 0;
+            break;
+        }
+        ok = output->write(buffer, n);
+    }
+    ok = output->close() && ok;
+    delete[] buffer;
+    delete input;
+    delete output;
+    return ok;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "io_engine.hpp"
+
+#define OBJECT_PREFIX "object://"  // names in the object store, the rest of the name is where the stand-in keeps the object
+#define OBJECT_PART 8388608        // bytes per ranged GET and per part of a multipart PUT, 8 MB
+#define OBJECT_PARALLEL 4          // GETs in flight per reader, PUTs per writer
+#define OBJECT_LATENCY 20          // ms the stand-in takes per request, unless set
+
+// where the inputs and outputs of the sorts live: posix files, or objects of an object store.
+// the runs and parts stay in the scratch directories of the node
+class Storage {
+   public:
+    virtual ~Storage() {}
+    // the object store for names that start with object://, else the posix files
+    static Storage& of(const std::string& name);
+    // true for posix files, which can also be mapped and written in place
+    static bool local(const std::string& name);
+    // ms every request of the object store waits, like the round trip to a real one
+    static void set_latency(int ms);
+    // copy a file from one storage into another, false if a read or write failed
+    static bool copy(const std::string& from, const std::string& to);
+    virtual const char* name() = 0;
+    // bytes of the file, -1 if there is none
+    virtual long long size(const std::string& name) = 0;
+    // reads [begin, end) of the file front to back, end -1 reads to the end of the file
+    virtual FileReader* open_range(const std::string& name, long long begin = 0, long long end = -1) = 0;
+    // a new file written front to back, size is how much will be written if known
+    virtual FileWriter* create(const std::string& name, long long size = 0) = 0;
+    // the files whose names start with prefix
+    virtual std::vector<std::string> list(const std::string& prefix) = 0;
+    virtual bool remove(const std::string& name) = 0;
+};
@@ -0,0 +1,116 @@
+/**
+ * valsort-style summaries of sorted partitions.
+ * A slave summarizes its sorted part while it sends it, and the master
+ * combines the summaries of the parts in key order, checking the records on
+ * both sides of every boundary. That validates the whole output without
+ * reading it again, in the same way `valsort -s` validates partition summaries.
+ */
+#include "summary.hpp"
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+using namespace std;
+
+Summarizer::Summarizer() : filled(0) {
+    memset(&sum, 0, sizeof(sum));
+}
+
+void Summarizer::add(const char* record) {
+    if (sum.rec_count > 0) {
+        int diff = memcmp(sum.last_rec, record, SUMMARY_KEY);
+        if (diff == 0) {
+            sum.dup_count++;
+        } else if (diff > 0) {
+            if (sum.unordered_count == 0) {
+                sum.first_unordered = sum.rec_count;
+            }
+            sum.unordered_count++;
+        }
+    } else {
+        memcpy(sum.first_rec, record, SUMMARY_RECORD);
+    }
+    memcpy(sum.last_rec, record, SUMMARY_RECORD);
+    sum.checksum += crc32(0, (const Bytef*)record, SUMMARY_RECORD);
+    sum.rec_count++;
+}
+
+void Summarizer::update(const char* data, size_t len) {
+    // finish a record split by the previous call
+    while (filled > 0 && len > 0) {
+        size_t n = min(len, (size_t)(SUMMARY_RECORD - filled));
+        memcpy(partial + filled, data, n);
+        filled = (filled + n) % SUMMARY_RECORD;
+        data += n;
+        len -= n;
+        if (filled == 0) {
+            add(partial);
+        }
+    }
+    if (filled > 0) {
+        return;
+    }
+    for (; len >= SUMMARY_RECORD; data += SUMMARY_RECORD, len -= SUMMARY_RECORD) {
+        add(data);
+    }
+    memcpy(partial, data, len);
+    filled = len;
+}
+
+const Summary& Summarizer::summary() {
+    return sum;
+}
+
+uint64_t records_checksum(const char* data, size_t len) {
+    uint64_t checksum = 0;
+    for (; len >= SUMMARY_RECORD; data += SUMMARY_RECORD, len -= SUMMARY_RECORD) {
+        checksum += crc32(0, (const Bytef*)data, SUMMARY_RECORD);
+    }
+    return checksum;
+}
+
+void combine_summaries(Summary& total, const Summary& next) {
+    if (next.rec_count == 0) {
+        return;
+    }
+    if (total.rec_count == 0) {
+        total = next;
+        return;
+    }
+
+    // the first record of the next part compares to the last record of this one
+    int diff = memcmp(total.last_rec, next.first_rec, SUMMARY_KEY);
+    if (diff == 0) {
+        total.dup_count++;
+    } else if (diff > 0) {
+        if (total.unordered_count == 0) {
+            total.first_unordered = total.rec_count;
+        }
+        total.unordered_count++;
+    }
+    if (total.unordered_count == 0 && next.unordered_count > 0) {
+        total.first_unordered = total.rec_count + next.first_unordered;
+    }
+
+    total.unordered_count += next.unordered_count;
+    total.rec_count += next.rec_count;
+    total.dup_count += next.dup_count;
+    total.checksum += next.checksum;
+    memcpy(total.last_rec, next.last_rec, SUMMARY_RECORD);
+}
+
+bool print_summary(const Summary& sum) {
+    printf("Records: %llu\n", (unsigned long long)sum.rec_count);
+    printf("Checksum: %llx\n", (unsigned long long)sum.checksum);
+    if (sum.unordered_count > 0) {
+        printf("ERROR - there are %llu unordered records, the first is record %llu\n", (unsigned long long)sum.unordered_count,
+               (unsigned long long)sum.first_unordered);
+        return false;
+    }
+    printf("Duplicate keys: %llu\n", (unsigned long long)sum.dup_count);
+    printf("SUCCESS - all records are in order\n");
+    return true;
+}
\ No newline at end of file
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SUMMARY_RECORD 100  // record size
+#define SUMMARY_KEY 10      // records are in order by their first 10 bytes, like valsort checks
+
+// summary of a sorted partition, as in gensort's valsort
+struct Summary {
+    uint64_t first_unordered;  // index of the first unordered record, or 0
+    uint64_t unordered_count;
+    uint64_t rec_count;
+    uint64_t dup_count;  // records with the same key as the record before
+    uint64_t checksum;   // sum of the crc32 of all records, independent of the order
+    char first_rec[SUMMARY_RECORD];
+    char last_rec[SUMMARY_RECORD];
+};
+
+// summarizes a stream of records, records may be split between calls
+class Summarizer {
+   public:
+    Summarizer();
+    void update(const char* data, size_t len);
+    const Summary& summary();
+
+   private:
+    Summary sum;
+    char partial[SUMMARY_RECORD];
+    int filled;
+    void add(const char* record);
+};
+
+// checksum of whole records, to compare the input with the summary of the output
+uint64_t records_checksum(const char* data, size_t len);
+
+// append the summary of the next partition, checking the boundary between them
+void combine_summaries(Summary& total, const Summary& next);
+// print the verdict like valsort, return true if all records are in order
+bool print_summary(const Summary& sum);
\ No newline at end of file
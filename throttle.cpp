@@ -0,0 +1,103 @@
+/**
+ * Token bucket limits on the network and disk bandwidth of a sort.
+ * Every node has limits of its own, set on the command line, and every job
+ * has limits that its master sends to the slaves with the job. The limits of
+ * a running job can be changed through the service, the master then passes
+ * them on to the slaves in band, on the streams it sends and receives.
+ */
+#include "throttle.hpp"
+
+#include <algorithm>
+#include <thread>
+
+#define BURST_SECONDS 0.1  // bytes that may pass at once, in seconds at the current rate
+
+using namespace std;
+
+TokenBucket::TokenBucket() : rate(0), tokens(0), last(chrono::steady_clock::now()) {}
+
+void TokenBucket::set_rate(double rate) {
+    lock_guard<mutex> lock(mtx);
+    this->rate = rate;
+    tokens = min(tokens, rate * BURST_SECONDS);
+    last = chrono::steady_clock::now();
+}
+
+void TokenBucket::consume(size_t bytes) {
+    if (rate.load() == 0) {
+        return;
+    }
+
+    // take the bytes now and sleep off the debt, so large requests pass too
+    double wait;
+    {
+        lock_guard<mutex> lock(mtx);
+        double current = rate.load();
+        if (current == 0) {
+            return;
+        }
+        auto now = chrono::steady_clock::now();
+        tokens = min(tokens + chrono::duration<double>(now - last).count() * current, current * BURST_SECONDS);
+        last = now;
+        tokens -= bytes;
+        wait = tokens < 0 ? -tokens / current : 0;
+    }
+    if (wait > 0) {
+        this_thread::sleep_for(chrono::duration<double>(wait));
+    }
+}
+
+Throttle::Throttle(Throttle* parent) : parent(parent), current{0, 0}, changes(0) {}
+
+Throttle& Throttle::node() {
+    static Throttle throttle;
+    return throttle;
+}
+
+void Throttle::set_limits(const IoLimits& limits) {
+    lock_guard<mutex> lock(mtx);
+    if (limits.net_rate == current.net_rate && limits.disk_rate == current.disk_rate) {
+        return;
+    }
+    current = limits;
+    changes++;
+    net_bucket.set_rate(limits.net_rate * 1048576.0);
+    disk_bucket.set_rate(limits.disk_rate * 1048576.0);
+}
+
+IoLimits Throttle::limits() {
+    lock_guard<mutex> lock(mtx);
+    return current;
+}
+
+int Throttle::version() {
+    lock_guard<mutex> lock(mtx);
+    return changes;
+}
+
+void Throttle::net(size_t bytes) {
+    net_bucket.consume(bytes);
+    if (parent != nullptr) {
+        parent->net(bytes);
+    }
+}
+
+void Throttle::disk(size_t bytes) {
+    disk_bucket.consume(bytes);
+    if (parent != nullptr) {
+        parent->disk(bytes);
+    }
+}
+
+DiskMeter::DiskMeter(Throttle* throttle) : throttle(throttle), pending(0) {}
+
+DiskMeter::~DiskMeter() {
+    charge();
+}
+
+void DiskMeter::charge() {
+    if (throttle != nullptr && pending > 0) {
+        throttle->disk(pending);
+    }
+    pending = 0;
+}
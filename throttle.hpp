@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+
+#define DISK_CHARGE_BLOCK 262144  // 256 KB, bytes of record sized io charged to the disk limits at a time
+
+// rates in MB/s, 0 for no limit
+struct IoLimits {
+    uint32_t net_rate;   // data frames sent and received
+    uint32_t disk_rate;  // scratch files read and written
+};
+
+// lets bytes through at a fixed rate, with bursts of up to a tenth of a second
+class TokenBucket {
+   public:
+    TokenBucket();
+    // bytes per second, 0 for no limit
+    void set_rate(double rate);
+    // wait until the bytes may pass
+    void consume(size_t bytes);
+
+   private:
+    std::mutex mtx;
+    std::atomic<double> rate;
+    double tokens;
+    std::chrono::steady_clock::time_point last;
+};
+
+// network and disk limits of a job, every job also takes from the limits of its node
+class Throttle {
+   public:
+    Throttle(Throttle* parent = nullptr);
+    // the limits of this process
+    static Throttle& node();
+    void set_limits(const IoLimits& limits);
+    IoLimits limits();
+    // changes whenever the limits change, so the new limits can be passed on to the peers
+    int version();
+    void net(size_t bytes);
+    void disk(size_t bytes);
+
+   private:
+    Throttle* parent;
+    std::mutex mtx;
+    IoLimits current;
+    int changes;
+    TokenBucket net_bucket;
+    TokenBucket disk_bucket;
+};
+
+// adds up the bytes of record sized reads and writes and charges them to a throttle a block at a time,
+// so a merge does not take the locks of the buckets for every record
+class DiskMeter {
+   public:
+    DiskMeter(Throttle* throttle);
+    // charges what is left
+    ~DiskMeter();
+    void add(size_t bytes) {
+        pending += bytes;
+        if (pending >= DISK_CHARGE_BLOCK) {
+            charge();
+        }
+    }
+    void charge();
+
+   private:
+    Throttle* throttle;
+    size_t pending;
+};
@@ -0,0 +1,182 @@
+/**
+ * Timeline of a distributed sort.
+ * Every node records the phases and transfers of a job as spans on its own
+ * monotonic clock. Before the job the master pings each slave a few times to
+ * estimate the offset of its clock, and at the end the slaves send their spans
+ * along with the result. The master shifts them onto its own clock and writes
+ * one chrome trace, which chrome://tracing and Perfetto open.
+ */
+#include "trace.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+
+#include "transfer.hpp"
+
+#define CLOCK_ROUNDS 4  // pings per clock offset estimate
+
+using namespace std;
+
+int64_t trace_clock() {
+    return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+Tracer::Tracer() : on(false), node(-1) {}
+
+void Tracer::start(bool enabled, int node) {
+    lock_guard<mutex> lock(mtx);
+    on = enabled;
+    this->node = node;
+    list.clear();
+    threads.clear();
+}
+
+bool Tracer::enabled() {
+    lock_guard<mutex> lock(mtx);
+    return on;
+}
+
+void Tracer::add(const string& name, const char* category, int64_t start, int64_t end, uint64_t bytes) {
+    lock_guard<mutex> lock(mtx);
+    if (!on) {
+        return;
+    }
+    TraceSpan span;
+    memset(&span, 0, sizeof(span));
+    strncpy(span.name, name.c_str(), TRACE_NAME - 1);
+    strncpy(span.category, category, sizeof(span.category) - 1);
+    span.node = node;
+    // the threads of a node get lanes in the order they record their first span
+    auto it = threads.find(this_thread::get_id());
+    if (it == threads.end()) {
+        it = threads.insert(make_pair(this_thread::get_id(), (int)threads.size())).first;
+    }
+    span.thread = it->second;
+    span.start = start;
+    span.duration = end - start;
+    span.bytes = bytes;
+    list.push_back(span);
+}
+
+void Tracer::add_spans(const vector<TraceSpan>& spans) {
+    lock_guard<mutex> lock(mtx);
+    if (on) {
+        list.insert(list.end(), spans.begin(), spans.end());
+    }
+}
+
+vector<TraceSpan> Tracer::spans() {
+    lock_guard<mutex> lock(mtx);
+    return list;
+}
+
+TraceScope::TraceScope(Tracer& tracer, const string& name, const char* category)
+    : tracer(tracer), name(name), category(category), start(trace_clock()), bytes(0) {}
+
+TraceScope::~TraceScope() {
+    tracer.add(name, category, start, trace_clock(), bytes);
+}
+
+void TraceScope::add_bytes(uint64_t bytes) {
+    this->bytes += bytes;
+}
+
+bool measure_clock_offset(int fd, int64_t& offset) {
+    int64_t best = -1;
+    for (int i = 0; i < CLOCK_ROUNDS; i++) {
+        int64_t sent = trace_clock();
+        FrameHeader header;
+        vector<char> payload;
+        if (!send_frame(fd, FRAME_CLOCK, &sent, sizeof(sent)) || !recv_frame(fd, header, payload) ||
+            header.type != FRAME_CLOCK || payload.size() != sizeof(int64_t)) {
+            return false;
+        }
+        int64_t received = trace_clock();
+        int64_t peer;
+        memcpy(&peer, payload.data(), sizeof(peer));
+        // the peer read its clock about half way through the round trip
+        if (best < 0 || received - sent < best) {
+            best = received - sent;
+            offset = peer - (sent + received) / 2;
+        }
+    }
+    return true;
+}
+
+bool answer_clock(int fd) {
+    int64_t now = trace_clock();
+    return send_frame(fd, FRAME_CLOCK, &now, sizeof(now));
+}
+
+static string json_escape(const char* text) {
+    string out;
+    for (const char* c = text; *c != 0; c++) {
+        if (*c == '"' || *c == '\\') {
+            out += '\\';
+        }
+        out += *c;
+    }
+    return out;
+}
+
+bool write_trace(const string& path, const vector<TraceSpan>& spans, const vector<int64_t>& offsets) {
+    // everything on the clock of the master, starting at the first span
+    vector<TraceSpan> timeline = spans;
+    int64_t first = 0;
+    int max_node = -1;
+    for (int i = 0; i < timeline.size(); i++) {
+        TraceSpan& span = timeline[i];
+        if (span.node >= 0 && span.node < offsets.size()) {
+            span.start -= offsets[span.node];
+        }
+        first = i == 0 ? span.start : min(first, span.start);
+        max_node = max(max_node, (int)span.node);
+    }
+
+    ofstream output(path, ios::out | ios::trunc);
+    if (!output.good()) {
+        return false;
+    }
+    output << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    // one process per node, the master first
+    for (int node = -1; node <= max_node; node++) {
+        string name = node < 0 ? "master" : "slave " + to_string(node);
+        output << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << node + 1 << ",\"args\":{\"name\":\"" << name
+               << "\"}},\n";
+        output << "{\"name\":\"process_sort_index\",\"ph\":\"M\",\"pid\":" << node + 1 << ",\"args\":{\"sort_index\":" << node + 1
+               << "}},\n";
+    }
+    for (int i = 0; i < timeline.size(); i++) {
+        const TraceSpan& span = timeline[i];
+        output << "{\"name\":\"" << json_escape(span.name) << "\",\"cat\":\"" << json_escape(span.category)
+               << "\",\"ph\":\"X\",\"pid\":" << span.node + 1 << ",\"tid\":" << span.thread << ",\"ts\":" << span.start - first
+               << ",\"dur\":" << span.duration << ",\"args\":{\"bytes\":" << span.bytes << "}}"
+               << (i + 1 < timeline.size() ? ",\n" : "\n");
+    }
+    output << "]}\n";
+    output.close();
+
+    // when each node was done, and how long it spent on the network, disks and cpus
+    for (int node = -1; node <= max_node; node++) {
+        int64_t done = 0, net = 0, disk = 0, cpu = 0;
+        for (int i = 0; i < timeline.size(); i++) {
+            const TraceSpan& span = timeline[i];
+            if (span.node != node) {
+                continue;
+            }
+            done = max(done, span.start + span.duration - first);
+            if (strcmp(span.category, "net") == 0) {
+                net += span.duration;
+            } else if (strcmp(span.category, "disk") == 0) {
+                disk += span.duration;
+            } else if (strcmp(span.category, "cpu") == 0) {
+                cpu += span.duration;
+            }
+        }
+        printf("Trace %s%s: done at %.2f s, net %.2f s, disk %.2f s, cpu %.2f s\n", node < 0 ? "master" : "slave ",
+               node < 0 ? "" : to_string(node).c_str(), done / 1e6, net / 1e6, disk / 1e6, cpu / 1e6);
+    }
+    return output.good();
+}
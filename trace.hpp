@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define TRACE_NAME 32  // bytes of a span name, with the terminating zero
+
+// a timed phase or transfer of one node, sent to the master at the end of the job
+struct TraceSpan {
+    char name[TRACE_NAME];
+    char category[8];  // net, disk or cpu, or job for the whole job
+    int32_t node;      // -1 for the master, else the slave id
+    int32_t thread;    // lane of the span within its node
+    int64_t start;     // microseconds on the clock of the node
+    int64_t duration;  // microseconds
+    uint64_t bytes;    // moved during the span, 0 if none
+};
+
+// microseconds on the monotonic clock of this node
+int64_t trace_clock();
+
+// collects the spans of one job on one node
+class Tracer {
+   public:
+    Tracer();
+    // forget the spans of the last job, record nothing unless enabled
+    void start(bool enabled, int node);
+    bool enabled();
+    void add(const std::string& name, const char* category, int64_t start, int64_t end, uint64_t bytes = 0);
+    // spans recorded by other nodes, passed on as they are
+    void add_spans(const std::vector<TraceSpan>& spans);
+    std::vector<TraceSpan> spans();
+
+   private:
+    std::mutex mtx;
+    bool on;
+    int node;
+    std::vector<TraceSpan> list;
+    std::map<std::thread::id, int> threads;
+};
+
+// records a span from its construction to its destruction
+class TraceScope {
+   public:
+    TraceScope(Tracer& tracer, const std::string& name, const char* category);
+    ~TraceScope();
+    void add_bytes(uint64_t bytes);
+
+   private:
+    Tracer& tracer;
+    std::string name;
+    const char* category;
+    int64_t start;
+    uint64_t bytes;
+};
+
+// ping the peer a few times and estimate its clock minus ours from the fastest round trip
+bool measure_clock_offset(int fd, int64_t& offset);
+// answer a ping of measure_clock_offset
+bool answer_clock(int fd);
+
+// write the spans as a chrome trace, the clock of slave i shifted back by offsets[i]
+bool write_trace(const std::string& path, const std::vector<TraceSpan>& spans, const std::vector<int64_t>& offsets);
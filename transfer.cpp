@@ -0,0 +1,541 @@
+/**
+ * Framed data transfer between master and slaves.
+ * A data stream is split into frames so the payload can be compressed
+ * frame by frame. In auto mode the writer measures the compressor and the
+ * network, and only compresses while compressing and sending the smaller
+ * frame is faster than sending the raw frame.
+ * When the peer is on the same host the payloads go through a shared memory
+ * ring instead, uncompressed.
+ * Every frame carries the crc32c of its payload, and the end frame a crc32c
+ * over the frame checksums, so lost or repeated frames are caught as well.
+ * A header whose lengths or codec no sender writes fails the stream, before
+ * anything is allocated for its payload.
+ * The receiver answers the end frame with the number of corrupt frames, and
+ * the sender sends the stream again if there were any.
+ * A throttled stream holds its data frames to the network limits of the job
+ * and passes changed limits on in band, in either direction.
+ */
+#include "transfer.hpp"
+
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "crc32c.hpp"
+
+#define PROBE_INTERVAL 64  // frames sent raw before compression is tried again
+#define RATE_WEIGHT 0.2    // weight of the newest sample in the moving averages
+
+using namespace std;
+
+int parse_compress_mode(const string& mode) {
+    if (mode == "on") return COMPRESS_ON;
+    if (mode == "auto") return COMPRESS_AUTO;
+    if (mode == "off") return COMPRESS_OFF;
+    return -1;
+}
+
+bool send_all(int fd, const void* buf, size_t len) {
+    const char* p = (const char*)buf;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool recv_all(int fd, void* buf, size_t len) {
+    char* p = (char*)buf;
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool send_header(int fd, int type, int codec, uint32_t raw_len, uint32_t wire_len, uint32_t crc, int flags = 0) {
+    FrameHeader header;
+    header.type = type;
+    header.codec = codec;
+    header.flags = flags;
+    header.raw_len = htonl(raw_len);
+    header.wire_len = htonl(wire_len);
+    header.crc = htonl(crc);
+    return send_all(fd, &header, sizeof(header));
+}
+
+bool send_frame(int fd, int type, const void* payload, uint32_t len) {
+    if (!send_header(fd, type, CODEC_NONE, len, len, crc32c(0, payload, len))) {
+        return false;
+    }
+    return len == 0 || send_all(fd, payload, len);
+}
+
+// a corrupt data frame only spoils its stream, which is sent again
+static bool check_frame(FrameHeader& header, const vector<char>& payload) {
+    if (crc32c(0, payload.data(), payload.size()) == header.crc) {
+        return true;
+    }
+    printf("Checksum mismatch in frame of type %d, %u bytes.\n", header.type, header.raw_len);
+    header.flags |= FLAG_CORRUPT;
+    return header.type == FRAME_DATA;
+}
+
+// the checksums only cover the payload, so a damaged header is caught by its lengths:
+// data frames hold at most FRAME_SIZE bytes, only they may be compressed, and a raw
+// payload is as long on the wire as decoded
+static bool check_header(const FrameHeader& header) {
+    bool valid = header.type >= FRAME_DATA && header.type <= FRAME_TRACE;
+    if (header.type == FRAME_DATA) {
+        valid = valid && header.raw_len <= FRAME_SIZE && header.wire_len <= compressBound(FRAME_SIZE) &&
+                (header.codec == CODEC_NONE || header.codec == CODEC_ZLIB);
+    } else {
+        valid = valid && header.raw_len <= MAX_CONTROL_SIZE && header.codec == CODEC_NONE;
+    }
+    valid = valid && (header.codec != CODEC_NONE || header.wire_len == header.raw_len);
+    if (!valid) {
+        printf("Fail to receive frame, damaged header: type %d, codec %d, %u bytes, %u on the wire.\n", header.type, header.codec,
+               header.raw_len, header.wire_len);
+    }
+    return valid;
+}
+
+bool recv_frame(int fd, FrameHeader& header, vector<char>& payload, ShmRing* ring) {
+    if (!recv_all(fd, &header, sizeof(header))) {
+        return false;
+    }
+    header.raw_len = ntohl(header.raw_len);
+    header.wire_len = ntohl(header.wire_len);
+    header.crc = ntohl(header.crc);
+    if (!check_header(header)) {
+        return false;
+    }
+    bool in_ring = header.flags & FLAG_RING;
+    if (in_ring && ring == nullptr) {
+        printf("Fail to receive frame, no shared memory ring.\n");
+        return false;
+    }
+
+    if (header.codec == CODEC_NONE) {
+        payload.resize(header.wire_len);
+        if (in_ring) {
+            ring->get(payload.data(), header.wire_len);
+        } else if (header.wire_len > 0 && !recv_all(fd, payload.data(), header.wire_len)) {
+            return false;
+        }
+        return check_frame(header, payload);
+    }
+
+    vector<char> wire(header.wire_len);
+    if (in_ring) {
+        ring->get(wire.data(), header.wire_len);
+    } else if (!recv_all(fd, wire.data(), header.wire_len)) {
+        return false;
+    }
+    payload.resize(header.raw_len);
+    uLongf raw_len = header.raw_len;
+    if (uncompress((Bytef*)payload.data(), &raw_len, (const Bytef*)wire.data(), header.wire_len) != Z_OK || raw_len != header.raw_len) {
+        // a damaged compressed payload counts as a checksum mismatch
+        payload.clear();
+    }
+    return check_frame(header, payload);
+}
+
+FrameWriter::FrameWriter(int fd, int compress_mode)
+    : fd(fd),
+      compress_mode(compress_mode),
+      flow_control(false),
+      granted(0),
+      sent(0),
+      compressing(compress_mode != COMPRESS_OFF),
+      probe_countdown(0),
+      buffer(FRAME_SIZE),
+      used(0),
+      net_rate(0),
+      zip_rate(0),
+      raw_bytes(0),
+      wire_bytes(0),
+      zip_frames(0),
+      frames(0),
+      ring(nullptr),
+      ring_checked(false),
+      stream_crc(0),
+      rejected(0),
+      throttle(nullptr),
+      limits_version(0) {
+    if (compress_mode != COMPRESS_OFF) {
+        zbuffer.resize(compressBound(FRAME_SIZE));
+    }
+}
+
+FrameWriter::~FrameWriter() {
+    delete ring;
+}
+
+// take over the limits the peer passed on, and remember that it knows them
+static bool apply_limits(Throttle* throttle, const vector<char>& payload, int& limits_version) {
+    if (payload.size() != sizeof(IoLimits)) {
+        return false;
+    }
+    if (throttle != nullptr) {
+        throttle->set_limits(*(const IoLimits*)payload.data());
+        limits_version = throttle->version();
+    }
+    return true;
+}
+
+// pass the limits on if they changed since the peer heard of them
+static bool send_limits(int fd, Throttle* throttle, int& limits_version) {
+    if (throttle == nullptr || throttle->version() == limits_version) {
+        return true;
+    }
+    limits_version = throttle->version();
+    IoLimits limits = throttle->limits();
+    return send_frame(fd, FRAME_LIMITS, &limits, sizeof(limits));
+}
+
+static double update_rate(double rate, double sample) {
+    return rate == 0 ? sample : rate * (1 - RATE_WEIGHT) + sample * RATE_WEIGHT;
+}
+
+bool FrameWriter::flush() {
+    if (used == 0) {
+        return true;
+    }
+
+    // a peer on this host gets the payloads through shared memory, compressing them would only cost time
+    if (!ring_checked) {
+        ring_checked = true;
+        string name;
+        if (is_unix_socket(fd) && (ring = ShmRing::create(name)) != nullptr) {
+            if (!send_frame(fd, FRAME_RING, name.data(), name.size())) {
+                return false;
+            }
+            compress_mode = COMPRESS_OFF;
+        }
+    }
+
+    const char* payload = buffer.data();
+    uint32_t wire_len = used;
+    uint32_t crc = crc32c(0, buffer.data(), used);
+    uint32_t net_crc = htonl(crc);
+    stream_crc = crc32c(stream_crc, &net_crc, sizeof(net_crc));
+    int codec = CODEC_NONE;
+    double zip_seconds = 0;
+
+    bool try_zip = compress_mode == COMPRESS_ON || (compress_mode == COMPRESS_AUTO && (compressing || probe_countdown == 0));
+    if (try_zip) {
+        auto start = chrono::high_resolution_clock::now();
+        uLongf zlen = zbuffer.size();
+        int rc = compress2((Bytef*)zbuffer.data(), &zlen, (const Bytef*)buffer.data(), used, Z_BEST_SPEED);
+        zip_seconds = chrono::duration<double>(chrono::high_resolution_clock::now() - start).count();
+        if (zip_seconds > 0) {
+            zip_rate = update_rate(zip_rate, used / zip_seconds);
+        }
+        // only use the compressed payload if it is smaller
+        if (rc == Z_OK && zlen < used) {
+            payload = zbuffer.data();
+            wire_len = zlen;
+            codec = CODEC_ZLIB;
+            zip_frames++;
+        }
+    }
+
+    // wait until the receiver has room for the frame
+    if (!poll_receiver()) {
+        return false;
+    }
+    while (flow_control && sent + wire_len > granted) {
+        FrameHeader header;
+        vector<char> payload;
+        if (!recv_frame(fd, header, payload) || !handle_frame(header, payload)) {
+            return false;
+        }
+    }
+    sent += wire_len;
+    if (throttle != nullptr) {
+        if (!send_limits(fd, throttle, limits_version)) {
+            return false;
+        }
+        throttle->net(wire_len);
+    }
+
+    auto start = chrono::high_resolution_clock::now();
+    if (ring != nullptr) {
+        if (!ring->put(fd, payload, wire_len) || !send_header(fd, FRAME_DATA, codec, used, wire_len, crc, FLAG_RING)) {
+            return false;
+        }
+    } else if (!send_header(fd, FRAME_DATA, codec, used, wire_len, crc) || !send_all(fd, payload, wire_len)) {
+        return false;
+    }
+    double send_seconds = chrono::duration<double>(chrono::high_resolution_clock::now() - start).count();
+    if (send_seconds > 0) {
+        net_rate = update_rate(net_rate, wire_len / send_seconds);
+    }
+
+    if (compress_mode == COMPRESS_AUTO) {
+        if (try_zip) {
+            // compression pays off if the time it saves on the wire is more than the time it costs
+            double saved = net_rate > 0 ? (double)(used - wire_len) / net_rate : 0;
+            double cost = zip_rate > 0 ? used / zip_rate : 0;
+            compressing = saved > cost;
+            if (!compressing) {
+                probe_countdown = PROBE_INTERVAL;
+            }
+        } else {
+            probe_countdown--;
+        }
+    }
+
+    raw_bytes += used;
+    wire_bytes += wire_len;
+    frames++;
+    used = 0;
+    return true;
+}
+
+// credits and limits the receiver sends while we send
+bool FrameWriter::handle_frame(const FrameHeader& header, const vector<char>& payload) {
+    if (header.type == FRAME_CREDIT && payload.size() == sizeof(long long)) {
+        granted += *(const long long*)payload.data();
+        return true;
+    }
+    if (header.type == FRAME_LIMITS) {
+        return apply_limits(throttle, payload, limits_version);
+    }
+    return false;
+}
+
+// a throttled stream may get new limits from the receiver at any time, so look for them without waiting
+bool FrameWriter::poll_receiver() {
+    if (throttle == nullptr) {
+        return true;
+    }
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN)) {
+        FrameHeader header;
+        vector<char> payload;
+        if (!recv_frame(fd, header, payload) || !handle_frame(header, payload)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool FrameWriter::write(const char* data, size_t len) {
+    while (len > 0) {
+        size_t n = min(len, (size_t)FRAME_SIZE - used);
+        memcpy(buffer.data() + used, data, n);
+        used += n;
+        data += n;
+        len -= n;
+        if (used == FRAME_SIZE && !flush()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool FrameWriter::finish() {
+    if (!flush()) {
+        return false;
+    }
+    uint32_t crc = htonl(stream_crc);
+    if (!send_frame(fd, FRAME_END, &crc, sizeof(crc))) {
+        return false;
+    }
+
+    // the receiver answers with the number of corrupt frames. this also keeps us
+    // from closing with unread credits, which would reset the connection and drop
+    // data the receiver has not read yet
+    FrameHeader header;
+    vector<char> payload;
+    do {
+        if (!recv_frame(fd, header, payload)) {
+            return false;
+        }
+        if (header.type == FRAME_LIMITS && !apply_limits(throttle, payload, limits_version)) {
+            return false;
+        }
+    } while (header.type == FRAME_CREDIT || header.type == FRAME_LIMITS);
+    if (header.type != FRAME_END || payload.size() != sizeof(uint32_t)) {
+        return false;
+    }
+    rejected = ntohl(*(uint32_t*)payload.data());
+    return true;
+}
+
+bool FrameWriter::verified() {
+    return rejected == 0;
+}
+
+int FrameWriter::corrupt_frames() {
+    return rejected;
+}
+
+void FrameWriter::set_flow_control(bool enabled) {
+    flow_control = enabled;
+}
+
+void FrameWriter::set_throttle(Throttle* throttle, bool pass_on) {
+    this->throttle = throttle;
+    limits_version = throttle != nullptr && !pass_on ? throttle->version() : -1;
+}
+
+void FrameWriter::print_stats(const char* name) {
+    if (compress_mode == COMPRESS_OFF || raw_bytes == 0) {
+        return;
+    }
+    printf("%s: %.2f MB sent as %.2f MB (%.1f%%), %lld of %lld frames compressed.\n", name, raw_bytes / 1024.0 / 1024.0,
+           wire_bytes / 1024.0 / 1024.0, wire_bytes * 100.0 / raw_bytes, zip_frames, frames);
+}
+
+FrameReader::FrameReader(int fd)
+    : fd(fd),
+      finished(false),
+      window(0),
+      ungranted(0),
+      offset(0),
+      ring(nullptr),
+      stream_crc(0),
+      corrupt(0),
+      throttle(nullptr),
+      limits_version(0) {}
+FrameReader::~FrameReader() {
+    delete ring;
+}
+
+bool FrameReader::set_flow_control(long long window) {
+    this->window = window;
+    return send_frame(fd, FRAME_CREDIT, &window, sizeof(window));
+}
+
+ssize_t FrameReader::read(char* buf, size_t len) {
+    while (offset == payload.size()) {
+        if (finished) {
+            return 0;
+        }
+        if (!send_limits(fd, throttle, limits_version)) {
+            return -1;
+        }
+        FrameHeader header;
+        if (!recv_frame(fd, header, payload, ring)) {
+            return -1;
+        }
+        offset = 0;
+        if (header.type == FRAME_LIMITS) {
+            if (!apply_limits(throttle, payload, limits_version)) {
+                return -1;
+            }
+            payload.clear();
+            continue;
+        }
+        if (header.type == FRAME_RING) {
+            ring = ShmRing::open(string(payload.begin(), payload.end()));
+            payload.clear();
+            if (ring == nullptr) {
+                printf("Fail to open shared memory ring.\n");
+                return -1;
+            }
+            continue;
+        }
+        if (window > 0 && header.type == FRAME_DATA) {
+            // hand the consumed bytes back to the sender in batches
+            ungranted += header.wire_len;
+            if (ungranted >= window / 2) {
+                if (!send_frame(fd, FRAME_CREDIT, &ungranted, sizeof(ungranted))) {
+                    return -1;
+                }
+                ungranted = 0;
+            }
+        }
+        if (header.type == FRAME_DATA && throttle != nullptr) {
+            throttle->net(header.wire_len);
+        }
+        if (header.type == FRAME_DATA) {
+            // a corrupt frame is dropped, the sender sends the whole stream again
+            if (header.flags & FLAG_CORRUPT) {
+                corrupt++;
+                payload.clear();
+            }
+            uint32_t net_crc = htonl(header.crc);
+            stream_crc = crc32c(stream_crc, &net_crc, sizeof(net_crc));
+        } else if (header.type == FRAME_END) {
+            finished = true;
+            if (payload.size() != sizeof(uint32_t) || ntohl(*(uint32_t*)payload.data()) != stream_crc) {
+                printf("Checksum mismatch at the end of stream, frames were lost.\n");
+                corrupt++;
+            }
+            payload.clear();
+            uint32_t verdict = htonl(corrupt);
+            if (!send_frame(fd, FRAME_END, &verdict, sizeof(verdict))) {
+                return -1;
+            }
+        } else {
+            printf("Unexpected frame type %d.\n", header.type);
+            return -1;
+        }
+    }
+    size_t n = min(len, payload.size() - offset);
+    memcpy(buf, payload.data() + offset, n);
+    offset += n;
+    return n;
+}
+
+void FrameReader::set_throttle(Throttle* throttle, bool pass_on) {
+    this->throttle = throttle;
+    limits_version = throttle != nullptr && !pass_on ? throttle->version() : -1;
+}
+
+bool FrameReader::verified() {
+    return finished && corrupt == 0;
+}
+
+int FrameReader::corrupt_frames() {
+    return corrupt;
+}
+
+BlockQueue::BlockQueue(size_t capacity) : capacity(capacity), closed(false) {}
+BlockQueue::~BlockQueue() {}
+
+void BlockQueue::push(vector<char>&& block) {
+    unique_lock<mutex> lock(mtx);
+    cv.wait(lock, [this] { return blocks.size() < capacity; });
+    blocks.push_back(move(block));
+    cv.notify_all();
+}
+
+bool BlockQueue::pop(vector<char>& block) {
+    unique_lock<mutex> lock(mtx);
+    cv.wait(lock, [this] { return !blocks.empty() || closed; });
+    if (blocks.empty()) {
+        return false;
+    }
+    block = move(blocks.front());
+    blocks.pop_front();
+    cv.notify_all();
+    return true;
+}
+
+void BlockQueue::close() {
+    lock_guard<mutex> lock(mtx);
+    closed = true;
+    cv.notify_all();
+}
@@ -0,0 +1,228 @@
+#pragma once
+
+#include <limits.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "local_transport.hpp"
+#include "throttle.hpp"
+
+#define FRAME_SIZE 262144          // 256 KB of raw data per frame
+#define CREDIT_WINDOW 4194304      // 4 MB in flight per flow controlled stream
+#define MAX_RETRANSMITS 3          // times a corrupt stream is sent again
+#define MAX_CONTROL_SIZE 67108864  // 64 MB, largest payload of the other frames, like traces and sketches
+
+// frame types on the master <-> slave connections
+enum FrameType {
+    FRAME_DATA = 1,       // a chunk of records (maybe compressed)
+    FRAME_END = 2,        // end of the data stream
+    FRAME_JOB = 3,        // job header sent by the master before the shard
+    FRAME_HELLO = 4,      // sent by a slave when it connects to the master
+    FRAME_RESULT = 5,     // sent by a slave before its sorted result
+    FRAME_PEERS = 6,      // addresses of all slaves, for the exchange mode
+    FRAME_SKETCH = 7,     // quantile sketch of a slave's shard
+    FRAME_SPLITTERS = 8,  // key ranges of the slaves, for the exchange mode
+    FRAME_CREDIT = 9,     // receiver allows the sender to send more bytes
+    FRAME_SUBMIT = 10,    // job submitted by a client of the sort service
+    FRAME_STATUS = 11,    // text status of a submitted job, sent to the client
+    FRAME_RING = 12,      // name of the shared memory ring carrying the payloads of this stream
+    FRAME_SUMMARY = 13,   // valsort-style summary of a sorted result, sent after it
+    FRAME_LIMITS = 14,    // new io limits of the job, passed on in band, or asked of the service
+    FRAME_CLOCK = 15,     // clock of the sender in microseconds, to estimate the offset between nodes
+    FRAME_TRACE = 16,     // spans of a slave and its children, sent after the summary
+};
+
+// FrameHeader flags
+#define FLAG_RING 1     // the payload is in the shared memory ring, not on the socket
+#define FLAG_CORRUPT 2  // set by recv_frame when the payload does not match its checksum
+
+// codec of the frame payload
+enum Codec {
+    CODEC_NONE = 0,
+    CODEC_ZLIB = 1,
+};
+
+// compression mode of a data stream
+enum CompressMode {
+    COMPRESS_OFF = 0,   // never compress
+    COMPRESS_ON = 1,    // always compress
+    COMPRESS_AUTO = 2,  // compress only while it makes the transfer faster
+};
+
+struct FrameHeader {
+    uint8_t type;
+    uint8_t codec;
+    uint16_t flags;
+    uint32_t raw_len;   // payload length after decoding
+    uint32_t wire_len;  // payload length on the wire
+    uint32_t crc;       // crc32c of the decoded payload
+};
+
+// sent by the master in a FRAME_JOB before the shard
+struct JobHeader {
+    uint32_t slave_id;
+    uint32_t compress;     // CompressMode the slave uses to send the result back
+    uint32_t parent_ip;    // where to send the result, in network byte order
+    uint32_t parent_port;  // 0 if the result goes to the master
+    uint32_t children;     // number of slaves sending their result to this slave
+    uint32_t exchange;     // slaves exchange key ranges with each other before sorting
+    uint32_t key_only;     // the part is (key, record id) tuples and the result only the ids
+    uint32_t elastic;      // the result goes back over the job connection
+    IoLimits limits;       // of the job when it starts
+    uint32_t trace;        // record spans and send them after the result
+    uint32_t job_id;       // tells the results of this job from late ones of an earlier, failed job
+};
+
+struct PeerAddress {
+    uint32_t ip;  // in network byte order
+    uint32_t port;
+};
+
+// sent by a slave when it connects to the master
+struct SlaveHello {
+    uint32_t listen_port;  // port other slaves can send their results to
+    uint32_t persistent;   // keeps the connection open and runs one job after the other
+};
+
+// sent by a slave in a FRAME_RESULT before its sorted result
+struct ResultHeader {
+    uint32_t slave_id;
+    uint32_t job_id;  // of the JobHeader
+};
+
+// sent by a client of the sort service in a FRAME_SUBMIT
+struct JobRequest {
+    char input[PATH_MAX];
+    char output[PATH_MAX];
+    uint32_t workers;  // 0 lets the service decide from the input size
+    uint32_t compress;
+    uint32_t merge_fanin;
+    uint32_t range_partition;
+    uint32_t exchange;
+    uint32_t key_only;
+    IoLimits limits;
+    char trace[PATH_MAX];  // where to write the timeline of the job, empty for none
+};
+
+// sent by a client to the sort service in a FRAME_LIMITS
+struct LimitsRequest {
+    int32_t job_id;  // -1 for the limits of the service node
+    IoLimits limits;
+};
+
+struct TransferOptions {
+    int compress = COMPRESS_OFF;
+};
+
+int parse_compress_mode(const std::string& mode);
+
+// send/receive exactly len bytes, return false on error or end of stream
+bool send_all(int fd, const void* buf, size_t len);
+bool recv_all(int fd, void* buf, size_t len);
+
+// send a single uncompressed frame
+bool send_frame(int fd, int type, const void* payload, uint32_t len);
+// receive a single frame, the payload is decoded and checked,
+// a corrupt data frame is flagged, any other corrupt frame is an error,
+// and so is a header no sender writes, since the stream cannot be followed past it
+bool recv_frame(int fd, FrameHeader& header, std::vector<char>& payload, ShmRing* ring = nullptr);
+
+// splits a data stream into frames and sends them
+class FrameWriter {
+   public:
+    FrameWriter(int fd, int compress_mode);
+    ~FrameWriter();
+    bool write(const char* data, size_t len);
+    // flush the buffered data, send the end frame and wait for the receiver to check the stream
+    bool finish();
+    // after finish: the receiver found no corrupt frames, otherwise the stream should be sent again
+    bool verified();
+    int corrupt_frames();
+    void print_stats(const char* name);
+    // only send what the receiver gave credit for
+    void set_flow_control(bool enabled);
+    // hold the data frames to the network limits, and pass changed limits on to the receiver,
+    // pass_on: the receiver may not know the current limits yet
+    void set_throttle(Throttle* throttle, bool pass_on = false);
+
+   private:
+    int fd;
+    int compress_mode;
+    bool flow_control;
+    long long granted;
+    long long sent;
+    bool compressing;
+    int probe_countdown;
+    std::vector<char> buffer;
+    size_t used;
+    std::vector<char> zbuffer;
+    double net_rate;  // bytes/s put on the wire
+    double zip_rate;  // bytes/s through the compressor
+    long long raw_bytes;
+    long long wire_bytes;
+    long long zip_frames;
+    long long frames;
+    ShmRing* ring;  // set up with the first frame when the peer is on this host
+    bool ring_checked;
+    uint32_t stream_crc;  // crc32c over the frame checksums
+    int rejected;         // corrupt frames reported by the receiver
+    Throttle* throttle;
+    int limits_version;  // of the limits the receiver knows
+    bool flush();
+    bool handle_frame(const FrameHeader& header, const std::vector<char>& payload);
+    bool poll_receiver();
+};
+
+// reassembles a data stream from frames
+class FrameReader {
+   public:
+    FrameReader(int fd);
+    ~FrameReader();
+    // return the number of bytes read, 0 at the end of stream, -1 on error
+    ssize_t read(char* buf, size_t len);
+    // give the sender credit for window bytes, and more as they are consumed
+    bool set_flow_control(long long window);
+    // after the end of stream: every frame matched its checksum, otherwise the sender sends the stream again
+    bool verified();
+    int corrupt_frames();
+    // hold the data frames to the network limits, and pass changed limits on to the sender
+    void set_throttle(Throttle* throttle, bool pass_on = false);
+
+   private:
+    int fd;
+    bool finished;
+    long long window;
+    long long ungranted;
+    std::vector<char> payload;
+    size_t offset;
+    ShmRing* ring;
+    uint32_t stream_crc;
+    int corrupt;
+    Throttle* throttle;
+    int limits_version;
+};
+
+// bounded queue of data blocks handed over to a sending thread
+class BlockQueue {
+   public:
+    BlockQueue(size_t capacity);
+    ~BlockQueue();
+    // wait while the queue is full
+    void push(std::vector<char>&& block);
+    // wait for a block, return false once the queue is closed and empty
+    bool pop(std::vector<char>& block);
+    void close();
+
+   private:
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<std::vector<char>> blocks;
+    size_t capacity;
+    bool closed;
+};
\ No newline at end of file